@@ -16,6 +16,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 #include "alertconfiguration.h"
+#include "luabytecodecache.h"
 #include "normalrule.h"
 #include "regexrule.h"
 #include "thresholdrulecomplex.h"
@@ -125,9 +126,9 @@ std::set<std::string> AlertConfiguration::readConfiguration(void)
         if (!std::filesystem::exists(_path)) {
             std::filesystem::create_directories(_path);
         }
+        // compiled code of rules from the last run
+        LuaBytecodeCache::instance().open(getPersistencePath() + LUA_CACHE_FILE);
         std::filesystem::path d(_path);
-        // every rule at the beggining has empty set of alerts
-        std::vector<PureAlert> emptyAlerts{};
         for (const auto& fn : std::filesystem::directory_iterator(d)) {
 
             // we are interested only in files with names "*.rule"
@@ -161,21 +162,12 @@ std::set<std::string> AlertConfiguration::readConfiguration(void)
                     fname.c_str());
                 continue;
             }
-            std::string rulename = rule->name();
-            // record topics we are interested in
-            for (const auto& interestedTopic : rule->getNeededTopics()) {
-                result.insert(interestedTopic);
-                auto _it_metrics = _metrics_alerts_map.find(interestedTopic);
-                if (_it_metrics != _metrics_alerts_map.end()) {
-                    _it_metrics->second.push_back(rulename);
-                } else {
-                    _metrics_alerts_map.insert(std::make_pair(interestedTopic, std::vector<std::string>{rulename}));
-                }
-            }
-            // add rule to the configuration
-            _alerts_map.insert(std::make_pair(rulename, std::make_pair(std::move(rule), emptyAlerts)));
+            // add rule to the configuration and record topics we are interested in
+            _insertRule(std::move(rule), result);
             log_debug("file '%s' read correctly", fname.c_str());
         }
+        // code of rules, which don't exist anymore, is dropped
+        LuaBytecodeCache::instance().save();
     } catch (std::exception& e) {
         log_error("Can't read configuration: %s", e.what());
         exit(1);
@@ -218,22 +210,10 @@ int AlertConfiguration::addRule(std::istream& newRuleString, std::set<std::strin
             "Error while saving file '%s': %s", (getPersistencePath() + temp_rule->name() + ".rule").c_str(), e.what());
         return -6;
     }
+    LuaBytecodeCache::instance().save();
 
-    std::string rulename = temp_rule->name();
     // in any case we need to check new subjects
-    for (const auto& interestedTopic : temp_rule->getNeededTopics()) {
-        newSubjectsToSubscribe.insert(interestedTopic);
-        auto _it_metrics = _metrics_alerts_map.find(interestedTopic);
-        if (_it_metrics != _metrics_alerts_map.end()) {
-            _it_metrics->second.push_back(rulename);
-        } else {
-            _metrics_alerts_map.insert(std::make_pair(interestedTopic, std::vector<std::string>{rulename}));
-        }
-    }
-
-    std::vector<PureAlert> emptyAlerts{};
-    _alerts_map.insert(std::make_pair(rulename, std::make_pair(std::move(temp_rule), emptyAlerts)));
-    it = _alerts_map.find(rulename);
+    it = _insertRule(std::move(temp_rule), newSubjectsToSubscribe);
     // CURRENT: wait until new measurements arrive
     // TODO: reevaluate immidiately ( new Method )
     // reevaluate rule for every known metric
@@ -242,6 +222,73 @@ int AlertConfiguration::addRule(std::istream& newRuleString, std::set<std::strin
     return 0;
 }
 
+AlertConfiguration::iterator AlertConfiguration::_insertRule(RulePtr rule, std::set<std::string>& topics)
+{
+    // every rule at the beggining has empty set of alerts
+    std::string rulename = rule->name();
+    auto        it       = _alerts_map.emplace(rulename, std::make_pair(std::move(rule), AlertList())).first;
+    RuleLinks&  links    = _rule_links[&*it];
+    for (const auto& interestedTopic : it->second.first->getNeededTopics()) {
+        topics.insert(interestedTopic);
+        TopicId      topicId = TopicTable::instance().intern(interestedTopic);
+        RuleHandles& rules   = _metrics_alerts_map[topicId];
+        links.topics.emplace_back(topicId, rules.size());
+        rules.push_back(&*it);
+    }
+    RuleHandles& elementRules = _element_rules_map[it->second.first->element()];
+    links.element             = elementRules.size();
+    elementRules.push_back(&*it);
+    _topics_generation++;
+    return it;
+}
+
+AlertConfiguration::RuleHandle AlertConfiguration::_swapRemove(RuleHandles& rules, size_t position)
+{
+    RuleHandle moved = rules.back();
+    rules.pop_back();
+    if (position == rules.size()) {
+        return NULL;
+    }
+    rules[position] = moved;
+    return moved;
+}
+
+void AlertConfiguration::_unlinkRule(RuleHandle rule)
+{
+    auto it_links = _rule_links.find(rule);
+    if (it_links == _rule_links.end()) {
+        // should not happened
+        log_error("Remove rule %s who was never been add.", rule->first.c_str());
+        return;
+    }
+    auto& topicLinks = it_links->second.topics;
+    for (size_t i = 0; i < topicLinks.size(); ++i) {
+        TopicId    topicId = topicLinks[i].first;
+        size_t     last    = _metrics_alerts_map[topicId].size() - 1;
+        RuleHandle moved   = _swapRemove(_metrics_alerts_map[topicId], topicLinks[i].second);
+        if (moved == NULL) {
+            continue;
+        }
+        // the moved rule was the last one, its link follows it (the rule can consume the topic more times)
+        for (auto& link : _rule_links.at(moved).topics) {
+            if (link.first == topicId && link.second == last) {
+                link.second = topicLinks[i].second;
+                break;
+            }
+        }
+    }
+
+    auto       it_element = _element_rules_map.find(rule->second.first->element());
+    RuleHandle moved      = _swapRemove(it_element->second, it_links->second.element);
+    if (moved != NULL) {
+        _rule_links.at(moved).element = it_links->second.element;
+    } else if (it_element->second.empty()) {
+        _element_rules_map.erase(it_element);
+    }
+    _rule_links.erase(it_links);
+    _topics_generation++;
+}
+
 int AlertConfiguration::touchRule(const std::string& rule_name, std::vector<PureAlert>& alertsToSend)
 {
     // find rule, that should be touched
@@ -259,8 +306,10 @@ int AlertConfiguration::touchRule(const std::string& rule_name, std::vector<Pure
         // put them into the list of alerts that had changed
         alertsToSend.push_back(oneAlert);
     }
-    // clear alert cache
+    // clear alert cache, transitions from the resolved alerts are not pending anymore
     rule_to_update->second.second.clear();
+    rule_to_update->second.first->debounce().reset();
+    _touch_generation++;
 
     return 0;
 }
@@ -326,6 +375,7 @@ int AlertConfiguration::updateRule(std::istream& newRuleString, const std::strin
             rule_removed_name.c_str());
         return -6;
     }
+    LuaBytecodeCache::instance().save();
     // so, in the files now everything ok
     // and we need to fix information in the memory
 
@@ -336,23 +386,8 @@ int AlertConfiguration::updateRule(std::istream& newRuleString, const std::strin
         alertsToSend.push_back(oneAlert);
     }
 
-    for (const auto& interestedTopic : rule_to_update->second.first->getNeededTopics()) {
-        auto _it_metrics = _metrics_alerts_map.find(interestedTopic);
-        if (_it_metrics != _metrics_alerts_map.end()) {
-            int it_pos = 0;
-            for (auto& it_rule_in_metric : _it_metrics->second) {
-                if (it_rule_in_metric == rule_removed_name) {
-                    _it_metrics->second.erase(_it_metrics->second.begin() + it_pos);
-                    break;
-                }
-                it_pos++;
-            }
-        } else {
-            // should not happened
-            log_error("Remove rule %s with metric %s who was never been add.", rule_removed_name.c_str(),
-                interestedTopic.c_str());
-        }
-    }
+    // handle of the old rule must not be used anymore
+    _unlinkRule(&*rule_to_update);
     // clear cache
     rule_to_update->second.second.clear();
     // remove old rule
@@ -360,22 +395,9 @@ int AlertConfiguration::updateRule(std::istream& newRuleString, const std::strin
     // remove entire entiry
     _alerts_map.erase(rule_to_update);
 
-    // find new topics to subscribe
-    std::vector<PureAlert> emptyAlerts{};
-    std::string            rulename = temp_rule->name();
+    // put new rule with empty alerts (and no pending transitions) into the cache
     // As we changed the rule, we need to check new subjects
-    for (const auto& interestedTopic : temp_rule->getNeededTopics()) {
-        newSubjectsToSubscribe.insert(interestedTopic);
-        auto _it_metrics = _metrics_alerts_map.find(interestedTopic);
-        if (_it_metrics != _metrics_alerts_map.end()) {
-            _it_metrics->second.push_back(rulename);
-        } else {
-            _metrics_alerts_map.insert(std::make_pair(interestedTopic, std::vector<std::string>{rulename}));
-        }
-    }
-    // put new rule with empty alerts into the cache
-    _alerts_map.insert(std::make_pair(rulename, std::make_pair(std::move(temp_rule), emptyAlerts)));
-    it = _alerts_map.find(rulename);
+    it = _insertRule(std::move(temp_rule), newSubjectsToSubscribe);
     // CURRENT: wait until new measurements arrive
     // TODO: reevaluate immidiately ( new Method )
     // reevaluate rule for every known metric
@@ -402,49 +424,49 @@ int AlertConfiguration::deleteAllRules(
 int AlertConfiguration::deleteRules(RuleMatcher* matcher, std::map<std::string, std::vector<PureAlert>>& alertsToSend,
     std::vector<std::string>& rulesDeleted)
 {
-    // clean up what we can without touching the iterator
-    auto rule_to_remove = _alerts_map.begin();
-    while (rule_to_remove != _alerts_map.end()) {
-        if ((*matcher)(*(rule_to_remove->second.first))) {
-            // delete from disk
-            int         rv                = rule_to_remove->second.first->remove(getPersistencePath());
-            std::string rule_removed_name = rule_to_remove->second.first->name();
-            if (rv != 0) {
-                log_error("Error while removing rule %s", rule_removed_name.c_str());
-                return -1;
-            }
-            // resolve found alerts
-            for (auto& oneAlert : rule_to_remove->second.second) {
-                oneAlert._status      = ALERT_RESOLVED;
-                oneAlert._description = "Rule deleted";
-                // put them into the list of alerts that changed
-                alertsToSend[rule_removed_name].push_back(oneAlert);
-            }
+    // rules of a name or of an element are looked up, other matchers have to check all rules
+    RuleHandles candidates;
+    if (auto nameMatcher = dynamic_cast<RuleNameMatcher*>(matcher)) {
+        auto it = _alerts_map.find(nameMatcher->name());
+        if (it != _alerts_map.end()) {
+            candidates.push_back(&*it);
+        }
+    } else if (auto elementMatcher = dynamic_cast<RuleElementMatcher*>(matcher)) {
+        // copy, unlinking of rules changes the index
+        auto it = _element_rules_map.find(elementMatcher->element());
+        if (it != _element_rules_map.end()) {
+            candidates = it->second;
+        }
+    } else {
+        for (auto& it : _alerts_map) {
+            candidates.push_back(&it);
+        }
+    }
 
-            for (const auto& interestedTopic : rule_to_remove->second.first->getNeededTopics()) {
-                auto _it_metrics = _metrics_alerts_map.find(interestedTopic);
-                if (_it_metrics != _metrics_alerts_map.end()) {
-                    int it_pos = 0;
-                    for (auto& it_rule_in_metric : _it_metrics->second) {
-                        if (it_rule_in_metric == rule_removed_name) {
-                            _it_metrics->second.erase(_it_metrics->second.begin() + it_pos);
-                            break;
-                        }
-                        it_pos++;
-                    }
-                } else {
-                    // should not happened
-                    log_error("Remove rule %s with metric %s who was never been add.", rule_removed_name.c_str(),
-                        interestedTopic.c_str());
-                }
-            }
-            // clear the cache
-            rule_to_remove->second.second.clear();
-            rulesDeleted.push_back(rule_removed_name);
-            rule_to_remove = _alerts_map.erase(rule_to_remove);
-        } else {
-            ++rule_to_remove;
+    for (RuleHandle rule_to_remove : candidates) {
+        if (!(*matcher)(*(rule_to_remove->second.first))) {
+            continue;
+        }
+        // delete from disk
+        int         rv                = rule_to_remove->second.first->remove(getPersistencePath());
+        std::string rule_removed_name = rule_to_remove->second.first->name();
+        if (rv != 0) {
+            log_error("Error while removing rule %s", rule_removed_name.c_str());
+            return -1;
         }
+        // resolve found alerts
+        for (auto& oneAlert : rule_to_remove->second.second) {
+            oneAlert._status      = ALERT_RESOLVED;
+            oneAlert._description = "Rule deleted";
+            // put them into the list of alerts that changed
+            alertsToSend[rule_removed_name].push_back(oneAlert);
+        }
+
+        _unlinkRule(rule_to_remove);
+        // clear the cache
+        rule_to_remove->second.second.clear();
+        rulesDeleted.push_back(rule_removed_name);
+        _alerts_map.erase(_alerts_map.find(rule_to_remove->first));
     }
 
     // delete rules from memory
@@ -457,20 +479,56 @@ int AlertConfiguration::deleteRules(RuleMatcher* matcher, std::map<std::string,
     return 0;
 }
 
-int AlertConfiguration::updateAlert(std::pair<RulePtr, std::vector<PureAlert>>& oneRuleAlerts,
+void AlertConfiguration::getNeededTopics(std::vector<std::string>& topics, std::vector<std::string>& patterns) const
+{
+    for (const auto& it_metrics : _metrics_alerts_map) {
+        // rules were deleted, but topic is still in the map
+        if (it_metrics.second.empty()) {
+            continue;
+        }
+        // all rules sharing the topic are of the same kind, look at the first one
+        if (it_metrics.second.front()->second.first->whoami() == "pattern") {
+            patterns.push_back(TopicTable::instance().name(it_metrics.first));
+        } else {
+            topics.push_back(TopicTable::instance().name(it_metrics.first));
+        }
+    }
+}
+
+void AlertConfiguration::getHistoryRequests(std::vector<std::pair<TopicId, uint64_t>>& requests) const
+{
+    for (const auto& it_rule : _alerts_map) {
+        uint64_t window = it_rule.second.first->historyWindow();
+        if (window == 0) {
+            continue;
+        }
+        for (const auto& topic : it_rule.second.first->getNeededTopics()) {
+            auto request = std::make_pair(TopicTable::instance().intern(topic), window);
+            if (std::find(requests.begin(), requests.end(), request) == requests.end()) {
+                requests.push_back(request);
+            }
+        }
+    }
+}
+
+int AlertConfiguration::updateAlert(B& oneRuleAlerts,
     /*const RulePtr &rule,*/
     const PureAlert& pureAlert, PureAlert& alert_to_send)
 {
-    // we found the rule
-    bool isAlertFound = false;
-    for (auto& oneAlert : oneRuleAlerts.second) // this object can be changed -> no const
-    {
-        bool isSameAlert = (pureAlert._element == oneAlert._element);
-        if (!isSameAlert) {
-            continue;
+    // we found the rule, the rule has at most one alert per element
+    PureAlert* foundAlert = oneRuleAlerts.second.find(pureAlert._element);
+    if (foundAlert != NULL) {
+        // we found the alert, this object can be changed -> no const
+        auto& oneAlert = *foundAlert;
+
+        // transition has to pass the debounce of the rule, the same state drops the pending one
+        bool isActive     = (oneAlert._status != ALERT_RESOLVED);
+        bool isTransition = (pureAlert._status == ALERT_START &&
+                                (!isActive || oneAlert._severity != pureAlert._severity)) ||
+                            (pureAlert._status == ALERT_RESOLVED && isActive);
+        if (!oneRuleAlerts.first->debounce().admit(pureAlert, isTransition)) {
+            return -1;
         }
-        // we found the alert
-        isAlertFound = true;
         if (pureAlert._status == ALERT_START) {
             if (oneAlert._status == ALERT_RESOLVED) {
                 // Found alert is old. This is new one
@@ -514,15 +572,17 @@ int AlertConfiguration::updateAlert(std::pair<RulePtr, std::vector<PureAlert>>&
                 return -1;
             }
         }
-    } // end of proceesing existing alerts
-
-    if (!isAlertFound) {
+        return -1;
+    } else {
         // this is completly new alert -> need to add it to the list
         // but  only if alert is not resolved
         // IPMVAL-2411 fix: enlarge to RESOLVED status (eg. any known status)
         //             was: if (pureAlert._status != ALERT_RESOLVED)
         if (PureAlert::isStatusKnown(pureAlert._status.c_str())) {
-            oneRuleAlerts.second.push_back(pureAlert);
+            if (!oneRuleAlerts.first->debounce().admit(pureAlert, pureAlert._status == ALERT_START)) {
+                return -1;
+            }
+            oneRuleAlerts.second.add(pureAlert);
             log_debug("RULE '%s' : ALERT is NEW for element '%s' with description '%s'",
                 oneRuleAlerts.first->name().c_str(), pureAlert._element.c_str(), pureAlert._description.c_str());
             alert_to_send = PureAlert(pureAlert);
@@ -531,14 +591,54 @@ int AlertConfiguration::updateAlert(std::pair<RulePtr, std::vector<PureAlert>>&
             // nothing to do, no need to add to the list resolved alerts
             return -1;
         }
-    } else {
-        return -1;
     }
-    //    } // end of processing one rule
-    return -1;
 }
 
 
+void AlertConfiguration::resolveExpired(TopicId topic, const std::string& element, uint64_t timestamp,
+    std::map<std::string, std::vector<PureAlert>>& alertsToSend)
+{
+    for (RuleHandle handle : getRulesByTopic(topic)) {
+        const RulePtr& rule         = handle->second.first;
+        std::string    alertElement = (rule->whoami() == "pattern") ? element : rule->element();
+
+        const PureAlert* active = handle->second.second.find(alertElement);
+        if (active == NULL || active->_status == ALERT_RESOLVED) {
+            continue;
+        }
+        PureAlert resolved(
+            ALERT_RESOLVED, timestamp, "Metric expired", alertElement, active->_severity, active->_actions);
+        PureAlert alertToSend;
+        if (updateAlert(handle->second, resolved, alertToSend) == 0) {
+            log_debug("RULE '%s' : metric of element '%s' expired, alert resolved", handle->first.c_str(),
+                alertElement.c_str());
+            alertsToSend[handle->first].push_back(alertToSend);
+        }
+    }
+}
+
+void AlertConfiguration::commitDebounced(uint64_t now, std::map<std::string, std::vector<PureAlert>>& alertsToSend)
+{
+    std::vector<PureAlert> due;
+    for (auto& it : _alerts_map) {
+        Debounce& debounce = it.second.first->debounce();
+        if (!debounce.isEnabled()) {
+            continue;
+        }
+        due.clear();
+        debounce.due(now, due);
+        for (const auto& proposal : due) {
+            PureAlert alertToSend;
+            if (updateAlert(it.second, proposal, alertToSend) == 0) {
+                log_debug("RULE '%s' : debounced transition of element '%s' to %s %s committed", it.first.c_str(),
+                    alertToSend._element.c_str(), alertToSend._status.c_str(), alertToSend._severity.c_str());
+                alertToSend._ttl = proposal._ttl;
+                alertsToSend[it.first].push_back(alertToSend);
+            }
+        }
+    }
+}
+
 int AlertConfiguration::updateAlertState(
     const char* rule_name, const char* element_name, const char* new_state, PureAlert& pureAlert)
 {
@@ -553,12 +653,10 @@ int AlertConfiguration::updateAlertState(
     auto oneRuleAlerts = _alerts_map.find(rule_name);
     if (oneRuleAlerts != _alerts_map.end()) {
         // we found the rule
-        for (auto& oneAlert : oneRuleAlerts->second.second) {
-            bool isSameAlert = (oneAlert._element == element_name);
-            if (!isSameAlert) {
-                continue;
-            }
+        PureAlert* foundAlert = oneRuleAlerts->second.second.find(element_name);
+        if (foundAlert != NULL) {
             // we found the alert
+            auto& oneAlert = *foundAlert;
             if (oneAlert._status == ALERT_RESOLVED) {
                 log_error("Alert %s with rule %s : RESOLVED alert cannot be changed manually",
                     oneAlert._element.c_str(), oneAlert._rule_class.c_str());
@@ -24,15 +24,21 @@
 
 #pragma once
 
+#include "alertlist.h"
 #include "purealert.h"
 #include "rule.h"
+#include "topictable.h"
 #include <istream>
 #include <memory>
 #include <set>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+/// Name of the file with compiled code of rules, stored next to the rules
+#define LUA_CACHE_FILE "lua.cache"
+
 /// Parses the input and reads the rule
 ///
 /// @param[in]  f    - an input stream to parse a rule
@@ -56,10 +62,17 @@ int readRule(std::istream& f, RulePtr& rule);
 class AlertConfiguration
 {
 public:
-    typedef typename std::pair<RulePtr, std::vector<PureAlert>> B;
-    typedef typename std::unordered_map<std::string, B>         A;
-    typedef typename A::value_type                              value_type;
-    typedef typename A::iterator                                iterator;
+    typedef typename std::pair<RulePtr, AlertList>      B;
+    typedef typename std::unordered_map<std::string, B> A;
+    typedef typename A::value_type                      value_type;
+    typedef typename A::iterator                        iterator;
+
+    /// Stable handle of a rule with its alerts (entry of the configuration)
+    ///
+    /// Entries are never moved, so the handle is valid until the rule is updated or deleted (both change
+    /// getTopicsGeneration()). Handles must not be kept over the release of mtxAlertConfig.
+    typedef value_type*             RuleHandle;
+    typedef std::vector<RuleHandle> RuleHandles;
 
     /// Creates an empty rule-alert configuration with empty path
     AlertConfiguration()
@@ -168,8 +181,27 @@ public:
     ///
     /// @return -1 nothing to send
     ///          0 need to send an alert
-    int updateAlert(
-        std::pair<RulePtr, std::vector<PureAlert>>& it, const PureAlert& pureAlert, PureAlert& alert_to_send);
+    int updateAlert(B& it, const PureAlert& pureAlert, PureAlert& alert_to_send);
+
+    /// Resolves alerts of rules, whose input metric expired
+    ///
+    /// Rule can't evaluate a metric, which is not published anymore, so its active alert of the element is
+    /// resolved ("Metric expired"). Pattern rules have an alert per element of the matching metric, other rules
+    /// for their element. Resolution passes the debounce of the rule as any other transition (see updateAlert()).
+    /// @param[in] topic - topic of rules consuming the metric, see getRulesByTopic()
+    /// @param[in] element - asset of the expired metric
+    /// @param[in] timestamp - time of the expiry
+    /// @param[out] alertsToSend - resolved alerts, by rule name
+    void resolveExpired(TopicId topic, const std::string& element, uint64_t timestamp,
+        std::map<std::string, std::vector<PureAlert>>& alertsToSend);
+
+    /// Commits debounced transitions, which are held long enough
+    ///
+    /// Metric, which doesn't change, is not evaluated again, so the time of the debounce is checked by the clock of
+    /// the caller (see Debounce::due()).
+    /// @param[in] now - current time
+    /// @param[out] alertsToSend - committed alerts, by rule name
+    void commitDebounced(uint64_t now, std::map<std::string, std::vector<PureAlert>>& alertsToSend);
 
     bool haveRule(const RulePtr& rule) const
     {
@@ -198,19 +230,93 @@ public:
 
     const std::vector<std::string> getRulesByMetric(std::string metric)
     {
-        auto it = _metrics_alerts_map.find(metric);
-        if (it == _metrics_alerts_map.end())
-            return std::vector<std::string>{};
-        else
-            return it->second;
-        // return std::vector<std::string>(it->second);
+        std::vector<std::string> result;
+        for (RuleHandle rule : getRulesByTopic(TopicTable::instance().find(metric))) {
+            result.push_back(rule->first);
+        }
+        return result;
+    }
+
+    /// Gets rules consuming the topic
+    ///
+    /// Fan-out of a metric without any allocation or lookup of rule names, see RuleHandle for validity.
+    /// @param[in] topic - interned topic
+    /// @return handles of rules in the order they were added
+    const RuleHandles& getRulesByTopic(TopicId topic) const
+    {
+        static const RuleHandles none;
+        auto                     it = _metrics_alerts_map.find(topic);
+        return it == _metrics_alerts_map.end() ? none : it->second;
+    }
+
+    /// Gets topics, which are currently consumed by at least one rule
+    ///
+    /// @param[out] topics - exact topics ("metric@element")
+    /// @param[out] patterns - regular expressions of pattern rules
+    void getNeededTopics(std::vector<std::string>& topics, std::vector<std::string>& patterns) const;
+
+    /// Gets topics, which need the history for aggregates, see Rule::historyWindow()
+    ///
+    /// Requests change with the generation of topics as well.
+    /// @param[out] requests - unique <topic, window [s]> pairs
+    void getHistoryRequests(std::vector<std::pair<TopicId, uint64_t>>& requests) const;
+
+    /// Gets the generation of the set of needed topics
+    ///
+    /// Generation is changed every time a rule is added, updated or deleted, so consumers can cache
+    /// the result of getNeededTopics() and rebuild it only when the generation differs.
+    uint64_t getTopicsGeneration(void) const
+    {
+        return _topics_generation;
+    }
+
+    /// Gets the generation of the evaluation state
+    ///
+    /// Generation is changed every time a rule is added, updated, deleted or touched, so results of previous
+    /// evaluations (e.g. unchanged samples skipped by the stream) can't be reused anymore.
+    uint64_t getEvaluationGeneration(void) const
+    {
+        return _topics_generation + _touch_generation;
     }
 
 private:
+    /// Adds the rule with empty alerts and links it to topics it consumes
+    /// @param[out] topics - topics consumed by the rule are added
+    /// @return the added entry
+    iterator _insertRule(RulePtr rule, std::set<std::string>& topics);
+
+    /// Unlinks the rule from topics it consumes and from its element in O(1), the entry itself is not erased
+    ///
+    /// The last rule of an index takes the place of the unlinked one, so order of rules of a topic changes.
+    void _unlinkRule(RuleHandle rule);
+
+    /// Moves the last rule of the index to the position and drops the last one
+    /// @param[in] position - position of the unlinked rule
+    /// @return the moved rule or NULL if the unlinked rule was the last one
+    static RuleHandle _swapRemove(RuleHandles& rules, size_t position);
+
+    // where the rule is linked in the indexes, to unlink it without searching
+    struct RuleLinks
+    {
+        // topic -> position of the rule in _metrics_alerts_map[topic]
+        std::vector<std::pair<TopicId, size_t>> topics;
+        // position of the rule in _element_rules_map[element]
+        size_t element = 0;
+    };
+
     // hash map to quickly retrieve specific alert by rulename
     A _alerts_map;
     // std::unordered_map<std::string,B> _alerts_map;
-    std::unordered_map<std::string, std::vector<std::string>> _metrics_alerts_map;
+    // rules consuming the topic, indexed by interned topic
+    std::unordered_map<TopicId, RuleHandles> _metrics_alerts_map;
+    // rules producing alerts for the element, indexed by element
+    std::unordered_map<std::string, RuleHandles> _element_rules_map;
+    // links of every rule in _metrics_alerts_map and _element_rules_map
+    std::unordered_map<RuleHandle, RuleLinks> _rule_links;
+    // changed every time the _metrics_alerts_map is modified
+    uint64_t _topics_generation = 0;
+    // changed every time a rule is touched
+    uint64_t _touch_generation = 0;
 
     // directory, where rules are stored
     std::string _path;
@@ -0,0 +1,28 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "alertlist.h"
+
+PureAlert& AlertList::add(const PureAlert& alert)
+{
+    if (!_index.emplace(alert._element, _alerts.size()).second) {
+        throw std::logic_error("element '" + alert._element + "' has an alert already");
+    }
+    _alerts.push_back(alert);
+    return _alerts.back();
+}
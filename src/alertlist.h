@@ -0,0 +1,112 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file alertlist.h
+/// @brief Alerts of one rule indexed by element
+#pragma once
+
+#include "purealert.h"
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Alerts of one rule, at most one per element
+///
+/// Alerts are kept in the order they were added, so touching or deleting the rule resolves them in the same order
+/// as before, and an index by element finds the alert of an element in O(1). Alerts are never removed one by one,
+/// so position of an alert (its handle) stays valid until clear().
+class AlertList
+{
+public:
+    typedef std::vector<PureAlert>::iterator       iterator;
+    typedef std::vector<PureAlert>::const_iterator const_iterator;
+
+    /// Finds the alert of the element
+    /// @return the alert or NULL if the element has no alert
+    PureAlert* find(const std::string& element)
+    {
+        auto it = _index.find(element);
+        return it == _index.end() ? NULL : &_alerts[it->second];
+    }
+
+    const PureAlert* find(const std::string& element) const
+    {
+        auto it = _index.find(element);
+        return it == _index.end() ? NULL : &_alerts[it->second];
+    }
+
+    /// Adds the alert of an element, which has no alert yet
+    /// @return the added alert
+    /// @throws std::logic_error if the element has an alert already
+    PureAlert& add(const PureAlert& alert);
+
+    /// Removes all alerts
+    void clear(void)
+    {
+        _alerts.clear();
+        _index.clear();
+    }
+
+    size_t size(void) const
+    {
+        return _alerts.size();
+    }
+
+    bool empty(void) const
+    {
+        return _alerts.empty();
+    }
+
+    PureAlert& operator[](size_t handle)
+    {
+        return _alerts[handle];
+    }
+
+    const PureAlert& operator[](size_t handle) const
+    {
+        return _alerts[handle];
+    }
+
+    // element of an alert must not be changed, it is the key of the index
+    iterator begin(void)
+    {
+        return _alerts.begin();
+    }
+
+    iterator end(void)
+    {
+        return _alerts.end();
+    }
+
+    const_iterator begin(void) const
+    {
+        return _alerts.begin();
+    }
+
+    const_iterator end(void) const
+    {
+        return _alerts.end();
+    }
+
+private:
+    std::vector<PureAlert> _alerts;
+
+    /// Element -> position of its alert in _alerts
+    std::unordered_map<std::string, size_t> _index;
+};
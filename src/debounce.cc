@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "debounce.h"
+#include <cinttypes>
+#include <fty_log.h>
+#include <stdexcept>
+
+void Debounce::fill(const cxxtools::SerializationInfo& rule)
+{
+    _count = 1;
+    _time  = 0;
+    _pending.clear();
+    if (rule.findMember("debounce") == NULL) {
+        return;
+    }
+    auto debounce = rule.getMember("debounce");
+    if (debounce.category() != cxxtools::SerializationInfo::Object) {
+        log_error("parameter 'debounce' in json must be an object.");
+        throw std::runtime_error("parameter 'debounce' in json must be an object.");
+    }
+    int count = 1;
+    int time  = 0;
+    if (debounce.findMember("count") != NULL) {
+        debounce.getMember("count") >>= count;
+    }
+    if (debounce.findMember("time") != NULL) {
+        debounce.getMember("time") >>= time;
+    }
+    if (count <= 0 || time < 0) {
+        log_error("parameters 'count' and 'time' of 'debounce' must be positive numbers.");
+        throw std::runtime_error("parameters 'count' and 'time' of 'debounce' must be positive numbers.");
+    }
+    _count = static_cast<unsigned>(count);
+    _time  = static_cast<uint64_t>(time);
+}
+
+bool Debounce::admit(const PureAlert& alert, bool transition)
+{
+    if (!isEnabled()) {
+        return true;
+    }
+    if (!transition) {
+        _pending.erase(alert._element);
+        return true;
+    }
+    auto& pending = _pending[alert._element];
+    if (pending._count == 0 || pending._alert._status != alert._status ||
+        pending._alert._severity != alert._severity) {
+        // first evaluation proposing it
+        pending._count = 1;
+        pending._since = alert._timestamp;
+    } else {
+        pending._count++;
+    }
+    pending._alert = alert;
+    if (pending._count >= _count && alert._timestamp >= pending._since + _time) {
+        _pending.erase(alert._element);
+        return true;
+    }
+    log_debug("transition of '%s' to %s %s suppressed (%u evaluations, %" PRIu64 " s)", alert._element.c_str(),
+        alert._status.c_str(), alert._severity.c_str(), pending._count, alert._timestamp - pending._since);
+    // transition is counted once, not every evaluation holding it
+    if (pending._count == 1) {
+        _suppressed++;
+    }
+    return false;
+}
+
+void Debounce::due(uint64_t now, std::vector<PureAlert>& alerts) const
+{
+    for (const auto& it : _pending) {
+        const Pending& pending = it.second;
+        if (pending._count >= _count && now >= pending._since + _time) {
+            alerts.push_back(pending._alert);
+            alerts.back()._timestamp = now;
+        }
+    }
+}
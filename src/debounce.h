@@ -0,0 +1,105 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file debounce.h
+/// @brief Debounce of the transitions of alerts of a rule
+#pragma once
+
+#include "purealert.h"
+#include <cstdint>
+#include <cxxtools/serializationinfo.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Debounce of the transitions of alerts of one rule
+///
+/// Transition (alert starts, is resolved or changes its severity) is committed only after 'count' consecutive
+/// evaluations proposed it and it was held for 'time' seconds. Evaluation proposing the committed state drops the
+/// pending transition, so an alert flapping around a threshold is not sent at all. Transition, which is not proposed
+/// again (the metric doesn't change), is committed by due() once its time passed. Without the settings every
+/// transition is committed at once.
+class Debounce
+{
+public:
+    /// Reads optional "debounce" of the rule
+    ///
+    /// "debounce": { "count": 3, "time": 60 } commits a transition proposed by 3 consecutive evaluations over
+    /// 60 s at least, both are optional.
+    ///
+    /// ATTENTION: throws, if bad JSON
+    void fill(const cxxtools::SerializationInfo& rule);
+
+    /// Checks if transitions are debounced
+    bool isEnabled(void) const
+    {
+        return _count > 1 || _time > 0;
+    }
+
+    /// Checks if the alert proposed by an evaluation can be committed
+    ///
+    /// @param[in] alert - alert proposed by the evaluation
+    /// @param[in] transition - true if the alert changes the committed status or severity of its element
+    /// @return false if the transition is suppressed
+    bool admit(const PureAlert& alert, bool transition);
+
+    /// Gets pending transitions, which were proposed by enough evaluations and are held for 'time' seconds at now
+    ///
+    /// Alerts have to be committed by admit() as any other proposal, their timestamp is set to now.
+    /// @param[in] now - current time
+    /// @param[out] alerts - the last alert proposing every such transition
+    void due(uint64_t now, std::vector<PureAlert>& alerts) const;
+
+    /// Drops pending transitions (e.g. alerts of the rule were resolved)
+    void reset(void)
+    {
+        _pending.clear();
+    }
+
+    /// Counts a transition suppressed by the rule itself (e.g. by hysteresis of thresholds)
+    void suppress(void)
+    {
+        _suppressed++;
+    }
+
+    /// Gets number of suppressed transitions, every transition held back is counted once
+    uint64_t suppressed(void) const
+    {
+        return _suppressed;
+    }
+
+private:
+    /// Transition waiting for the commit
+    struct Pending
+    {
+        // the last alert proposing it
+        PureAlert _alert;
+        // consecutive evaluations proposing it
+        unsigned _count = 0;
+        // timestamp of the first one
+        uint64_t _since = 0;
+    };
+
+    unsigned _count = 1;
+    uint64_t _time  = 0;
+
+    /// Pending transition of every element
+    std::unordered_map<std::string, Pending> _pending;
+
+    uint64_t _suppressed = 0;
+};
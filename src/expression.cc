@@ -0,0 +1,501 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "expression.h"
+#include "rule.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+/// Recursive descent parser emitting the program of the expression
+class Expression::Parser
+{
+public:
+    Parser(Expression& expression)
+        : _expression(expression)
+        , _text(expression._text)
+    {
+    }
+
+    void parse(void)
+    {
+        next();
+        // name = expression;
+        while (_token.size() > 0 && isName(_token) && peek() == '=' && peekSecond() != '=') {
+            std::string name = _token;
+            next();
+            expect("=");
+            expression();
+            expect(";");
+            auto slot = _locals.find(name);
+            if (slot == _locals.end()) {
+                slot = _locals.emplace(name, addSlot(0)).first;
+            }
+            _expression.emit(STORE, slot->second);
+        }
+        expression();
+        if (_token == ";") {
+            next();
+        }
+        if (!_token.empty()) {
+            error("unexpected '" + _token + "'");
+        }
+    }
+
+private:
+    [[noreturn]] void error(const std::string& message)
+    {
+        throw std::runtime_error("Invalid expression: " + message);
+    }
+
+    static bool isName(const std::string& token)
+    {
+        return isalpha(static_cast<unsigned char>(token[0])) || token[0] == '_';
+    }
+
+    char peek(void) const
+    {
+        size_t i = _position;
+        while (i < _text.size() && isspace(static_cast<unsigned char>(_text[i]))) {
+            i++;
+        }
+        return i < _text.size() ? _text[i] : '\0';
+    }
+
+    char peekSecond(void) const
+    {
+        size_t i = _position;
+        while (i < _text.size() && isspace(static_cast<unsigned char>(_text[i]))) {
+            i++;
+        }
+        return i + 1 < _text.size() ? _text[i + 1] : '\0';
+    }
+
+    // reads the next token to _token, empty at the end
+    void next(void)
+    {
+        while (_position < _text.size() && isspace(static_cast<unsigned char>(_text[_position]))) {
+            _position++;
+        }
+        _token.clear();
+        if (_position == _text.size()) {
+            return;
+        }
+        size_t start = _position;
+        char   c     = _text[_position];
+        if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            while (_position < _text.size() &&
+                   (isalnum(static_cast<unsigned char>(_text[_position])) || _text[_position] == '_')) {
+                _position++;
+            }
+        } else if (isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            char* end = NULL;
+            strtod(_text.c_str() + _position, &end);
+            if (end == _text.c_str() + _position) {
+                error("bad number");
+            }
+            _position = static_cast<size_t>(end - _text.c_str());
+        } else if ((c == '<' || c == '>' || c == '=' || c == '~' || c == '!') && _position + 1 < _text.size() &&
+                   _text[_position + 1] == '=') {
+            _position += 2;
+        } else if (std::string("+-*/<>()?:,;=").find(c) != std::string::npos) {
+            _position++;
+        } else {
+            error(std::string("unexpected character '") + c + "'");
+        }
+        _token = _text.substr(start, _position - start);
+    }
+
+    void expect(const std::string& token)
+    {
+        if (_token != token) {
+            error("expected '" + token + "'" + (_token.empty() ? " at the end" : " before '" + _token + "'"));
+        }
+        next();
+    }
+
+    uint32_t addSlot(double value)
+    {
+        _expression._slots.push_back(value);
+        return static_cast<uint32_t>(_expression._slots.size() - 1);
+    }
+
+    // expression := or ['?' expression ':' expression]
+    void expression(void)
+    {
+        disjunction();
+        if (_token == "?") {
+            next();
+            expression();
+            expect(":");
+            expression();
+            _expression.emit(SELECT);
+        }
+    }
+
+    // or := and {'or' and}
+    void disjunction(void)
+    {
+        conjunction();
+        while (_token == "or") {
+            next();
+            conjunction();
+            _expression.emit(OR);
+        }
+    }
+
+    // and := not {'and' not}
+    void conjunction(void)
+    {
+        negation();
+        while (_token == "and") {
+            next();
+            negation();
+            _expression.emit(AND);
+        }
+    }
+
+    // not := 'not' not | comparison
+    void negation(void)
+    {
+        if (_token == "not") {
+            next();
+            negation();
+            _expression.emit(NOT);
+            return;
+        }
+        comparison();
+    }
+
+    // comparison := sum [operator sum]
+    void comparison(void)
+    {
+        static const std::map<std::string, Operation> operators = {{"<", LESS}, {"<=", LESS_EQUAL},
+            {">", GREATER}, {">=", GREATER_EQUAL}, {"==", EQUAL}, {"~=", NOT_EQUAL}, {"!=", NOT_EQUAL}};
+
+        sum();
+        auto op = operators.find(_token);
+        if (op != operators.end()) {
+            next();
+            sum();
+            _expression.emit(op->second);
+        }
+    }
+
+    // sum := product {('+' | '-') product}
+    void sum(void)
+    {
+        product();
+        while (_token == "+" || _token == "-") {
+            Operation operation = (_token == "+") ? ADD : SUBTRACT;
+            next();
+            product();
+            _expression.emit(operation);
+        }
+    }
+
+    // product := unary {('*' | '/') unary}
+    void product(void)
+    {
+        unary();
+        while (_token == "*" || _token == "/") {
+            Operation operation = (_token == "*") ? MULTIPLY : DIVIDE;
+            next();
+            unary();
+            _expression.emit(operation);
+        }
+    }
+
+    // unary := '-' unary | primary
+    void unary(void)
+    {
+        if (_token == "-") {
+            next();
+            unary();
+            _expression.emit(NEGATE);
+            return;
+        }
+        primary();
+    }
+
+    // primary := number | name | function '(' arguments ')' | '(' expression ')'
+    void primary(void)
+    {
+        if (_token.empty()) {
+            error("unexpected end");
+        }
+        if (_token == "(") {
+            next();
+            expression();
+            expect(")");
+            return;
+        }
+        if (isdigit(static_cast<unsigned char>(_token[0])) || _token[0] == '.') {
+            _expression.emit(LOAD, addSlot(strtod(_token.c_str(), NULL)));
+            next();
+            return;
+        }
+        if (!isName(_token) || _token == "and" || _token == "or" || _token == "not") {
+            error("unexpected '" + _token + "'");
+        }
+        std::string name = _token;
+        next();
+        if (_token == "(") {
+            call(name);
+            return;
+        }
+        reference(name);
+    }
+
+    void call(const std::string& name)
+    {
+        static const std::map<std::string, Operation> functions = {
+            {"abs", ABS}, {"avg", AVG}, {"min", MIN}, {"max", MAX}};
+
+        auto function = functions.find(name);
+        if (function == functions.end()) {
+            error("unknown function '" + name + "'");
+        }
+        next();
+        uint32_t count = 0;
+        if (_token != ")") {
+            expression();
+            count++;
+            while (_token == ",") {
+                next();
+                expression();
+                count++;
+            }
+        }
+        expect(")");
+        if (count == 0 || (function->second == ABS && count != 1)) {
+            error("bad number of arguments of '" + name + "'");
+        }
+        _expression.emit(function->second, count);
+    }
+
+    void reference(const std::string& name)
+    {
+        auto local = _locals.find(name);
+        if (local != _locals.end()) {
+            _expression.emit(LOAD, local->second);
+            return;
+        }
+        // v1 .. vN
+        if (name.size() > 1 && name[0] == 'v' && name.find_first_not_of("0123456789", 1) == std::string::npos &&
+            name[1] != '0') {
+            size_t index = strtoul(name.c_str() + 1, NULL, 10);
+            if (index > _expression._inputs) {
+                error("value '" + name + "' is not passed to the rule");
+            }
+            _expression.emit(INPUT, static_cast<uint32_t>(index - 1));
+            return;
+        }
+        for (int i = RULE_RESULT_TO_LOW_CRITICAL; i <= RULE_RESULT_UNKNOWN; i++) {
+            std::string upper = Rule::resultToString(i);
+            transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+            if (upper == name) {
+                _expression.emit(LOAD, addSlot(i));
+                return;
+            }
+        }
+        // variable, value is known after bind()
+        for (const auto& variable : _expression._variables) {
+            if (variable.first == name) {
+                _expression.emit(LOAD, variable.second);
+                return;
+            }
+        }
+        uint32_t slot = addSlot(NAN);
+        _expression._variables.emplace_back(name, slot);
+        _expression.emit(LOAD, slot);
+    }
+
+    Expression&                     _expression;
+    const std::string&              _text;
+    size_t                          _position = 0;
+    std::string                     _token;
+    std::map<std::string, uint32_t> _locals;
+};
+
+void Expression::emit(Operation operation, uint32_t argument)
+{
+    _program.push_back(Instruction{operation, argument});
+}
+
+void Expression::compile(const std::string& text, size_t inputs)
+{
+    _compiled = false;
+    _bound    = false;
+    _text     = text;
+    _inputs   = inputs;
+    _program.clear();
+    _slots.clear();
+    _variables.clear();
+
+    Parser(*this).parse();
+
+    // depth of the stack
+    size_t depth = 0;
+    _depth       = 0;
+    for (const auto& instruction : _program) {
+        switch (instruction._operation) {
+            case INPUT:
+            case LOAD:
+                depth++;
+                break;
+            case NEGATE:
+            case NOT:
+            case ABS:
+                break;
+            case SELECT:
+                depth -= 2;
+                break;
+            case AVG:
+            case MIN:
+            case MAX:
+                depth -= instruction._argument - 1;
+                break;
+            default:
+                depth--;
+                break;
+        }
+        _depth = std::max(_depth, depth);
+    }
+    _stack.assign(_depth, 0);
+    _compiled = true;
+    _bound    = _variables.empty();
+}
+
+bool Expression::bind(const std::map<std::string, double>& variables)
+{
+    for (const auto& variable : _variables) {
+        if (variables.count(variable.first) == 0) {
+            return false;
+        }
+    }
+    for (const auto& variable : _variables) {
+        _slots[variable.second] = variables.at(variable.first);
+    }
+    _bound = _compiled;
+    return true;
+}
+
+double Expression::evaluate(const std::vector<double>& values)
+{
+    // top of the stack is sp[-1]
+    double* sp = _stack.data();
+    for (const auto& instruction : _program) {
+        switch (instruction._operation) {
+            case INPUT:
+                *sp++ = values[instruction._argument];
+                break;
+            case LOAD:
+                *sp++ = _slots[instruction._argument];
+                break;
+            case STORE:
+                _slots[instruction._argument] = *--sp;
+                break;
+            case ADD:
+                sp--;
+                sp[-1] += sp[0];
+                break;
+            case SUBTRACT:
+                sp--;
+                sp[-1] -= sp[0];
+                break;
+            case MULTIPLY:
+                sp--;
+                sp[-1] *= sp[0];
+                break;
+            case DIVIDE:
+                sp--;
+                sp[-1] /= sp[0];
+                break;
+            case NEGATE:
+                sp[-1] = -sp[-1];
+                break;
+            case LESS:
+                sp--;
+                sp[-1] = sp[-1] < sp[0];
+                break;
+            case LESS_EQUAL:
+                sp--;
+                sp[-1] = sp[-1] <= sp[0];
+                break;
+            case GREATER:
+                sp--;
+                sp[-1] = sp[-1] > sp[0];
+                break;
+            case GREATER_EQUAL:
+                sp--;
+                sp[-1] = sp[-1] >= sp[0];
+                break;
+            case EQUAL:
+                sp--;
+                sp[-1] = sp[-1] == sp[0];
+                break;
+            case NOT_EQUAL:
+                sp--;
+                sp[-1] = sp[-1] != sp[0];
+                break;
+            case AND:
+                sp--;
+                sp[-1] = (sp[-1] != 0) && (sp[0] != 0);
+                break;
+            case OR:
+                sp--;
+                sp[-1] = (sp[-1] != 0) || (sp[0] != 0);
+                break;
+            case NOT:
+                sp[-1] = (sp[-1] == 0);
+                break;
+            case SELECT:
+                sp -= 2;
+                sp[-1] = (sp[-1] != 0) ? sp[0] : sp[1];
+                break;
+            case ABS:
+                sp[-1] = std::fabs(sp[-1]);
+                break;
+            case AVG:
+            case MIN:
+            case MAX: {
+                double* first  = sp - instruction._argument;
+                double  result = first[0];
+                for (double* i = first + 1; i < sp; ++i) {
+                    if (instruction._operation == AVG) {
+                        result += *i;
+                    } else if (instruction._operation == MIN) {
+                        result = std::min(result, *i);
+                    } else {
+                        result = std::max(result, *i);
+                    }
+                }
+                if (instruction._operation == AVG) {
+                    result /= instruction._argument;
+                }
+                sp       = first + 1;
+                first[0] = result;
+                break;
+            }
+        }
+    }
+    return sp[-1];
+}
@@ -0,0 +1,133 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file expression.h
+/// @brief Arithmetic expressions evaluating rules without Lua
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/// Compiled expression of a rule
+///
+/// Expression is an alternative to Lua code of 'single' and 'threshold' rules, for example
+///
+///     a = avg(v1, v2, v3); p = max(abs(v1 - a), abs(v2 - a), abs(v3 - a)) / a * 100;
+///     p > high_critical ? HIGH_CRITICAL : p > high_warning ? HIGH_WARNING : OK
+///
+/// Expression is a list of assignments of local names followed by the result. Values of the rule are v1 .. vN
+/// (in the order of targets, aggregates follow), other names are locals, results (OK, HIGH_CRITICAL, ...) and
+/// variables of the rule. Supported are numbers, + - * /, comparisons (< <= > >= == ~= !=), 'and', 'or', 'not'
+/// (true is 1, false is 0, 'not' binds looser than comparisons), cond ? a : b and functions abs(x), avg(...),
+/// min(...), max(...).
+///
+/// Expression is compiled to a flat program in reverse polish notation: names are resolved to slots when the
+/// rule is loaded, so the evaluation is a single pass over the program with a stack of known depth.
+class Expression
+{
+public:
+    Expression(){};
+
+    /// Compiles the expression
+    ///
+    /// ATTENTION: throws std::runtime_error, if the expression has errors
+    ///
+    /// @param[in] text - text of the expression
+    /// @param[in] inputs - number of values passed to evaluate()
+    void compile(const std::string& text, size_t inputs);
+
+    /// Resolves names of variables to the values
+    ///
+    /// @param[in] variables - variables of the rule
+    /// @return false if some name is not a variable of the rule, values are not changed then
+    bool bind(const std::map<std::string, double>& variables);
+
+    /// Checks if the expression is compiled and bound
+    bool isValid(void) const
+    {
+        return _compiled && _bound;
+    }
+
+    /// Gets text of the expression
+    const std::string& text(void) const
+    {
+        return _text;
+    }
+
+    /// Evaluates the expression
+    ///
+    /// @param[in] values - values of the rule, at least as many as inputs passed to compile()
+    /// @return value of the expression
+    double evaluate(const std::vector<double>& values);
+
+private:
+    enum Operation : uint8_t
+    {
+        INPUT,  // push values[_argument]
+        LOAD,   // push _slots[_argument]
+        STORE,  // pop to _slots[_argument]
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE,
+        NEGATE,
+        LESS,
+        LESS_EQUAL,
+        GREATER,
+        GREATER_EQUAL,
+        EQUAL,
+        NOT_EQUAL,
+        AND,
+        OR,
+        NOT,
+        SELECT, // cond ? a : b
+        ABS,
+        AVG,    // of _argument values
+        MIN,
+        MAX
+    };
+
+    struct Instruction
+    {
+        Operation _operation;
+        uint32_t  _argument;
+    };
+
+    class Parser;
+
+    void emit(Operation operation, uint32_t argument = 0);
+
+    bool        _compiled = false;
+    bool        _bound    = false;
+    std::string _text;
+    size_t      _inputs = 0;
+
+    std::vector<Instruction> _program;
+
+    /// Constants, variables and locals
+    std::vector<double> _slots;
+
+    /// Names of variables and their slots
+    std::vector<std::pair<std::string, uint32_t>> _variables;
+
+    /// Stack of the evaluation, its size is the depth of the program
+    std::vector<double> _stack;
+    size_t              _depth = 0;
+};
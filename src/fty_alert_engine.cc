@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "fty_alert_actions.h"
 #include "fty_alert_engine_audit_log.h"
 #include "fty_alert_engine_server.h"
+#include "luarule.h"
 #include <czmq.h>
 #include <lua.h>
 
@@ -84,6 +85,19 @@ int main(int argc, char** argv)
         log_debug("logConfigFile=%s", logConfigFile.c_str());
     }
 
+    // must be set before any rule is read
+    const char* luaVm = zconfig_get(cfg, "engine/lua_vm", "shared");
+    LuaRule::sharedVm(!streq(luaVm, "private"));
+    log_info("Lua rules run in %s states", LuaRule::sharedVm() ? "shared" : "private");
+    LuaVm::instructionBudget(atoi(zconfig_get(cfg, "engine/lua_instructions", "1000000")));
+    LuaRule::quarantineAfter(static_cast<unsigned>(atoi(zconfig_get(cfg, "engine/lua_quarantine", "3"))));
+    log_info("Lua calls are limited to %d instructions, quarantine after %u overruns", LuaVm::instructionBudget(),
+        LuaRule::quarantineAfter());
+    LuaRule::memoryLimit(static_cast<size_t>(atoi(zconfig_get(cfg, "engine/lua_memory_limit", "4096"))) * 1024);
+    log_info("Lua memory of a rule is limited to %zu KiB", LuaRule::memoryLimit() / 1024);
+    LuaRule::batchEvaluation(streq(zconfig_get(cfg, "engine/lua_batch", "true"), "true"));
+    log_info("Lua rules sharing the code are evaluated %s", LuaRule::batchEvaluation() ? "in batches" : "one by one");
+
     zactor_t* ag_server_stream =
         zactor_new(fty_alert_engine_stream, static_cast<void*>(const_cast<char*>(ENGINE_AGENT_NAME_STREAM)));
     zactor_t* ag_server_mailbox =
@@ -95,6 +109,10 @@ int main(int argc, char** argv)
     zstr_sendx(ag_server_mailbox, "PRODUCER", FTY_PROTO_STREAM_ALERTS_SYS, NULL);
 
     // Stream
+    zstr_sendx(ag_server_stream, "INGEST", zconfig_get(cfg, "engine/ingest", "filtered"), NULL);
+    zstr_sendx(ag_server_stream, "CHANGE_ONLY", zconfig_get(cfg, "engine/change_only", "true"), NULL);
+    zstr_sendx(ag_server_stream, "WORKERS", zconfig_get(cfg, "engine/workers", "0"), NULL);
+    zstr_sendx(ag_server_stream, "HISTORY", zconfig_get(cfg, "engine/history_rings", "1024"), NULL);
     zstr_sendx(ag_server_stream, "CONNECT", ENDPOINT, NULL);
     zstr_sendx(ag_server_stream, "PRODUCER", FTY_PROTO_STREAM_ALERTS_SYS, NULL);
     // zstr_sendx(ag_server_stream, "CONSUMER", FTY_PROTO_STREAM_METRICS, ".*", NULL);
@@ -22,9 +22,21 @@
 #include "fty_alert_engine_server.h"
 #include "alertconfiguration.h"
 #include "autoconfig.h"
+#include "luarule.h"
+#include "metricreadset.h"
+#include "ruleworkerpool.h"
+#include "thresholdrulesimple.h"
+#include "topictable.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cinttypes>
 #include <fty_shm.h>
 #include <mutex>
 #include <functional>
+#include <string_view>
+#include <tuple>
+#include <unordered_set>
 
 #define METRICS_STREAM "METRICS"
 
@@ -38,8 +50,8 @@ static AlertConfiguration alertConfiguration;
 // Mutex to manage the alertConfiguration object access
 static std::mutex mtxAlertConfig;
 
-// map to know if a metric is evaluted or not
-static std::map<std::string, bool> evaluateMetrics;
+// map to know if a metric is evaluted or not, indexed by interned topic
+static std::unordered_map<TopicId, bool> evaluateMetrics;
 
 void clearEvaluateMetrics()
 {
@@ -134,6 +146,107 @@ void get_rule(mlm_client_t* client, const char* name, AlertConfiguration& ac)
 }
 
 
+// Replies statistics of the engine
+//
+// STATS/lua: one frame per shared Lua state ("state <n>: <memory> KiB, <chunks> chunks") followed by one
+// frame per compiled chunk of that state ("chunk <hash>: <users> rules")
+// STATS/cpu: one frame per Lua rule evaluated by Lua at least once ("<rule>: <evaluations> evaluations,
+// <cpu> us, <overruns> overruns"), the most expensive rules first
+// STATS/quarantine: one frame per quarantined rule ("<rule>: <overruns> overruns")
+// STATS/memory: one frame per Lua rule ("<rule>: <memory> bytes, <failures> failures"), the top consumers first
+// STATS/debounce: one frame per rule, which suppressed a transition ("<rule>: <suppressed> suppressed"), the most
+// suppressing rules first
+static void get_stats(mlm_client_t* client, const char* what)
+{
+    zmsg_t* reply = zmsg_new();
+    if (streq(what, "lua")) {
+        zmsg_addstr(reply, "STATS");
+        zmsg_addstr(reply, what);
+        // states of the workers are not used outside of the evaluation
+        {
+            std::lock_guard<std::mutex> lock(mtxAlertConfig);
+            size_t index = 0;
+            for (const auto& vm : LuaVm::all()) {
+                std::vector<LuaVm::ChunkUsers> chunks;
+                vm->chunks(chunks);
+                zmsg_addstrf(reply, "state %zu: %d KiB, %zu chunks", index++, vm->memory(), chunks.size());
+                for (const auto& chunk : chunks) {
+                    zmsg_addstrf(reply, "chunk %016" PRIx64 ": %zu rules", chunk._hash, chunk._users);
+                }
+            }
+        }
+    } else if (streq(what, "cpu") || streq(what, "quarantine")) {
+        zmsg_addstr(reply, "STATS");
+        zmsg_addstr(reply, what);
+        std::vector<std::pair<std::string, LuaRule::Usage>> usages;
+        {
+            std::lock_guard<std::mutex> lock(mtxAlertConfig);
+            for (const auto& it : alertConfiguration) {
+                const LuaRule* rule = dynamic_cast<const LuaRule*>(it.second.first.get());
+                if (rule && (rule->usage()._evaluations > 0 || rule->usage()._quarantined)) {
+                    usages.emplace_back(it.first, rule->usage());
+                }
+            }
+        }
+        std::sort(usages.begin(), usages.end(), [](const auto& a, const auto& b) {
+            return a.second._cpuTime > b.second._cpuTime;
+        });
+        for (const auto& usage : usages) {
+            if (streq(what, "cpu")) {
+                zmsg_addstrf(reply, "%s: %" PRIu64 " evaluations, %" PRIu64 " us, %" PRIu64 " overruns",
+                    usage.first.c_str(), usage.second._evaluations, usage.second._cpuTime, usage.second._overruns);
+            } else if (usage.second._quarantined) {
+                zmsg_addstrf(reply, "%s: %" PRIu64 " overruns", usage.first.c_str(), usage.second._overruns);
+            }
+        }
+    } else if (streq(what, "memory")) {
+        zmsg_addstr(reply, "STATS");
+        zmsg_addstr(reply, what);
+        std::vector<std::tuple<std::string, size_t, uint64_t>> memories;
+        // accounts of the shared states are not changed outside of the evaluation
+        {
+            std::lock_guard<std::mutex> lock(mtxAlertConfig);
+            for (const auto& it : alertConfiguration) {
+                const LuaRule* rule = dynamic_cast<const LuaRule*>(it.second.first.get());
+                if (rule && !rule->code().empty()) {
+                    memories.emplace_back(it.first, rule->memory(), rule->usage()._memoryErrors);
+                }
+            }
+        }
+        std::sort(memories.begin(), memories.end(), [](const auto& a, const auto& b) {
+            return std::get<1>(a) > std::get<1>(b);
+        });
+        for (const auto& memory : memories) {
+            zmsg_addstrf(reply, "%s: %zu bytes, %" PRIu64 " failures", std::get<0>(memory).c_str(),
+                std::get<1>(memory), std::get<2>(memory));
+        }
+    } else if (streq(what, "debounce")) {
+        zmsg_addstr(reply, "STATS");
+        zmsg_addstr(reply, what);
+        std::vector<std::pair<std::string, uint64_t>> suppressed;
+        // counters are changed by the evaluation
+        {
+            std::lock_guard<std::mutex> lock(mtxAlertConfig);
+            for (const auto& it : alertConfiguration) {
+                if (it.second.first->debounce().suppressed() > 0) {
+                    suppressed.emplace_back(it.first, it.second.first->debounce().suppressed());
+                }
+            }
+        }
+        std::sort(suppressed.begin(), suppressed.end(), [](const auto& a, const auto& b) {
+            return a.second > b.second;
+        });
+        for (const auto& it : suppressed) {
+            zmsg_addstrf(reply, "%s: %" PRIu64 " suppressed", it.first.c_str(), it.second);
+        }
+    } else {
+        log_warning("statistics '%s' are unknown", what);
+        zmsg_addstr(reply, "ERROR");
+        zmsg_addstr(reply, "INVALID_TYPE");
+    }
+    mlm_client_sendto(client, mlm_client_sender(client), RULES_SUBJECT, mlm_client_tracker(client), 1000, &reply);
+}
+
 // XXX: Store the actions as zlist_t internally to avoid useless copying
 zlist_t* makeActionList(const std::vector<std::string>& actions)
 {
@@ -438,145 +551,448 @@ void check_metrics(mlm_client_t* client, const char* metric_topic, AlertConfigur
     }
 }
 
-// static
-bool evaluate_metric(mlm_client_t* client, const MetricInfo& triggeringMetric, const MetricList& knownMetricValues,
-    AlertConfiguration& ac)
+// Updates alerts of the evaluated rule
+//
+// mtxAlertConfig must be locked by the caller. Can run in a worker thread, so it touches only the rule itself
+// and its alerts, the alert is sent by the caller.
+// @param[in] trigger - topic of the metric which triggered the evaluation (in knownMetricValues)
+// @param[in] rv - result of the evaluation of the rule
+// @param[in] pureAlert - alert made by the evaluation
+// @return true if alertToSend has to be sent
+static bool update_rule_alerts(AlertConfiguration::RuleHandle handle, TopicId trigger,
+    const MetricList& knownMetricValues, AlertConfiguration& ac, int rv, const PureAlert& pureAlert,
+    PureAlert& alertToSend)
 {
-    // Go through all known rules, and try to evaluate them
-    mtxAlertConfig.lock();
-    bool isEvaluate = false;
+    auto&       it_ac = handle->second;
+    const auto& rule  = it_ac.first;
 
-    std::string sTopic;
-    // end_warranty_date is the only "regex rule", for optimisation purpose, use some trick for those.
-    if (triggeringMetric.getSource() == "end_warranty_date")
-        sTopic = "^end_warranty_date@.+";
-    else
-        sTopic = triggeringMetric.generateTopic();
+    try {
+        if (rv != 0) {
+            log_error(" ### Cannot evaluate the rule '%s'", rule->name().c_str());
+            return false;
+        }
 
-    const std::vector<std::string> rules_of_metric = ac.getRulesByMetric(sTopic);
+        // proposal is complete, debounce can commit it later (see AlertConfiguration::commitDebounced())
+        PureAlert proposal = pureAlert;
+        proposal._ttl      = knownMetricValues.getTtl(trigger) * 3;
+
+        // NOTE: Warranty rule is not processed by configurator which adds info about asset. In order to send the
+        // corrent message to stream alert description is modified
+        if (rule->name() == "warranty") {
+            int                remaining_days = static_cast<int>(knownMetricValues.find(trigger));
+            const std::string& asset          = knownMetricValues.getElementName(trigger);
+            if (proposal._description == "{\"key\":\"TRANSLATE_LUA (Warranty expired)\"}") {
+                remaining_days = abs(remaining_days);
+                proposal._description =
+                    std::string(
+                        "{\"key\" : \"TRANSLATE_LUA (Warranty on {{asset}} expired {{days}} days ago.)\", ") +
+                    "\"variables\" : { \"asset\" : { \"value\" : \"\", \"assetLink\" : \"" +
+                    asset + "\" }, \"days\" : \"" + std::to_string(remaining_days) +
+                    "\"} }";
+            } else if (proposal._description == "{\"key\":\"TRANSLATE_LUA (Warranty expires in)\"}") {
+                // Style note: do not break long translated lines, that would break their parser
+                proposal._description = std::string(
+                                            "{\"key\" : \"TRANSLATE_LUA (Warranty on {{asset}} expires in less "
+                                            "than {{days}} days.)\", ") +
+                                        "\"variables\" : { \"asset\" : { \"value\" : \"\", \"assetLink\" : \"" +
+                                        asset + "\" }, \"days\" : \"" +
+                                        std::to_string(remaining_days) + "\"} }";
+            } else {
+                log_error("Unable to identify Warranty alert description");
+            }
+        }
 
-    log_debug(" ### evaluate topic '%s' (rules size: %zu)", sTopic.c_str(), rules_of_metric.size());
+        rv               = ac.updateAlert(it_ac, proposal, alertToSend);
+        alertToSend._ttl = proposal._ttl;
 
-    for (const auto& rulename : rules_of_metric) {
-        if (ac.count(rulename) == 0) {
-            log_error("Rule %s must exist but was not found", rulename.c_str());
+        if (rv == -1) {
+            log_debug(" ### alert updated, nothing to send");
+            // nothing to send
+            return false;
+        }
+        return true;
+    } catch (const std::exception& e) {
+        log_error("CANNOT evaluate rule, because '%s'", e.what());
+    }
+    return false;
+}
+
+// Evaluates one rule
+//
+// mtxAlertConfig must be locked by the caller, see update_rule_alerts().
+// @return true if alertToSend has to be sent
+static bool evaluate_rule(AlertConfiguration::RuleHandle handle, TopicId trigger, const MetricList& knownMetricValues,
+    AlertConfiguration& ac, PureAlert& alertToSend)
+{
+    const auto& rule = handle->second.first;
+    log_debug(" ### Evaluate rule '%s'", rule->name().c_str());
+
+    PureAlert pureAlert;
+    int       rv = -1;
+    try {
+        rv = rule->evaluate(knownMetricValues, trigger, pureAlert);
+    } catch (const std::exception& e) {
+        log_error("CANNOT evaluate rule, because '%s'", e.what());
+        return false;
+    }
+    return update_rule_alerts(handle, trigger, knownMetricValues, ac, rv, pureAlert, alertToSend);
+}
+
+// Rules to evaluate in one cycle, every one with the topic of the metric which triggered it
+typedef std::vector<std::pair<AlertConfiguration::RuleHandle, TopicId>> EvaluationUnits;
+
+// Evaluates rules of one shard
+//
+// Simple threshold rules are classified together (see ThresholdRuleSimple::evaluateBatch()). With batch
+// evaluation, Lua rules sharing the code are evaluated by one call of Lua (see LuaRule::evaluateBatch()), other
+// rules one by one. Pattern rules depend on the triggering metric, so they are never batched.
+// @param[in] indexes - indexes of the units of the shard
+// @param[out] alerts, toSend - alert to send of every unit
+static void evaluate_shard(const std::vector<size_t>& indexes, const EvaluationUnits& units,
+    const MetricList& knownMetricValues, AlertConfiguration& ac, std::vector<PureAlert>& alerts,
+    std::vector<char>& toSend)
+{
+    std::vector<size_t>               thresholds;
+    std::vector<ThresholdRuleSimple*> simpleRules;
+    std::vector<TopicId>              triggers;
+    std::vector<size_t>               batched;
+    std::vector<LuaRule*>             rules;
+    for (size_t i : indexes) {
+        Rule* it = units[i].first->second.first.get();
+        if (auto simple = dynamic_cast<ThresholdRuleSimple*>(it)) {
+            thresholds.push_back(i);
+            simpleRules.push_back(simple);
+            triggers.push_back(units[i].second);
             continue;
         }
+        LuaRule* rule = NULL;
+        if (LuaRule::batchEvaluation() && it->whoami() != "pattern") {
+            rule = dynamic_cast<LuaRule*>(it);
+        }
+        if (rule) {
+            batched.push_back(i);
+            rules.push_back(rule);
+        } else {
+            toSend[i] = evaluate_rule(units[i].first, units[i].second, knownMetricValues, ac, alerts[i]);
+        }
+    }
 
-        auto&       it_ac = ac.at(rulename);
-        const auto& rule  = it_ac.first;
-        log_debug(" ### Evaluate rule '%s'", rule->name().c_str());
-
-        try {
-            isEvaluate = true;
-            PureAlert pureAlert;
-            int       rv = rule->evaluate(knownMetricValues, pureAlert);
-            if (rv != 0) {
-                log_error(" ### Cannot evaluate the rule '%s'", rule->name().c_str());
-                continue;
-            }
+    std::vector<PureAlert> pureAlerts;
+    std::vector<int>       results;
+    if (!simpleRules.empty()) {
+        ThresholdRuleSimple::evaluateBatch(simpleRules, triggers, knownMetricValues, pureAlerts, results);
+        for (size_t j = 0; j < thresholds.size(); ++j) {
+            size_t i  = thresholds[j];
+            toSend[i] = update_rule_alerts(
+                units[i].first, units[i].second, knownMetricValues, ac, results[j], pureAlerts[j], alerts[i]);
+        }
+    }
+    if (!rules.empty()) {
+        LuaRule::evaluateBatch(rules, knownMetricValues, pureAlerts, results);
+        for (size_t j = 0; j < batched.size(); ++j) {
+            size_t i  = batched[j];
+            toSend[i] = update_rule_alerts(
+                units[i].first, units[i].second, knownMetricValues, ac, results[j], pureAlerts[j], alerts[i]);
+        }
+    }
+}
 
-            PureAlert alertToSend;
-            rv               = ac.updateAlert(it_ac, pureAlert, alertToSend);
-            alertToSend._ttl = triggeringMetric.getTtl() * 3;
-
-            // NOTE: Warranty rule is not processed by configurator which adds info about asset. In order to send the
-            // corrent message to stream alert description is modified
-            if (rule->name() == "warranty") {
-                int remaining_days = static_cast<int>(triggeringMetric.getValue());
-                if (alertToSend._description == "{\"key\":\"TRANSLATE_LUA (Warranty expired)\"}") {
-                    remaining_days = abs(remaining_days);
-                    alertToSend._description =
-                        std::string(
-                            "{\"key\" : \"TRANSLATE_LUA (Warranty on {{asset}} expired {{days}} days ago.)\", ") +
-                        "\"variables\" : { \"asset\" : { \"value\" : \"\", \"assetLink\" : \"" +
-                        triggeringMetric.getElementName() + "\" }, \"days\" : \"" + std::to_string(remaining_days) +
-                        "\"} }";
-                } else if (alertToSend._description == "{\"key\":\"TRANSLATE_LUA (Warranty expires in)\"}") {
-                    // Style note: do not break long translated lines, that would break their parser
-                    alertToSend._description = std::string(
-                                                   "{\"key\" : \"TRANSLATE_LUA (Warranty on {{asset}} expires in less "
-                                                   "than {{days}} days.)\", ") +
-                                               "\"variables\" : { \"asset\" : { \"value\" : \"\", \"assetLink\" : \"" +
-                                               triggeringMetric.getElementName() + "\" }, \"days\" : \"" +
-                                               std::to_string(remaining_days) + "\"} }";
-                } else {
-                    log_error("Unable to identify Warranty alert description");
-                }
+// Gets topic of rules consuming the metric
+// @param[in] source - metric name
+// @param[in] topic - topic of the metric
+static TopicId rules_topic(const std::string& source, TopicId topic)
+{
+    static const TopicId warrantyTopic = TopicTable::instance().intern("^end_warranty_date@.+");
+
+    // end_warranty_date is the only "regex rule", for optimisation purpose, use some trick for those.
+    if (source == "end_warranty_date") {
+        return warrantyTopic;
+    }
+    return topic;
+}
+
+// Evaluates rules affected by the metrics changed in one cycle
+//
+// All metrics of the cycle are already in knownMetricValues, so every rule sees a consistent snapshot and is
+// evaluated only once, even if several of its inputs changed. Pattern rules are the exception, they generate
+// alert per matching metric, so they are evaluated once per changed metric.
+// @param[in] changed - topics of metrics changed in the cycle (stored in knownMetricValues)
+// @param[out] isEvaluate - for every changed metric, true if at least one rule consumes it
+// Rules are evaluated by the workers of the pool (each rule always by the same one), alerts are gathered and
+// sent by the caller thread in the order of evaluation.
+void evaluate_metrics(mlm_client_t* client, const std::vector<TopicId>& changed,
+    const MetricList& knownMetricValues, AlertConfiguration& ac, RuleWorkerPool& pool, std::vector<bool>& isEvaluate)
+{
+    EvaluationUnits                                    units;
+    std::unordered_set<AlertConfiguration::RuleHandle> scheduled;
+
+    std::lock_guard<std::mutex> lock(mtxAlertConfig);
+    isEvaluate.assign(changed.size(), false);
+    for (size_t i = 0; i < changed.size(); ++i) {
+        TopicId trigger = changed[i];
+        TopicId topic   = rules_topic(knownMetricValues.getSource(trigger), trigger);
+
+        // handles stay valid, the configuration is locked until the end of the cycle
+        const AlertConfiguration::RuleHandles& rules_of_metric = ac.getRulesByTopic(topic);
+        if (ManageFtyLog::getInstanceFtylog()->isLogDebug()) {
+            log_debug(" ### evaluate topic '%s' (rules size: %zu)", TopicTable::instance().name(topic).c_str(),
+                rules_of_metric.size());
+        }
+
+        for (AlertConfiguration::RuleHandle rule : rules_of_metric) {
+            isEvaluate[i] = true;
+            // pattern rule generates alert for the triggering metric, so it is evaluated for every one
+            if (topic != trigger || scheduled.insert(rule).second) {
+                units.emplace_back(rule, trigger);
+            } else {
+                log_debug(" ### rule '%s' already scheduled in this cycle", rule->first.c_str());
             }
+        }
+    }
 
-            if (rv == -1) {
-                log_debug(" ### alert updated, nothing to send");
-                // nothing to send
-                continue;
+    // fan out: every shard evaluates its rules in the order they were scheduled
+    std::vector<std::vector<size_t>> shards(pool.size());
+    for (size_t i = 0; i < units.size(); ++i) {
+        shards[pool.shard(units[i].first->first)].push_back(i);
+    }
+
+    // every unit has its own slot, so workers don't share anything
+    std::vector<PureAlert> alerts(units.size());
+    std::vector<char>      toSend(units.size(), 0);
+
+    std::vector<RuleWorkerPool::Job> jobs(shards.size());
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+        if (shards[shard].empty()) {
+            continue;
+        }
+        jobs[shard] = [&, shard]() {
+            evaluate_shard(shards[shard], units, knownMetricValues, ac, alerts, toSend);
+        };
+    }
+    pool.run(jobs);
+
+    // gather
+    for (size_t i = 0; i < units.size(); ++i) {
+        if (toSend[i]) {
+            send_alerts(client, {alerts[i]}, units[i].first->first);
+        }
+    }
+}
+
+// Resolves alerts of rules consuming the metrics, which expired
+//
+// Rule can't be evaluated without its input, so instead of evaluating it again, its alert is resolved (see
+// AlertConfiguration::resolveExpired()).
+static void resolve_expired(
+    mlm_client_t* client, const std::vector<MetricInfo>& expired, AlertConfiguration& ac, uint64_t now)
+{
+    std::lock_guard<std::mutex> lock(mtxAlertConfig);
+    for (const auto& metric : expired) {
+        std::map<std::string, std::vector<PureAlert>> alertsToSend;
+        ac.resolveExpired(
+            rules_topic(metric.getSource(), metric.getTopicId()), metric.getElementName(), now, alertsToSend);
+        for (auto& it : alertsToSend) {
+            for (auto& alert : it.second) {
+                alert._ttl = metric.getTtl() * 3;
             }
-            send_alerts(client, {alertToSend}, rule);
-        } catch (const std::exception& e) {
-            log_error("CANNOT evaluate rule, because '%s'", e.what());
+            send_alerts(client, it.second, it.first);
         }
     }
-    mtxAlertConfig.unlock();
-    return isEvaluate;
 }
 
-void metric_processing(fty::shm::shmMetrics& result, MetricList& cache, mlm_client_t* client)
+// Commits debounced transitions held long enough at now
+//
+// Unchanged metric is not evaluated again (see MetricProcessing::changeOnly), so the time of the debounce is
+// checked by the clock of the poll loop (see AlertConfiguration::commitDebounced()).
+static void commit_debounced(mlm_client_t* client, AlertConfiguration& ac, uint64_t now)
 {
+    std::lock_guard<std::mutex>                   lock(mtxAlertConfig);
+    std::map<std::string, std::vector<PureAlert>> alertsToSend;
+    ac.commitDebounced(now, alertsToSend);
+    for (const auto& it : alertsToSend) {
+        send_alerts(client, it.second, it.first);
+    }
+}
+
+int metric_value(std::string_view text, double& value)
+{
+    // leading white spaces and '+' are accepted by strtod(), but not by from_chars()
+    const char* begin = text.data();
+    const char* end   = text.data() + text.size();
+    while (begin != end && std::isspace(static_cast<unsigned char>(*begin))) {
+        ++begin;
+    }
+    bool negative = false;
+    if (begin != end && (*begin == '+' || *begin == '-')) {
+        negative = *begin == '-';
+        ++begin;
+    }
+    if (begin == end || *begin == '+' || *begin == '-') {
+        return -1;
+    }
+    // hexadecimal form of strtod() ("0x1A", "0x1p-3")
+    std::chars_format format = std::chars_format::general;
+    if (end - begin > 2 && begin[0] == '0' && (begin[1] == 'x' || begin[1] == 'X')) {
+        format = std::chars_format::hex;
+        begin += 2;
+        if (*begin == '+' || *begin == '-') {
+            return -1;
+        }
+    }
+    auto [last, ec] = std::from_chars(begin, end, value, format);
+    if (ec == std::errc::result_out_of_range) {
+        return -2;
+    }
+    if (ec != std::errc() || last != end) {
+        return -1;
+    }
+    if (negative) {
+        value = -value;
+    }
+    return 0;
+}
+
+void metric_processing(fty::shm::shmMetrics& result, MetricList& cache, mlm_client_t* client,
+    MetricProcessing& processing, AlertConfiguration& ac)
+{
+    // metrics of this cycle, which have to be evaluated
+    std::vector<TopicId> changed;
+
     // process accumulated stream messages
     for (auto& element : result) {
         // std::string topic = element.first;
         // fty_proto_t *bmessage = element.second;
 
-        // process as metric message
-        const char* type      = fty_proto_type(element);
-        const char* name      = fty_proto_name(element);
-        const char* value     = fty_proto_value(element);
-        const char* unit      = fty_proto_unit(element);
-        uint32_t    ttl       = fty_proto_ttl(element);
-        uint64_t    timestamp = fty_proto_aux_number(element, "time", static_cast<uint64_t>(::time(NULL)));
+        // process as metric message, fields are borrowed from the message until the metric is stored
+        const char*      type      = fty_proto_type(element);
+        const char*      name      = fty_proto_name(element);
+        std::string_view value     = fty_proto_value(element);
+        const char*      unit      = fty_proto_unit(element);
+        uint32_t         ttl       = fty_proto_ttl(element);
+        uint64_t         timestamp = fty_proto_aux_number(element, "time", static_cast<uint64_t>(::time(NULL)));
+
+        // topic is interned only when the metric is stored, the table never forgets it
+        TopicId topic = TopicTable::instance().find(type, name);
+
+        // the same sample as in the previous cycle was already evaluated
+        uint64_t fingerprint = 0;
+        if (processing.changeOnly) {
+            fingerprint = MetricList::fingerprint(timestamp, value.data(), processing.generation);
+            if (topic != TOPIC_NONE && cache.isKnownSample(topic, fingerprint)) {
+                processing.skipped++;
+                continue;
+            }
+        }
 
         // TODO: 2016-04-27 ACE: fix it later, when "string" values
         // in the metric would be considered as
         // normal behaviour, but for now it is not supposed to be so
         // -> generated error messages into the log
-        char*  end;
-        double dvalue = strtod(value, &end);
-        if (errno == ERANGE) {
-            errno = 0;
+        double dvalue = 0;
+        int    rv     = metric_value(value, dvalue);
+        if (rv == -2) {
             // fty_proto_print (element);
             log_error("%s: can't convert value to double #1, ignore message", name);
             continue;
-        } else if (end == value || *end != '\0') {
+        } else if (rv != 0) {
             // fty_proto_print (element);
             log_error("%s: can't convert value to double #2, ignore message", name);
             continue;
         }
 
-        log_debug("%s: Got message '%s@%s' with value %s", name, type, name, value);
+        log_debug("%s: Got message '%s@%s' with value %s", name, type, name, value.data());
 
-        // Update cache with new value
-        MetricInfo m(name, type, unit, dvalue, timestamp, "", ttl);
-        cache.addMetric(m);
+        // Update cache with new value (known metric is updated in place)
+        if (topic == TOPIC_NONE) {
+            topic = TopicTable::instance().intern(type, name);
+        }
+        cache.addMetric(topic, name, type, unit, dvalue, timestamp, ttl, fingerprint);
+        processing.processed++;
 
         // search if this metric is already evaluated and if this metric is evaluate
-        std::map<std::string, bool>::iterator found       = evaluateMetrics.find(m.generateTopic());
-        bool                                  metricfound = found != evaluateMetrics.end();
+        auto found       = evaluateMetrics.find(topic);
+        bool metricfound = found != evaluateMetrics.end();
 
-        log_debug("Check metric : %s", m.generateTopic().c_str());
+        log_debug("Check metric : %s@%s", type, name);
         if (metricfound && ManageFtyLog::getInstanceFtylog()->isLogDebug()) {
-            log_debug("Metric '%s' is known and %s be evaluated", m.generateTopic().c_str(),
-                found->second ? "must" : "will not");
+            log_debug("Metric '%s@%s' is known and %s be evaluated", type, name, found->second ? "must" : "will not");
         }
 
         if (!metricfound || found->second) {
-            bool isEvaluate = evaluate_metric(client, m, cache, alertConfiguration);
+            changed.push_back(topic);
+        }
+    }
 
-            // if the metric is evaluate for the first time, add to the list
-            if (!metricfound) {
-                log_debug("Add %s evaluated metric '%s'", isEvaluate ? " " : "not", m.generateTopic().c_str());
-                evaluateMetrics[m.generateTopic()] = isEvaluate;
+    // evaluate affected rules once all metrics of the cycle are known
+    std::vector<bool> isEvaluate;
+    evaluate_metrics(client, changed, cache, ac, processing.workers, isEvaluate);
+
+    // if the metric is evaluate for the first time, add to the list
+    for (size_t i = 0; i < changed.size(); ++i) {
+        TopicId topic = changed[i];
+        if (evaluateMetrics.find(topic) == evaluateMetrics.end()) {
+            if (ManageFtyLog::getInstanceFtylog()->isLogDebug()) {
+                log_debug("Add %s evaluated metric '%s'", isEvaluate[i] ? " " : "not",
+                    TopicTable::instance().name(topic).c_str());
             }
+            evaluateMetrics[topic] = isEvaluate[i];
+        }
+    }
+}
+
+bool coalesce_metric(
+    std::unordered_map<TopicId, fty_proto_t*>& messages, fty_proto_t* message, const MetricReadSet* readSet)
+{
+    // buffer is reused, topic no rule is interested in is not interned, the table would keep it forever
+    thread_local std::string name;
+    name.assign(fty_proto_type(message)).append(1, '@').append(fty_proto_name(message));
+    if (readSet && !readSet->matches(name)) {
+        fty_proto_destroy(&message);
+        return false;
+    }
+    TopicId topic = TopicTable::instance().intern(name);
+    auto it = messages.find(topic);
+    if (it == messages.end()) {
+        messages.emplace(topic, message);
+    } else {
+        // Discard the old METRICS update, we did not manage to process
+        // it in time.
+        log_debug("Metrics update '%s' processed too late, discarding", name.c_str());
+        fty_proto_destroy(&it->second);
+        it->second = message;
+    }
+    return true;
+}
+
+// Rebuilds the set of metrics read from shm, if rules were changed since the last time
+static void update_read_set(MetricReadSet& readSet)
+{
+    std::lock_guard<std::mutex> lock(mtxAlertConfig);
+    readSet.update(alertConfiguration);
+}
+
+// Processes one batch of metrics (from shm or coalesced from the stream) and logs the counters
+static void process_metrics(
+    fty::shm::shmMetrics& result, MetricList& cache, mlm_client_t* client, MetricProcessing& processing)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtxAlertConfig);
+        processing.generation = alertConfiguration.getEvaluationGeneration();
+        if (processing.historyGeneration != alertConfiguration.getTopicsGeneration()) {
+            // rules needing aggregates were changed, samples must go to the right rings
+            std::vector<std::pair<TopicId, uint64_t>> requests;
+            alertConfiguration.getHistoryRequests(requests);
+            cache.trackHistory(requests);
+            processing.historyGeneration = alertConfiguration.getTopicsGeneration();
         }
     }
+
+    uint64_t skipped   = processing.skipped;
+    uint64_t processed = processing.processed;
+    metric_processing(result, cache, client, processing, alertConfiguration);
+    log_debug("metrics skipped as unchanged: %" PRIu64 " (total %" PRIu64 "), processed: %" PRIu64
+              " (total %" PRIu64 ")",
+        processing.skipped - skipped, processing.skipped, processing.processed - processed, processing.processed);
 }
 
 void fty_alert_engine_stream(zsock_t* pipe, void* args)
@@ -584,6 +1000,15 @@ void fty_alert_engine_stream(zsock_t* pipe, void* args)
     MetricList cache; // need to track incoming measurements
     char*      name = static_cast<char*>(args);
 
+    // read only metrics needed by rules (filtered) or every metric in shm (all)
+    bool          filteredIngest = true;
+    MetricReadSet readSet;
+
+    MetricProcessing processing;
+
+    // METRICS stream messages waiting for processing, only the newest one per topic is kept
+    std::unordered_map<TopicId, fty_proto_t*> streamMessages;
+
     mlm_client_t* client = mlm_client_new();
     assert(client);
 
@@ -600,13 +1025,30 @@ void fty_alert_engine_stream(zsock_t* pipe, void* args)
         int64_t timeCurrent = zclock_mono() - timeCash;
         if (timeCurrent >= timeout) {
             fty::shm::shmMetrics result;
-            cache.removeOldMetrics();
             timeCash = zclock_mono();
+
+            // alerts of rules consuming expired metrics are resolved
+            uint64_t                now = static_cast<uint64_t>(::time(NULL));
+            std::vector<MetricInfo> expired;
+            cache.removeOldMetrics(now, expired);
+            if (!expired.empty()) {
+                log_debug("number of metrics expired : %zu", expired.size());
+                resolve_expired(client, expired, alertConfiguration, now);
+            }
+
             // Timeout, need to get metrics and update refresh value
-            fty::shm::read_metrics(".*", ".*", result);
-            log_debug("number of metrics read : %d", result.size());
+            if (filteredIngest) {
+                update_read_set(readSet);
+                readSet.read(result);
+            } else {
+                fty::shm::read_metrics(".*", ".*", result);
+            }
+            log_debug("number of metrics read : %zu", result.size());
             timeout = fty_get_polling_interval() * 1000;
-            metric_processing(result, cache, client);
+            process_metrics(result, cache, client, processing);
+
+            // transitions, which are not proposed again, are committed once their time passed
+            commit_debounced(client, alertConfiguration, static_cast<uint64_t>(::time(NULL)));
         } else {
             timeout = timeout - timeCurrent;
         }
@@ -625,12 +1067,14 @@ void fty_alert_engine_stream(zsock_t* pipe, void* args)
         // Drain the queue of pending METRICS stream messages before
         // doing actual work
 
-        // METRICS messages received in this round
-        //        std::unordered_map<std::string, fty_proto_t*> stream_messages;
         // Mailbox message received (if any)
         zmsg_t*     zmessage = NULL;
         std::string subject;
 
+        // the read set is refreshed once per drain, rules changed meanwhile are seen by the next one
+        if (filteredIngest && which == mlm_client_msgpipe(client)) {
+            update_read_set(readSet);
+        }
         while (which == mlm_client_msgpipe(client)) {
             zmsg_t*     zmsg  = mlm_client_recv(client);
             std::string topic = mlm_client_subject(client);
@@ -658,19 +1102,24 @@ void fty_alert_engine_stream(zsock_t* pipe, void* args)
                 fty_proto_destroy(&bmessage);
                 break;
             }
-            //            auto it = stream_messages.find(topic);
-            //            if (it == stream_messages.end()) {
-            //                stream_messages.emplace(topic, bmessage);
-            //            } else {
-            //                // Discard the old METRICS update, we did not manage to process
-            //                // it in time.
-            //                log_warning("%s: Metrics update '%s' processed too late, discarding", name,
-            //                topic.c_str()); fty_proto_destroy(&it->second); it->second = bmessage;
-            //            }
+
+            coalesce_metric(streamMessages, bmessage, filteredIngest ? &readSet : NULL);
             // Check if further messages are pending
             which = zpoller_wait(poller, 0);
         }
 
+        // process METRICS messages received in this round as one batch
+        if (!streamMessages.empty()) {
+            fty::shm::shmMetrics result;
+            for (auto& message : streamMessages) {
+                // result takes the ownership
+                result.add(message.second);
+            }
+            streamMessages.clear();
+            log_debug("number of metrics received : %zu", result.size());
+            process_metrics(result, cache, client, processing);
+        }
+
         if (which == pipe) {
             zmsg_t* msg = zmsg_recv(pipe);
             char*   cmd = zmsg_popstr(msg);
@@ -703,6 +1152,60 @@ void fty_alert_engine_stream(zsock_t* pipe, void* args)
                     log_error("%s: can't set consumer on stream '%s', '%s'", name, stream, pattern);
                 zstr_free(&pattern);
                 zstr_free(&stream);
+            } else if (streq(cmd, "INGEST")) {
+                log_debug("INGEST received");
+                char* mode = zmsg_popstr(msg);
+                if (mode && streq(mode, "all")) {
+                    filteredIngest = false;
+                } else if (mode && streq(mode, "filtered")) {
+                    filteredIngest = true;
+                } else {
+                    log_error("%s: unknown ingest mode '%s'", name, mode ? mode : "(null)");
+                }
+                log_info("%s: shm ingest mode is '%s'", name, filteredIngest ? "filtered" : "all");
+                zstr_free(&mode);
+            } else if (streq(cmd, "WORKERS")) {
+                log_debug("WORKERS received");
+                char* count   = zmsg_popstr(msg);
+                long  workers = count ? strtol(count, NULL, 10) : 0;
+                if (workers <= 0) {
+                    workers = static_cast<long>(std::thread::hardware_concurrency());
+                }
+                size_t previous = processing.workers.size();
+                processing.workers.resize(workers > 0 ? static_cast<size_t>(workers) : 1);
+                if (processing.workers.size() != previous) {
+                    // rules move to other workers, states of the stopped ones are freed with their last binding
+                    std::lock_guard<std::mutex> lock(mtxAlertConfig);
+                    for (const auto& it : alertConfiguration) {
+                        LuaRule* rule = dynamic_cast<LuaRule*>(it.second.first.get());
+                        if (rule) {
+                            rule->releaseBindings();
+                        }
+                    }
+                }
+                log_info("%s: rules are evaluated by %zu workers", name, processing.workers.size());
+                zstr_free(&count);
+            } else if (streq(cmd, "HISTORY")) {
+                log_debug("HISTORY received");
+                char* count = zmsg_popstr(msg);
+                long  rings = count ? strtol(count, NULL, 10) : 0;
+                cache.resizeHistory(rings > 0 ? static_cast<size_t>(rings) : 0);
+                // topics are tracked again with the next batch
+                processing.historyGeneration = UINT64_MAX;
+                log_info("%s: history of metrics is limited to %ld rings", name, rings > 0 ? rings : 0);
+                zstr_free(&count);
+            } else if (streq(cmd, "CHANGE_ONLY")) {
+                log_debug("CHANGE_ONLY received");
+                char* mode = zmsg_popstr(msg);
+                if (mode && (streq(mode, "true") || streq(mode, "1"))) {
+                    processing.changeOnly = true;
+                } else if (mode && (streq(mode, "false") || streq(mode, "0"))) {
+                    processing.changeOnly = false;
+                } else {
+                    log_error("%s: unknown change only mode '%s'", name, mode ? mode : "(null)");
+                }
+                log_info("%s: change only processing is %s", name, processing.changeOnly ? "enabled" : "disabled");
+                zstr_free(&mode);
             }
 
             zstr_free(&cmd);
@@ -738,6 +1241,9 @@ void fty_alert_engine_stream(zsock_t* pipe, void* args)
         zmsg_destroy(&zmessage);
     }
 exit:
+    for (auto& message : streamMessages) {
+        fty_proto_destroy(&message.second);
+    }
     zpoller_destroy(&poller);
     mlm_client_destroy(&client);
 }
@@ -860,6 +1366,8 @@ void fty_alert_engine_mailbox(zsock_t* pipe, void* args)
                     log_info("Requested deletion of rules about element '%s'", param);
                     RuleElementMatcher matcher(param);
                     delete_rules(client, &matcher, alertConfiguration);
+                } else if (streq(command, "STATS")) {
+                    get_stats(client, param);
                 } else {
                     log_error("Received unexpected message to MAILBOX with command '%s'", command);
                 }
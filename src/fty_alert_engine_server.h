@@ -20,12 +20,67 @@
 */
 
 #pragma once
+#include "alertconfiguration.h"
+#include "metriclist.h"
+#include "ruleworkerpool.h"
+#include "topictable.h"
 #include <czmq.h>
 #include <fty_proto.h>
+#include <fty_shm.h>
 #include <malamute.h>
+#include <string_view>
+#include <unordered_map>
+
+class MetricReadSet;
 
 
 void  fty_alert_engine_stream(zsock_t* pipe, void* args);
 void  fty_alert_engine_mailbox(zsock_t* pipe, void* args);
 void  clearEvaluateMetrics();
 char* s_readall(const char* filename);
+
+/// Converts the value of a metric to double
+///
+/// The whole text must be a number in the form accepted by strtod(): leading white spaces, optional sign, decimal
+/// or hexadecimal digits, "inf" or "nan". Trailing characters are not accepted.
+/// @return 0 if converted, -1 if the text is not a number, -2 if the number is out of range
+int   metric_value(std::string_view text, double& value);
+
+/// Options and counters of the metric processing
+struct MetricProcessing
+{
+    // skip samples, which were already processed (same timestamp and value)
+    bool changeOnly = false;
+    // evaluation generation of the configuration, see AlertConfiguration::getEvaluationGeneration()
+    uint64_t generation = 0;
+    // number of samples skipped because they were not changed
+    uint64_t skipped = 0;
+    // number of samples passed to the evaluation
+    uint64_t processed = 0;
+    // topics generation of the configuration, the history is tracked for
+    uint64_t historyGeneration = UINT64_MAX;
+    // workers evaluating rules
+    RuleWorkerPool workers;
+};
+
+/// Stores metrics of one batch to the cache and evaluates rules affected by them, every rule once
+///
+/// With changeOnly, samples already processed in the same evaluation generation are skipped. Alerts are sent by
+/// the client.
+/// @param[in] result - metrics of the batch (from shm or coalesced from the stream)
+/// @param[in,out] cache - known metrics
+/// @param[in] client - client sending the alerts
+/// @param[in,out] processing - options and counters
+/// @param[in,out] ac - rules and their alerts
+void metric_processing(fty::shm::shmMetrics& result, MetricList& cache, mlm_client_t* client,
+    MetricProcessing& processing, AlertConfiguration& ac);
+
+/// Keeps the METRICS stream message as the newest one of its topic, until the batch is processed
+///
+/// Takes the ownership of the message, older message of the same topic is destroyed.
+/// @param[in,out] messages - newest message of every topic
+/// @param[in] message - received message
+/// @param[in] readSet - metrics needed by rules, NULL to accept every metric
+/// @return false if the message was dropped, because no rule needs it
+bool coalesce_metric(
+    std::unordered_map<TopicId, fty_proto_t*>& messages, fty_proto_t* message, const MetricReadSet* readSet);
@@ -0,0 +1,241 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "luaallocator.h"
+#include <cstdlib>
+#include <cstring>
+#include <fty_log.h>
+
+// error outside of protected call, same as in luaL_newstate()
+static int s_panic(lua_State* state)
+{
+    log_fatal("PANIC: unprotected error in call to Lua API (%s)", lua_tostring(state, -1));
+    return 0;
+}
+
+LuaAllocator::LuaAllocator()
+    : _accounts{Account{0, 0, false}}
+    , _pools(MAX_POOLED / GRANULARITY, NULL)
+{
+}
+
+LuaAllocator::~LuaAllocator()
+{
+    for (void* slab : _slabs) {
+        ::free(slab);
+    }
+}
+
+lua_State* LuaAllocator::newState(void)
+{
+    lua_State* state = lua_newstate(s_alloc, this);
+    if (state) {
+        lua_atpanic(state, s_panic);
+    }
+    return state;
+}
+
+LuaAllocator* LuaAllocator::of(lua_State* state)
+{
+    void* ud = NULL;
+    if (lua_getallocf(state, &ud) != s_alloc) {
+        return NULL;
+    }
+    return static_cast<LuaAllocator*>(ud);
+}
+
+int LuaAllocator::newAccount(size_t limit)
+{
+    if (!_freeAccounts.empty()) {
+        int account = _freeAccounts.back();
+        _freeAccounts.pop_back();
+        _accounts[static_cast<size_t>(account)] = Account{0, limit, false};
+        return account;
+    }
+    _accounts.push_back(Account{0, limit, false});
+    return static_cast<int>(_accounts.size() - 1);
+}
+
+void LuaAllocator::releaseAccount(int account)
+{
+    if (account <= STATE || static_cast<size_t>(account) >= _accounts.size()) {
+        return;
+    }
+    Account& it = _accounts[static_cast<size_t>(account)];
+    it._released = true;
+    if (it._used == 0) {
+        _freeAccounts.push_back(account);
+    }
+}
+
+size_t LuaAllocator::used(int account) const
+{
+    if (account < STATE || static_cast<size_t>(account) >= _accounts.size()) {
+        return 0;
+    }
+    return _accounts[static_cast<size_t>(account)]._used;
+}
+
+int LuaAllocator::charge(int account)
+{
+    int previous = _current;
+    _current     = account;
+    return previous;
+}
+
+bool LuaAllocator::fits(uint32_t account, size_t size) const
+{
+    const Account& it = _accounts[account];
+    return !_enforce || it._limit == 0 || it._used + size <= it._limit;
+}
+
+void LuaAllocator::credit(uint32_t account, size_t size)
+{
+    Account& it = _accounts[account];
+    it._used -= size;
+    _used -= size;
+    if (it._used == 0 && it._released) {
+        it._released = false;
+        _freeAccounts.push_back(static_cast<int>(account));
+    }
+}
+
+void* LuaAllocator::s_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    LuaAllocator* allocator = static_cast<LuaAllocator*>(ud);
+    if (nsize == 0) {
+        if (ptr) {
+            allocator->free(ptr, osize);
+        }
+        return NULL;
+    }
+    if (!ptr) {
+        return allocator->allocate(nsize, static_cast<uint32_t>(allocator->_current));
+    }
+    return allocator->reallocate(ptr, osize, nsize);
+}
+
+void* LuaAllocator::allocate(size_t size, uint32_t account)
+{
+    if (!fits(account, size)) {
+        return NULL;
+    }
+    size_t   block   = sizeof(Header) + size;
+    uint32_t clazz   = 0;
+    Header*  header  = NULL;
+    if (block <= MAX_POOLED) {
+        clazz        = static_cast<uint32_t>((block + GRANULARITY - 1) / GRANULARITY);
+        block        = clazz * GRANULARITY;
+        void*& first = _pools[clazz - 1];
+        if (first) {
+            // the next free block is stored in the free block
+            header = static_cast<Header*>(first);
+            memcpy(&first, header, sizeof(void*));
+        } else {
+            if (_slabLeft < block) {
+                _slab = static_cast<char*>(malloc(SLAB));
+                if (!_slab) {
+                    _slabLeft = 0;
+                    return NULL;
+                }
+                _slabs.push_back(_slab);
+                _slabLeft = SLAB;
+                _reserved += SLAB;
+            }
+            header = reinterpret_cast<Header*>(_slab);
+            _slab += block;
+            _slabLeft -= block;
+        }
+    } else {
+        header = static_cast<Header*>(malloc(block));
+        if (!header) {
+            return NULL;
+        }
+        _reserved += block;
+    }
+    header->_account = account;
+    header->_class   = clazz;
+    header->_size    = clazz ? 0 : block;
+    _accounts[account]._used += size;
+    _used += size;
+    return header + 1;
+}
+
+void LuaAllocator::free(void* ptr, size_t size)
+{
+    Header* header = static_cast<Header*>(ptr) - 1;
+    credit(header->_account, size);
+    if (header->_class == 0) {
+        _reserved -= header->_size;
+        ::free(header);
+        return;
+    }
+    void*& first = _pools[header->_class - 1];
+    memcpy(header, &first, sizeof(void*));
+    first = header;
+}
+
+void* LuaAllocator::shrink(void* ptr, size_t osize, size_t nsize)
+{
+    if (nsize > osize) {
+        return NULL;
+    }
+    // shrinking must not fail, the old block is kept
+    credit((static_cast<Header*>(ptr) - 1)->_account, osize - nsize);
+    return ptr;
+}
+
+void* LuaAllocator::reallocate(void* ptr, size_t osize, size_t nsize)
+{
+    Header*  header  = static_cast<Header*>(ptr) - 1;
+    uint32_t account = header->_account;
+    if (nsize > osize && !fits(account, nsize - osize)) {
+        return NULL;
+    }
+
+    // block is big enough
+    if (header->_class != 0 && sizeof(Header) + nsize <= header->_class * GRANULARITY &&
+        sizeof(Header) + nsize > (header->_class - 1) * GRANULARITY) {
+        _accounts[account]._used += nsize - osize;
+        _used += nsize - osize;
+        return ptr;
+    }
+    if (header->_class == 0 && sizeof(Header) + nsize > MAX_POOLED) {
+        Header* moved = static_cast<Header*>(realloc(header, sizeof(Header) + nsize));
+        if (!moved) {
+            return shrink(ptr, osize, nsize);
+        }
+        _reserved += sizeof(Header) + nsize - moved->_size;
+        moved->_size = sizeof(Header) + nsize;
+        _accounts[account]._used += nsize - osize;
+        _used += nsize - osize;
+        return moved + 1;
+    }
+
+    // block of other size class; limit is already checked
+    bool  enforce = _enforce;
+    _enforce      = false;
+    void* moved   = allocate(nsize, account);
+    _enforce      = enforce;
+    if (!moved) {
+        return shrink(ptr, osize, nsize);
+    }
+    memcpy(moved, ptr, nsize < osize ? nsize : osize);
+    free(ptr, osize);
+    return moved;
+}
@@ -0,0 +1,164 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file luaallocator.h
+/// @brief Memory allocator of Lua states with per-rule accounting
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <lua5.1/lua.h>
+#include <vector>
+
+/// Memory allocator of one Lua state
+///
+/// Small blocks (the most of Lua objects) are taken from pools of fixed size classes carved from big slabs, so
+/// long running states don't scatter small allocations over the heap. Freed blocks are kept for reuse, slabs
+/// are released with the allocator.
+///
+/// Every block is charged to an account (a rule), the account is stored in the header of the block, so the
+/// block is credited back to its account, whoever frees it (e.g. garbage collection during evaluation of other
+/// rule). Structures of the whole state (e.g. the string table) are charged to the account growing them. Account
+/// can have a limit, which is enforced only when enabled by enforce(): Lua raises a memory error then, which is
+/// safe only in protected calls.
+///
+/// Allocator is not thread safe, it is used by one state.
+class LuaAllocator
+{
+public:
+    /// Account of the state itself (libraries, constants), it has no limit
+    static constexpr int STATE = 0;
+
+    LuaAllocator();
+    ~LuaAllocator();
+
+    LuaAllocator(const LuaAllocator&) = delete;
+    LuaAllocator& operator=(const LuaAllocator&) = delete;
+
+    /// Creates a new state using this allocator, the allocator must outlive the state
+    /// @return new state, NULL on error
+    lua_State* newState(void);
+
+    /// Gets the allocator of the state
+    /// @return allocator, NULL if the state doesn't use LuaAllocator
+    static LuaAllocator* of(lua_State* state);
+
+    /// Creates a new account
+    /// @param[in] limit - maximum number of bytes charged to the account, 0 means no limit
+    /// @return identifier of the account
+    int newAccount(size_t limit);
+
+    /// Releases the account, it is dropped once all its blocks are freed
+    void releaseAccount(int account);
+
+    /// Gets number of bytes charged to the account
+    size_t used(int account) const;
+
+    /// Gets number of bytes allocated by Lua
+    size_t used(void) const
+    {
+        return _used;
+    }
+
+    /// Gets number of bytes taken from the system (slabs and big blocks)
+    size_t reserved(void) const
+    {
+        return _reserved;
+    }
+
+    /// Sets the account charged by new allocations
+    /// @return previous account
+    int charge(int account);
+
+    /// Enables limits of the accounts
+    void enforce(bool enforce)
+    {
+        _enforce = enforce;
+    }
+
+    /// Charges the account in a scope
+    class Charge
+    {
+    public:
+        Charge(LuaAllocator* allocator, int account)
+            : _allocator(allocator)
+            , _previous(allocator ? allocator->charge(account) : STATE)
+        {
+        }
+        ~Charge()
+        {
+            if (_allocator) {
+                _allocator->charge(_previous);
+            }
+        }
+
+    private:
+        LuaAllocator* _allocator;
+        int           _previous;
+    };
+
+private:
+    /// Header of every block
+    struct alignas(16) Header
+    {
+        uint32_t _account;
+        // size class of the block, 0 for blocks not taken from pools
+        uint32_t _class;
+        // size of the block not taken from pools (header included)
+        uint64_t _size;
+    };
+
+    struct Account
+    {
+        size_t _used;
+        size_t _limit;
+        bool   _released;
+    };
+
+    /// Size classes are multiples of granularity up to the maximal pooled size (header included)
+    static constexpr size_t GRANULARITY = 16;
+    static constexpr size_t MAX_POOLED  = 512;
+    static constexpr size_t SLAB        = 64 * 1024;
+
+    static void* s_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+    void* allocate(size_t size, uint32_t account);
+    void* reallocate(void* ptr, size_t osize, size_t nsize);
+    // handles failed reallocation
+    void* shrink(void* ptr, size_t osize, size_t nsize);
+    void  free(void* ptr, size_t size);
+
+    bool fits(uint32_t account, size_t size) const;
+    void credit(uint32_t account, size_t size);
+
+    std::vector<Account> _accounts;
+    std::vector<int>     _freeAccounts;
+    int                  _current = STATE;
+    bool                 _enforce = false;
+
+    size_t _used     = 0;
+    size_t _reserved = 0;
+
+    /// Free blocks of every size class (index is class - 1)
+    std::vector<void*> _pools;
+
+    /// Slabs and the unused rest of the last one
+    std::vector<void*> _slabs;
+    char*              _slab     = NULL;
+    size_t             _slabLeft = 0;
+};
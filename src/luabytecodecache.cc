@@ -0,0 +1,250 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "luabytecodecache.h"
+#include "utils.h"
+#include <cstdio>
+#include <fstream>
+#include <fty_log.h>
+#include <lua5.1/lauxlib.h>
+
+// version of the file format
+static const char* CACHE_MAGIC = "fty-alert-engine lua cache 2";
+
+// lua_Writer appending the bytecode to std::string
+static int s_writer(lua_State* /* state */, const void* data, size_t size, void* result)
+{
+    static_cast<std::string*>(result)->append(static_cast<const char*>(data), size);
+    return 0;
+}
+
+// Gets the header of the bytecode dumped by this Lua (version, format, endianness, sizes of int, size_t,
+// instruction and number), empty if it can't be dumped
+static const std::string& s_bytecodeHeader(void)
+{
+    static const std::string header = []() {
+        // size of the header of Lua 5.1 bytecode, see LUAC_HEADERSIZE
+        static const size_t HEADER_SIZE = 12;
+
+        std::string bytecode;
+        lua_State*  state = luaL_newstate();
+        if (state && luaL_loadstring(state, "return") == 0) {
+            lua_dump(state, s_writer, &bytecode);
+        }
+        if (state) {
+            lua_close(state);
+        }
+        return bytecode.size() >= HEADER_SIZE ? bytecode.substr(0, HEADER_SIZE) : std::string();
+    }();
+    return header;
+}
+
+// Gets the header of the file: version of the format, Lua version, size of the number and the bytecode header
+static std::string s_header(void)
+{
+    std::string header = std::string(CACHE_MAGIC) + " " + std::to_string(LUA_VERSION_NUM) + " " +
+                         std::to_string(sizeof(lua_Number)) + " ";
+    char hex[3];
+    for (unsigned char c : s_bytecodeHeader()) {
+        snprintf(hex, sizeof(hex), "%02x", c);
+        header += hex;
+    }
+    return header + "\n";
+}
+
+static void s_writeNumber(std::ostream& out, uint64_t value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static bool s_readNumber(std::istream& in, uint64_t& value)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+static void s_writeString(std::ostream& out, const std::string& value)
+{
+    uint64_t size = value.size();
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.write(value.data(), static_cast<std::streamsize>(value.size()));
+}
+
+static bool s_readString(std::istream& in, std::string& value)
+{
+    uint64_t size = 0;
+    if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)) || size > (64 << 20)) {
+        return false;
+    }
+    value.resize(size);
+    return static_cast<bool>(in.read(&value[0], static_cast<std::streamsize>(size)));
+}
+
+LuaBytecodeCache& LuaBytecodeCache::instance(void)
+{
+    static LuaBytecodeCache cache;
+    return cache;
+}
+
+size_t LuaBytecodeCache::open(const std::string& file)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _file = file;
+    _entries.clear();
+    _dirty = false;
+
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        log_debug("lua cache '%s' doesn't exist", file.c_str());
+        return 0;
+    }
+    std::string header;
+    if (!std::getline(in, header) || header + "\n" != s_header()) {
+        log_info("lua cache '%s' is of other version, ignore it", file.c_str());
+        _dirty = true;
+        return 0;
+    }
+    std::string code;
+    std::string bytecode;
+    uint64_t    sourceHash = 0;
+    uint64_t    checksum   = 0;
+    size_t      dropped    = 0;
+    while (s_readNumber(in, sourceHash) && s_readNumber(in, checksum) && s_readString(in, code) &&
+           s_readString(in, bytecode)) {
+        uint64_t hash  = utils::fnv1a64(code.data(), code.size());
+        Entry    entry = {code, bytecode, checksum, false};
+        if (hash != sourceHash || !verify(entry)) {
+            dropped++;
+            continue;
+        }
+        _entries.emplace(hash, std::move(entry));
+    }
+    if (!in.eof()) {
+        log_warning("lua cache '%s' is truncated", file.c_str());
+    }
+    if (dropped > 0) {
+        log_warning("lua cache '%s' has %zu corrupted entries, their code is compiled again", file.c_str(), dropped);
+    }
+    // entries not used by any rule are dropped by the next save
+    _dirty = true;
+    log_debug("lua cache '%s' has %zu entries", file.c_str(), _entries.size());
+    return _entries.size();
+}
+
+int LuaBytecodeCache::save(void)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_file.empty() || !_dirty) {
+        return 0;
+    }
+    size_t        count = 0;
+    std::string   tmp   = _file + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out << s_header();
+    for (auto it = _entries.begin(); it != _entries.end();) {
+        if (!it->second._used) {
+            it = _entries.erase(it);
+            continue;
+        }
+        s_writeNumber(out, it->first);
+        s_writeNumber(out, it->second._checksum);
+        s_writeString(out, it->second._code);
+        s_writeString(out, it->second._bytecode);
+        count++;
+        ++it;
+    }
+    out.close();
+    if (!out || std::rename(tmp.c_str(), _file.c_str()) != 0) {
+        log_error("can't write lua cache '%s'", _file.c_str());
+        std::remove(tmp.c_str());
+        return -1;
+    }
+    _dirty = false;
+    log_debug("lua cache '%s' saved with %zu entries", _file.c_str(), count);
+    return 0;
+}
+
+LuaBytecodeCache::Entry* LuaBytecodeCache::findLocked(uint64_t hash, const std::string& code)
+{
+    auto range = _entries.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second._code == code) {
+            return &it->second;
+        }
+    }
+    return NULL;
+}
+
+bool LuaBytecodeCache::verify(const Entry& entry)
+{
+    const std::string& header = s_bytecodeHeader();
+    return !header.empty() && entry._bytecode.compare(0, header.size(), header) == 0 &&
+           utils::fnv1a64(entry._bytecode.data(), entry._bytecode.size()) == entry._checksum;
+}
+
+int LuaBytecodeCache::load(lua_State* state, const std::string& code)
+{
+    uint64_t hash = utils::fnv1a64(code.data(), code.size());
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Entry*                      entry = findLocked(hash, code);
+        if (entry) {
+            if (!verify(*entry)) {
+                log_warning("cached bytecode is corrupted, compile the code again");
+            } else if (luaL_loadbuffer(state, entry->_bytecode.data(), entry->_bytecode.size(), "rule") == 0) {
+                entry->_used = true;
+                return 0;
+            } else {
+                log_warning(
+                    "cached bytecode can't be loaded (%s), compile the code again", lua_tostring(state, -1));
+                lua_pop(state, 1);
+            }
+            auto range = _entries.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (&it->second == entry) {
+                    _entries.erase(it);
+                    break;
+                }
+            }
+            _dirty = true;
+        }
+    }
+
+    int error = luaL_loadbuffer(state, code.data(), code.size(), "rule");
+    if (error != 0) {
+        return error;
+    }
+    std::string bytecode;
+    if (lua_dump(state, s_writer, &bytecode) != 0) {
+        return 0;
+    }
+
+    uint64_t checksum = utils::fnv1a64(bytecode.data(), bytecode.size());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!findLocked(hash, code)) {
+        _entries.emplace(hash, Entry{code, std::move(bytecode), checksum, true});
+        _dirty = true;
+    }
+    return 0;
+}
+
+size_t LuaBytecodeCache::size(void) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _entries.size();
+}
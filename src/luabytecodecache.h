@@ -0,0 +1,98 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file luabytecodecache.h
+/// @brief Persistent cache of compiled Lua code of rules
+#pragma once
+
+#include <cstdint>
+#include <lua5.1/lua.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Process wide cache of Lua bytecode (lua_dump) keyed by the hash of the source code
+///
+/// Cache is loaded from a file at start up, so code of rules doesn't have to be parsed and compiled again.
+/// File is rewritten by save() only with entries used since it was opened: entries of deleted or changed rules
+/// are dropped automatically. File is written to a temporary file, which replaces the old one.
+///
+/// File of other version (of the format, of Lua or of its bytecode header) is ignored as a whole. Every entry
+/// carries the hash of its source and the checksum of its bytecode, entry which doesn't match them or the bytecode
+/// header of this Lua is dropped before it is loaded, as well as bytecode which Lua refuses to load, and the source
+/// is compiled instead. Cache is thread safe.
+class LuaBytecodeCache
+{
+public:
+    /// Gets the cache of the process
+    static LuaBytecodeCache& instance(void);
+
+    /// Loads the cache from the file, previous content is dropped
+    ///
+    /// @param[in] file - path of the cache file, it doesn't need to exist
+    /// @return number of entries loaded
+    size_t open(const std::string& file);
+
+    /// Writes entries used since open() to the file (if there are any changes)
+    ///
+    /// @return 0 on success (or if there is no file), -1 on error
+    int save(void);
+
+    /// Pushes compiled code to the stack of the state
+    ///
+    /// Bytecode is taken from the cache if possible, otherwise the source is compiled and its bytecode is stored
+    /// in the cache.
+    /// @param[in] state - Lua state
+    /// @param[in] code - source code
+    /// @return 0 and the function on the stack, error of luaL_loadbuffer() and the message on the stack otherwise
+    int load(lua_State* state, const std::string& code);
+
+    /// Gets number of entries
+    size_t size(void) const;
+
+private:
+    LuaBytecodeCache(){};
+
+    struct Entry
+    {
+        std::string _code;
+        std::string _bytecode;
+        // checksum of the bytecode
+        uint64_t _checksum;
+        // used since the cache was opened
+        bool _used;
+    };
+
+    /// Finds entry of the code
+    Entry* findLocked(uint64_t hash, const std::string& code);
+
+    /// Checks the entry can be loaded: checksum of its bytecode and the bytecode header of this Lua
+    static bool verify(const Entry& entry);
+
+    mutable std::mutex _mutex;
+
+    /// Path of the cache file, empty if the cache is only in memory
+    std::string _file;
+
+    /// Entries differ from the file
+    bool _dirty = false;
+
+    /// Entries by hash of the source code
+    std::unordered_multimap<uint64_t, Entry> _entries;
+};
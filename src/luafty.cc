@@ -0,0 +1,119 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "luafty.h"
+#include <cmath>
+#include <lua5.1/lauxlib.h>
+
+namespace luafty {
+
+double avg(const double* values, size_t count)
+{
+    double sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += values[i];
+    }
+    return sum / static_cast<double>(count);
+}
+
+double maxdev(const double* values, size_t count)
+{
+    double average = avg(values, count);
+    // the first one wins on NaN, like in math.max()
+    double deviation = std::fabs(values[0] - average);
+    for (size_t i = 1; i < count; ++i) {
+        double it = std::fabs(values[i] - average);
+        if (it > deviation) {
+            deviation = it;
+        }
+    }
+    return deviation;
+}
+
+double imbalance(const double* values, size_t count)
+{
+    return maxdev(values, count) / avg(values, count) * 100;
+}
+
+double clamp(double value, double low, double high)
+{
+    if (low > value) {
+        value = low;
+    }
+    if (high < value) {
+        value = high;
+    }
+    return value;
+}
+
+} // namespace luafty
+
+// Copies numeric arguments of the call to the buffer
+// @return number of the values
+static size_t s_values(lua_State* state, double* values)
+{
+    int count = lua_gettop(state);
+    luaL_argcheck(state, count >= 1, 1, "number expected, got no value");
+    luaL_argcheck(state, count <= static_cast<int>(luafty::MAX_VALUES), count, "too many values");
+    for (int i = 1; i <= count; ++i) {
+        values[i - 1] = luaL_checknumber(state, i);
+    }
+    return static_cast<size_t>(count);
+}
+
+static int s_avg(lua_State* state)
+{
+    double values[luafty::MAX_VALUES];
+    size_t count = s_values(state, values);
+    lua_pushnumber(state, luafty::avg(values, count));
+    return 1;
+}
+
+static int s_maxdev(lua_State* state)
+{
+    double values[luafty::MAX_VALUES];
+    size_t count = s_values(state, values);
+    lua_pushnumber(state, luafty::maxdev(values, count));
+    return 1;
+}
+
+static int s_imbalance(lua_State* state)
+{
+    double values[luafty::MAX_VALUES];
+    size_t count = s_values(state, values);
+    lua_pushnumber(state, luafty::imbalance(values, count));
+    return 1;
+}
+
+static int s_clamp(lua_State* state)
+{
+    double value = luaL_checknumber(state, 1);
+    double low   = luaL_checknumber(state, 2);
+    double high  = luaL_checknumber(state, 3);
+    lua_pushnumber(state, luafty::clamp(value, low, high));
+    return 1;
+}
+
+static const luaL_Reg s_functions[] = {
+    {"avg", s_avg}, {"maxdev", s_maxdev}, {"imbalance", s_imbalance}, {"clamp", s_clamp}, {NULL, NULL}};
+
+int luaopen_fty(lua_State* state)
+{
+    luaL_register(state, "fty", s_functions);
+    return 1;
+}
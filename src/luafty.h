@@ -0,0 +1,49 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file luafty.h
+/// @brief Native math functions of rules, available in Lua as the module fty
+#pragma once
+
+#include <cstddef>
+#include <lua5.1/lua.h>
+
+namespace luafty {
+
+/// Maximal number of values of one call from Lua
+static constexpr size_t MAX_VALUES = 64;
+
+/// Average of the values, (v1 + v2 + ... + vn) / n summed in order, same as in Lua
+double avg(const double* values, size_t count);
+
+/// Maximal absolute deviation of the values from their average
+double maxdev(const double* values, size_t count);
+
+/// Imbalance of the values [%], maxdev / avg * 100
+double imbalance(const double* values, size_t count);
+
+/// Value limited to the range, same as math.min(math.max(value, low), high)
+double clamp(double value, double low, double high);
+
+} // namespace luafty
+
+/// Opens the module fty (fty.avg, fty.maxdev, fty.imbalance, fty.clamp) like luaL_openlibs() opens the standard
+/// ones, it is called by lua_call()
+///
+/// Functions give exactly the same results as the same computation written in Lua, NaN included.
+int luaopen_fty(lua_State* state);
@@ -18,23 +18,125 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "luarule.h"
 #include "fty_alert_engine_audit_log.h"
+#include "luabytecodecache.h"
+#include "luafty.h"
 #include <algorithm>
+#include <atomic>
 #include <czmq.h>
 #include <fty_log.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <time.h>
+
+static std::atomic<bool>     s_sharedVm{false};
+static std::atomic<unsigned> s_quarantineAfter{3};
+static std::atomic<size_t>   s_memoryLimit{4096 * 1024};
+static std::atomic<bool>     s_batchEvaluation{false};
+
+void LuaRule::sharedVm(bool shared)
+{
+    s_sharedVm = shared;
+}
+
+bool LuaRule::sharedVm(void)
+{
+    return s_sharedVm;
+}
+
+void LuaRule::quarantineAfter(unsigned overruns)
+{
+    s_quarantineAfter = overruns;
+}
+
+unsigned LuaRule::quarantineAfter(void)
+{
+    return s_quarantineAfter;
+}
+
+void LuaRule::memoryLimit(size_t bytes)
+{
+    s_memoryLimit = bytes;
+}
+
+size_t LuaRule::memoryLimit(void)
+{
+    return s_memoryLimit;
+}
+
+void LuaRule::batchEvaluation(bool batch)
+{
+    s_batchEvaluation = batch;
+}
+
+bool LuaRule::batchEvaluation(void)
+{
+    return s_batchEvaluation;
+}
+
+size_t LuaRule::memory(void) const
+{
+    size_t memory = _allocator ? _allocator->used(_account) : 0;
+    for (const auto& binding : _bindings) {
+        memory += binding._vm->allocator().used(binding._account);
+    }
+    return memory;
+}
 
 LuaRule::~LuaRule()
 {
     if (_lstate)
         lua_close(_lstate);
+    releaseBindings();
+}
+
+void LuaRule::releaseBindings(void)
+{
+    for (auto& binding : _bindings) {
+        binding._vm->unref(binding._main);
+        binding._vm->unref(binding._environment);
+        binding._vm->releaseChunk(binding._chunk);
+        // objects of the rule are credited back, when they are collected
+        binding._vm->allocator().releaseAccount(binding._account);
+    }
+    _bindings.clear();
+}
+
+LuaRule::Binding& LuaRule::_binding(void)
+{
+    std::shared_ptr<LuaVm> vm = LuaVm::local();
+    for (auto& binding : _bindings) {
+        if (binding._vm == vm) {
+            return binding;
+        }
+    }
+    int                  account = vm->allocator().newAccount(s_memoryLimit);
+    LuaAllocator::Charge charge(&vm->allocator(), account);
+    int                  environment = vm->newEnvironment(getGlobalVariables());
+    try {
+        int chunk = 0;
+        int main  = vm->load(environment, _code, chunk);
+        _bindings.push_back(Binding{vm, environment, chunk, main, account});
+    } catch (...) {
+        vm->unref(environment);
+        vm->allocator().releaseAccount(account);
+        throw;
+    }
+    return _bindings.back();
 }
 
 LuaRule::LuaRule(const LuaRule& r)
 {
-    _name = r._name;
+    _name          = r._name;
+    _metrics       = r._metrics;
+    _topics        = r._topics;
+    _historyWindow = r._historyWindow;
+    _aggregates    = r._aggregates;
     globalVariables(r.getGlobalVariables());
-    code(r._code);
+    if (r._expression.text().empty()) {
+        code(r._code);
+    } else {
+        expression(r._expression.text());
+    }
 }
 
 
@@ -44,32 +146,106 @@ void LuaRule::globalVariables(const std::map<std::string, double>& vars)
     _setGlobalVariablesToLUA();
 }
 
-void LuaRule::code(const std::string& newCode)
+void LuaRule::_clear(void)
 {
     if (_lstate)
         lua_close(_lstate);
+    _lstate = NULL;
+    _allocator.reset();
+    _account = LuaAllocator::STATE;
+    releaseBindings();
     _valid = false;
     _code.clear();
+    _native.parse("");
+    _compiled.load("");
+    _expression = Expression();
+    _usage      = Usage();
+}
+
+void LuaRule::code(const std::string& newCode)
+{
+    _clear();
+
+    _shared = s_sharedVm;
+    _code   = newCode;
+    if (_shared) {
+        // code is bound to the states of the evaluating threads (see _binding()), native form needs no check,
+        // other code is checked in the scratch state
+        if (_native.parse(_code)) {
+            _native.bind(getGlobalVariables());
+        } else if (_compiled.load(_code)) {
+            _compiled.bind(getGlobalVariables());
+        } else {
+            try {
+                _check();
+            } catch (...) {
+                _clear();
+                throw;
+            }
+        }
+        _valid = true;
+        return;
+    }
+
+    _open();
+    if (_native.parse(_code)) {
+        _native.bind(getGlobalVariables());
+    } else if (_compiled.load(_code)) {
+        _compiled.bind(getGlobalVariables());
+    }
+}
 
-#if LUA_VERSION_NUM > 501
-    _lstate = luaL_newstate();
-#else
-    _lstate = lua_open();
-#endif
+// State checking code of the rules read by the thread, it is not used for evaluation
+static LuaVm& s_scratchVm(void)
+{
+    static thread_local LuaVm vm;
+    return vm;
+}
+
+void LuaRule::_check(void)
+{
+    LuaVm& vm          = s_scratchVm();
+    int    account     = vm.allocator().newAccount(s_memoryLimit);
+    int    environment = LUA_NOREF;
+    try {
+        LuaAllocator::Charge charge(&vm.allocator(), account);
+        environment = vm.newEnvironment(getGlobalVariables());
+        int chunk   = 0;
+        vm.unref(vm.load(environment, _code, chunk));
+        vm.releaseChunk(chunk);
+    } catch (...) {
+        vm.unref(environment);
+        vm.allocator().releaseAccount(account);
+        throw;
+    }
+    vm.unref(environment);
+    vm.allocator().releaseAccount(account);
+}
+
+void LuaRule::_open(void)
+{
+    _allocator.reset(new LuaAllocator());
+    _lstate = _allocator->newState();
     if (!_lstate) {
         throw std::runtime_error("Can't initiate LUA context!");
     }
     luaL_openlibs(_lstate); // get functions like print();
+    lua_pushcfunction(_lstate, luaopen_fty);
+    lua_call(_lstate, 0, 0);
+
+    // everything the code creates is charged to the rule
+    _account = _allocator->newAccount(s_memoryLimit);
+    LuaAllocator::Charge charge(_allocator.get(), _account);
 
     // set global variables
     _setGlobalVariablesToLUA();
 
-    // set code, try to compile it
-    _code     = newCode;
-    int error = luaL_dostring(_lstate, _code.c_str());
-    _valid    = (error == 0);
+    // try to compile the code
+    bool exceeded = false;
+    int  error    = LuaBytecodeCache::instance().load(_lstate, _code) || LuaVm::call(_lstate, 0, LUA_MULTRET, exceeded);
+    _valid        = (error == 0);
     if (!_valid) {
-        throw std::runtime_error("Invalid LUA code!");
+        throw std::runtime_error(exceeded ? "LUA code exceeded instruction budget!" : "Invalid LUA code!");
     }
 
     // check wether there is main() function
@@ -81,18 +257,77 @@ void LuaRule::code(const std::string& newCode)
     }
 }
 
+void LuaRule::expression(const std::string& text)
+{
+    _clear();
+    try {
+        _expression.compile(text, _metrics.size() * (1 + _aggregates.size()));
+    } catch (...) {
+        _expression = Expression();
+        throw;
+    }
+    if (!_expression.bind(getGlobalVariables())) {
+        _expression = Expression();
+        throw std::runtime_error("Expression uses a name, which is not a variable of the rule!");
+    }
+    _valid = true;
+}
+
+void LuaRule::_fillAggregates(const cxxtools::SerializationInfo& rule)
+{
+    _historyWindow = 0;
+    _aggregates.clear();
+    if (rule.findMember("aggregates") == NULL) {
+        return;
+    }
+    auto aggregates = rule.getMember("aggregates");
+    if (aggregates.category() != cxxtools::SerializationInfo::Object) {
+        log_error("parameter 'aggregates' in json must be an object.");
+        throw std::runtime_error("parameter 'aggregates' in json must be an object.");
+    }
+    int window = 0;
+    aggregates.getMember("window") >>= window;
+    if (window <= 0) {
+        log_error("parameter 'window' of 'aggregates' must be a positive number of seconds.");
+        throw std::runtime_error("parameter 'window' of 'aggregates' must be a positive number of seconds.");
+    }
+    auto functions = aggregates.getMember("functions");
+    if (functions.category() != cxxtools::SerializationInfo::Array) {
+        log_error("parameter 'functions' of 'aggregates' must be an array.");
+        throw std::runtime_error("parameter 'functions' of 'aggregates' must be an array.");
+    }
+    functions >>= _aggregates;
+    for (const auto& function : _aggregates) {
+        if (!MetricAggregates::isKnown(function)) {
+            log_error("unknown aggregate function '%s'.", function.c_str());
+            throw std::runtime_error("unknown aggregate function '" + function + "'.");
+        }
+    }
+    _historyWindow = static_cast<uint64_t>(window);
+}
+
 int LuaRule::evaluate(const MetricList& metricList, PureAlert& pureAlert)
 {
     log_debug("LuaRule::evaluate %s", _name.c_str());
-    int res = 0;
 
     std::vector<double>      values;
     std::vector<std::string> auditValues;
-    int                      index = 0;
-    for (const auto& metric : _metrics) {
-        double value = metricList.find(metric);
+    int                      res = _inputs(metricList, values, auditValues);
+    if (res != RULE_RESULT_UNKNOWN) {
+        res = _outcome(static_cast<int>(luaEvaluate(values)), pureAlert);
+    }
+    _audit(auditValues, res, pureAlert);
+    return res;
+}
+
+int LuaRule::_inputs(const MetricList& metricList, std::vector<double>& values, std::vector<std::string>& auditValues)
+{
+    int res = 0;
+    for (size_t i = 0; i < _topics.size(); ++i) {
+        double             value  = metricList.find(_topics[i]);
+        const std::string& metric = TopicTable::instance().name(_topics[i]);
         if (std::isnan(value)) {
-            log_debug("metric#%d: %s = NaN", index, metric.c_str());
+            log_debug("metric#%zu: %s = NaN", i, metric.c_str());
             log_debug("Don't have everything for '%s' yet", _name.c_str());
             std::stringstream ss;
             ss << metric.c_str() << " = "
@@ -102,41 +337,70 @@ int LuaRule::evaluate(const MetricList& metricList, PureAlert& pureAlert)
             break;
         }
         values.push_back(value);
-        log_debug("metric#%d: %s = %lf", index, metric.c_str(), value);
+        log_debug("metric#%zu: %s = %lf", i, metric.c_str(), value);
         std::stringstream ss;
         ss << metric.c_str() << " = " << value;
         auditValues.push_back(ss.str());
-        index++;
     }
 
-    if (res != RULE_RESULT_UNKNOWN) {
-        int         status     = static_cast<int>(luaEvaluate(values));
-        const char* statusText = resultToString(status);
-        // log_debug("LuaRule::evaluate on %s gives '%s'", _name.c_str(), statusText);
-
-        auto outcome = _outcomes.find(statusText);
-        if (outcome != _outcomes.cend()) {
-            log_debug("LuaRule::evaluate %s START %s", _name.c_str(), outcome->second._severity.c_str());
-
-            // some known outcome was found
-            pureAlert = PureAlert(ALERT_START, static_cast<uint64_t>(::time(NULL)), outcome->second._description,
-                _element, outcome->second._severity, outcome->second._actions);
-            pureAlert.print();
-        } else if (status == RULE_RESULT_OK) {
-            log_debug("LuaRule::evaluate %s %s", _name.c_str(), "RESOLVED");
-
-            // When alert is resolved, it doesn't have new severity!!!!
-            pureAlert = PureAlert(
-                ALERT_RESOLVED, static_cast<uint64_t>(::time(NULL)), "everything is ok", _element, "OK", {""});
-            pureAlert.print();
-        } else {
-            log_error(
-                "LuaRule::evaluate %s has returned a result %s, but it is not specified in 'result' in the JSON rule "
-                "definition",
-                _name.c_str(), statusText);
+    // aggregates follow the values, metric by metric
+    for (size_t i = 0; res != RULE_RESULT_UNKNOWN && i < _topics.size() && !_aggregates.empty(); ++i) {
+        MetricAggregates aggregates;
+        if (!metricList.getAggregates(_topics[i], _historyWindow, aggregates) || aggregates._count == 0) {
+            log_debug("Don't have history of '%s' for '%s' yet", TopicTable::instance().name(_topics[i]).c_str(),
+                _name.c_str());
             res = RULE_RESULT_UNKNOWN;
+            break;
         }
+        for (const auto& function : _aggregates) {
+            double value = 0;
+            aggregates.get(function, value);
+            values.push_back(value);
+            std::stringstream ss;
+            ss << function << "(" << TopicTable::instance().name(_topics[i]) << ") = " << value;
+            auditValues.push_back(ss.str());
+        }
+    }
+
+    if (res != RULE_RESULT_UNKNOWN && _usage._quarantined) {
+        log_debug("Rule '%s' is quarantined", _name.c_str());
+        res = RULE_RESULT_UNKNOWN;
     }
+    return res;
+}
+
+int LuaRule::_outcome(int status, PureAlert& pureAlert)
+{
+    const char* statusText = resultToString(status);
+    // log_debug("LuaRule::evaluate on %s gives '%s'", _name.c_str(), statusText);
+
+    auto outcome = _outcomes.find(statusText);
+    if (outcome != _outcomes.cend()) {
+        log_debug("LuaRule::evaluate %s START %s", _name.c_str(), outcome->second._severity.c_str());
+
+        // some known outcome was found
+        pureAlert = PureAlert(ALERT_START, static_cast<uint64_t>(::time(NULL)), outcome->second._description,
+            _element, outcome->second._severity, outcome->second._actions);
+        pureAlert.print();
+    } else if (status == RULE_RESULT_OK) {
+        log_debug("LuaRule::evaluate %s %s", _name.c_str(), "RESOLVED");
+
+        // When alert is resolved, it doesn't have new severity!!!!
+        pureAlert = PureAlert(
+            ALERT_RESOLVED, static_cast<uint64_t>(::time(NULL)), "everything is ok", _element, "OK", {""});
+        pureAlert.print();
+    } else {
+        log_error(
+            "LuaRule::evaluate %s has returned a result %s, but it is not specified in 'result' in the JSON rule "
+            "definition",
+            _name.c_str(), statusText);
+        return RULE_RESULT_UNKNOWN;
+    }
+    return 0;
+}
+
+void LuaRule::_audit(const std::vector<std::string>& auditValues, int res, const PureAlert& pureAlert)
+{
     std::stringstream ss;
     std::for_each(begin(auditValues), end(auditValues), [&ss](const std::string& elem) {
         if (ss.str().empty())
@@ -147,35 +411,190 @@ int LuaRule::evaluate(const MetricList& metricList, PureAlert& pureAlert)
     log_info_alarms_engine_audit("Evaluate rule '%s' [%s] -> %s %s", _name.c_str(), ss.str().c_str(),
         (res == RULE_RESULT_UNKNOWN) ? ALERT_UNKNOWN : pureAlert._status.c_str(),
         (res == RULE_RESULT_UNKNOWN) ? "" : pureAlert._severity.c_str());
-    return res;
 }
 
 double LuaRule::luaEvaluate(const std::vector<double>& metrics)
+{
+    if (!_expression.text().empty()) {
+        if (!_valid || metrics.size() < _metrics.size() * (1 + _aggregates.size())) {
+            throw std::runtime_error("Rule is not valid!");
+        }
+        return _expression.evaluate(metrics);
+    }
+    if (_valid && _native.isValid() && metrics.size() >= _native.inputs()) {
+        return _native.evaluate(metrics);
+    }
+    if (_valid && _compiled.isValid() && metrics.size() >= _compiled.inputs()) {
+        return _compiled.evaluate(metrics);
+    }
+    return callMain(metrics);
+}
+
+double LuaRule::callMain(const std::vector<double>& metrics)
 {
     double result;
 
     if (!_valid) {
         throw std::runtime_error("Rule is not valid!");
     }
-    lua_settop(_lstate, 0);
+    if (_usage._quarantined) {
+        throw std::runtime_error("Rule is quarantined!");
+    }
+    lua_State*    state     = _lstate;
+    LuaAllocator* allocator = _allocator.get();
+    int           account   = _account;
+    if (_shared) {
+        Binding& binding = _binding();
+        state            = binding._vm->state();
+        allocator        = &binding._vm->allocator();
+        account          = binding._account;
+        lua_settop(state, 0);
+        lua_rawgeti(state, LUA_REGISTRYINDEX, binding._main);
+    } else {
+        lua_settop(state, 0);
+        lua_getglobal(state, "main");
+    }
+    LuaAllocator::Charge charge(allocator, account);
+    size_t               limit = s_memoryLimit;
+    if (limit > 0 && allocator->used(account) > limit / 2) {
+        // garbage of the rule may be still charged to it, collect it before the rule fails on the limit
+        lua_gc(state, LUA_GCCOLLECT, 0);
+    }
 
-    lua_getglobal(_lstate, "main");
     for (const auto x : metrics) {
-        lua_pushnumber(_lstate, x);
+        lua_pushnumber(state, x);
     }
-    if (lua_pcall(_lstate, static_cast<int>(metrics.size()), 1, 0) != 0) {
-        throw std::runtime_error("LUA calling main() failed!");
+    bool     exceeded = false;
+    uint64_t start    = LuaVm::cpuTime();
+    int      error    = LuaVm::call(state, static_cast<int>(metrics.size()), 1, exceeded);
+    if (error != 0) {
+        lua_settop(state, 0);
     }
-    if (!lua_isnumber(_lstate, -1)) {
+    _count(LuaVm::cpuTime() - start, exceeded, error);
+    if (!lua_isnumber(state, -1)) {
+        lua_settop(state, 0);
         throw std::runtime_error("LUA main function did not returned number!");
     }
-    result = lua_tonumber(_lstate, -1);
-    lua_pop(_lstate, 1);
+    result = lua_tonumber(state, -1);
+    lua_pop(state, 1);
     return result;
 }
 
+void LuaRule::_count(uint64_t cpuTime, bool exceeded, int error)
+{
+    _usage._cpuTime += cpuTime;
+    _usage._evaluations++;
+    if (exceeded) {
+        _usage._overruns++;
+        _usage._consecutiveOverruns++;
+        if (s_quarantineAfter > 0 && _usage._consecutiveOverruns >= s_quarantineAfter) {
+            _usage._quarantined = true;
+            log_error("Rule '%s' exceeded the instruction budget %u times in a row, it is quarantined", _name.c_str(),
+                _usage._consecutiveOverruns);
+        }
+    } else {
+        _usage._consecutiveOverruns = 0;
+    }
+    if (error == LUA_ERRMEM) {
+        _usage._memoryErrors++;
+        throw std::runtime_error("LUA main() exceeded memory limit!");
+    }
+    if (error != 0) {
+        throw std::runtime_error(exceeded ? "LUA main() exceeded instruction budget!" : "LUA calling main() failed!");
+    }
+}
+
+bool LuaRule::_batched(const std::vector<double>& metrics) const
+{
+    return _shared && _valid && !_usage._quarantined && _expression.text().empty() &&
+           !(_native.isValid() && metrics.size() >= _native.inputs()) &&
+           !(_compiled.isValid() && metrics.size() >= _compiled.inputs());
+}
+
+void LuaRule::evaluateBatch(const std::vector<LuaRule*>& rules, const MetricList& metricList,
+    std::vector<PureAlert>& alerts, std::vector<int>& results)
+{
+    // rule waiting for the call of its main()
+    struct Pending
+    {
+        size_t                   _index;
+        Binding*                 _binding;
+        std::vector<double>      _values;
+        std::vector<std::string> _auditValues;
+    };
+    std::vector<Pending> pending;
+    // chunk -> pending rules using it
+    std::map<int, std::vector<size_t>> groups;
+
+    alerts.assign(rules.size(), PureAlert());
+    results.assign(rules.size(), -1);
+    std::shared_ptr<LuaVm> vm      = LuaVm::local();
+    bool                   collect = false;
+    for (size_t i = 0; i < rules.size(); ++i) {
+        LuaRule* rule = rules[i];
+        log_debug("LuaRule::evaluateBatch %s", rule->_name.c_str());
+        try {
+            Pending it{i, NULL, {}, {}};
+            results[i] = rule->_inputs(metricList, it._values, it._auditValues);
+            if (results[i] != RULE_RESULT_UNKNOWN && rule->_batched(it._values)) {
+                it._binding  = &rule->_binding();
+                size_t limit = s_memoryLimit;
+                collect      = collect || (limit > 0 && vm->allocator().used(it._binding->_account) > limit / 2);
+                groups[it._binding->_chunk].push_back(pending.size());
+                pending.push_back(std::move(it));
+                continue;
+            }
+            // not evaluated by Lua of this thread
+            if (results[i] != RULE_RESULT_UNKNOWN) {
+                results[i] = rule->_outcome(static_cast<int>(rule->luaEvaluate(it._values)), alerts[i]);
+            }
+            rule->_audit(it._auditValues, results[i], alerts[i]);
+        } catch (const std::exception& e) {
+            log_error("CANNOT evaluate rule, because '%s'", e.what());
+            results[i] = -1;
+        }
+    }
+    if (collect) {
+        // garbage of the rules may be still charged to them, collect it before they fail on the limit
+        lua_gc(vm->state(), LUA_GCCOLLECT, 0);
+    }
+
+    // one call of Lua per group of rules sharing the code
+    std::vector<LuaVm::BatchCall> calls;
+    for (const auto& group : groups) {
+        calls.clear();
+        for (size_t index : group.second) {
+            const Pending& it = pending[index];
+            calls.push_back(LuaVm::BatchCall{it._binding->_main, it._binding->_account, &it._values});
+        }
+        vm->callBatch(calls);
+        for (size_t j = 0; j < calls.size(); ++j) {
+            const Pending& it   = pending[group.second[j]];
+            LuaRule*       rule = rules[it._index];
+            try {
+                rule->_count(calls[j]._cpuTime, calls[j]._exceeded, calls[j]._error);
+                results[it._index] = rule->_outcome(static_cast<int>(calls[j]._result), alerts[it._index]);
+                rule->_audit(it._auditValues, results[it._index], alerts[it._index]);
+            } catch (const std::exception& e) {
+                log_error("CANNOT evaluate rule, because '%s'", e.what());
+                results[it._index] = -1;
+            }
+        }
+    }
+}
+
 void LuaRule::_setGlobalVariablesToLUA()
 {
+    // a threshold missing in variables is nil in Lua, such rule is left to Lua
+    _native.bind(getGlobalVariables());
+    _compiled.bind(getGlobalVariables());
+    if (!_expression.bind(getGlobalVariables())) {
+        log_error("rule '%s' lost a variable used in the expression, keeping the old values", _name.c_str());
+    }
+    for (const auto& binding : _bindings) {
+        LuaAllocator::Charge charge(&binding._vm->allocator(), binding._account);
+        binding._vm->setVariables(binding._environment, getGlobalVariables());
+    }
     if (_lstate == NULL)
         return;
     for (int i = RULE_RESULT_TO_LOW_CRITICAL; i <= RULE_RESULT_UNKNOWN; i++) {
@@ -23,8 +23,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
+#include "expression.h"
+#include "luavm.h"
 #include "rule.h"
+#include "templateevaluator.h"
+#include "thresholdchain.h"
 #include <lua5.1/lua.h>
+#include <memory>
 
 class LuaRule : public Rule
 {
@@ -39,17 +44,190 @@ public:
     {
         return _code;
     };
-    void   globalVariables(const std::map<std::string, double>& vars);
-    int    evaluate(const MetricList& metricList, PureAlert& pureAlert);
-    double luaEvaluate(const std::vector<double>& metrics);
+
+    /// Sets the expression evaluating the rule instead of Lua code, see Expression
+    ///
+    /// Targets and aggregates of the rule must be known, they give the number of values of the expression.
+    /// ATTENTION: throws, if the expression has errors
+    void expression(const std::string& text);
+    void     globalVariables(const std::map<std::string, double>& vars);
+    int      evaluate(const MetricList& metricList, PureAlert& pureAlert);
+    double   luaEvaluate(const std::vector<double>& metrics);
+
+    /// Calls main() of the code by Lua, even if the rule is evaluated natively
+    double callMain(const std::vector<double>& metrics);
+
+    /// Checks if the code is a threshold chain evaluated without Lua, see ThresholdChain
+    bool nativeEvaluator(void) const
+    {
+        return _native.isValid();
+    }
+
+    /// Gets the name of the template, whose native evaluator evaluates the rule, NULL if none (see TemplateEvaluator)
+    const char* compiledTemplate(void) const
+    {
+        return _compiled.isValid() ? _compiled.name() : NULL;
+    }
+
+    uint64_t historyWindow(void) const
+    {
+        return _historyWindow;
+    }
     ~LuaRule();
 
+    /// Sets how rules created from now on run their code
+    ///
+    /// Shared: code of all rules evaluated by one thread lives in one state of the thread (see LuaVm), private:
+    /// every rule has its own state.
+    static void sharedVm(bool shared);
+    static bool sharedVm(void);
+
+    /// Sets number of consecutive evaluations exceeding the instruction budget (see LuaVm::instructionBudget()),
+    /// after which the rule is quarantined: it is not evaluated anymore, until it is updated. 0 never quarantines.
+    static void quarantineAfter(unsigned overruns);
+    static unsigned quarantineAfter(void);
+
+    /// Sets maximum memory of Lua objects of rules created from now on [B], 0 means no limit
+    ///
+    /// Evaluation allocating over the limit fails.
+    static void   memoryLimit(size_t bytes);
+    static size_t memoryLimit(void);
+
+    /// Gets memory of Lua objects of the rule in all its states [B]
+    size_t memory(void) const;
+
+    /// Releases the code from all shared states, it is bound again by the next evaluation
+    ///
+    /// States of threads, which don't evaluate the rule anymore (e.g. stopped workers), are freed with the last
+    /// rule bound there. Must not be called while any thread evaluates the rule.
+    void releaseBindings(void);
+
+    /// Enables evaluation of rules by evaluateBatch()
+    static void batchEvaluation(bool batch);
+    static bool batchEvaluation(void);
+
+    /// Evaluates rules by one call of Lua per group of rules sharing the code (see LuaVm::callBatch())
+    ///
+    /// Rules not evaluated by Lua of the calling thread (private states, native evaluation, missing inputs) are
+    /// evaluated one by one. Must be called by the thread evaluating the rules.
+    /// @param[in] rules - rules to evaluate, every one only once
+    /// @param[in] metricList - known metrics
+    /// @param[out] alerts - alert of every rule
+    /// @param[out] results - result of evaluate() of every rule, -1 if the evaluation failed
+    static void evaluateBatch(const std::vector<LuaRule*>& rules, const MetricList& metricList,
+        std::vector<PureAlert>& alerts, std::vector<int>& results);
+
+    /// Usage of Lua by the rule
+    struct Usage
+    {
+        // calls of main()
+        uint64_t _evaluations = 0;
+        // CPU time of the calls [us]
+        uint64_t _cpuTime = 0;
+        // calls stopped because of the instruction budget
+        uint64_t _overruns = 0;
+        // calls failed because of the memory limit
+        uint64_t _memoryErrors = 0;
+        // the last consecutive calls stopped because of the instruction budget
+        unsigned _consecutiveOverruns = 0;
+        bool     _quarantined         = false;
+    };
+
+    const Usage& usage(void) const
+    {
+        return _usage;
+    }
+
 protected:
     void _setGlobalVariablesToLUA();
 
+    /// Gets the values passed to main() and their audit texts
+    /// @return RULE_RESULT_UNKNOWN if some input is missing or the rule is quarantined, 0 otherwise
+    int _inputs(const MetricList& metricList, std::vector<double>& values, std::vector<std::string>& auditValues);
+
+    /// Makes the alert of the status returned by main()
+    /// @return RULE_RESULT_UNKNOWN if the status has no outcome, 0 otherwise
+    int _outcome(int status, PureAlert& pureAlert);
+
+    /// Logs the evaluation to the audit log
+    void _audit(const std::vector<std::string>& auditValues, int res, const PureAlert& pureAlert);
+
+    /// Counts the call of main() in the usage
+    ///
+    /// ATTENTION: throws, if the call failed
+    void _count(uint64_t cpuTime, bool exceeded, int error);
+
+    /// Checks if the rule with these values is evaluated by main() in the state of the calling thread
+    bool _batched(const std::vector<double>& metrics) const;
+
+    /// Drops the code or the expression of the rule
+    void _clear(void);
+
+    /// Checks _code runs and defines main() in the scratch state of the calling thread, code is not kept there
+    ///
+    /// One scratch state is reused for all rules, so checking a rule costs no new state nor libraries.
+    ///
+    /// ATTENTION: throws, if the code is not valid
+    void _check(void);
+
+    /// Loads _code in a new private state of the rule, checks it runs and defines main()
+    ///
+    /// ATTENTION: throws, if state can't be created or the code is not valid
+    void _open(void);
+
+    /// Reads optional "aggregates" of the rule
+    ///
+    /// "aggregates": { "window": 300, "functions": ["mean", "max"] } passes the aggregates of every metric over
+    /// the last 300 s to main() after the metric values, metric by metric, in the order of functions.
+    ///
+    /// ATTENTION: throws, if bad JSON
+    void _fillAggregates(const cxxtools::SerializationInfo& rule);
+
+    /// Window of the history [s], 0 if no aggregates are needed
+    uint64_t _historyWindow = 0;
+
+    /// Names of the aggregates passed to main(), see MetricAggregates
+    std::vector<std::string> _aggregates;
+
     bool       _valid  = false;
     lua_State* _lstate = NULL;
 
+    /// Code of the rule loaded in a shared state and the memory account of the rule there
+    struct Binding
+    {
+        std::shared_ptr<LuaVm> _vm;
+        int                    _environment;
+        int                    _chunk;
+        int                    _main;
+        int                    _account;
+    };
+
+    /// Gets binding of the state of the calling thread, code is loaded there the first time
+    ///
+    /// Code is bound lazily by the evaluation, so only the states of the threads evaluating the rule hold it.
+    Binding& _binding(void);
+
+    /// Allocator of the private state and the account of the code in it
+    std::unique_ptr<LuaAllocator> _allocator;
+    int                           _account = LuaAllocator::STATE;
+
+    /// true if the code runs in shared states
+    bool _shared = false;
+
+    /// Shared states the code is loaded in (one per evaluating thread)
+    std::vector<Binding> _bindings;
+
+    /// Native form of the code, valid only if the code is a threshold chain
+    ThresholdChain _native;
+
+    /// Evaluator generated from the template with the same code, used if the code is not a threshold chain
+    TemplateEvaluator _compiled;
+
+    /// Expression evaluating the rule, used instead of the code if its text is not empty
+    Expression _expression;
+
+    Usage _usage;
+
 private:
     std::string _code;
 };
@@ -0,0 +1,337 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "luavm.h"
+#include "luabytecodecache.h"
+#include "luafty.h"
+#include "rule.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <fty_log.h>
+#include <lua5.1/lauxlib.h>
+#include <lua5.1/lualib.h>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <time.h>
+
+static std::mutex                        s_statesMutex;
+static std::vector<std::weak_ptr<LuaVm>> s_states;
+static std::atomic<int>                  s_instructionBudget{0};
+
+// set by the hook, when the call running in this thread exceeds the budget
+static thread_local bool s_exceeded = false;
+
+static void s_budgetHook(lua_State* state, lua_Debug* /* debug */)
+{
+    s_exceeded = true;
+    luaL_error(state, "instruction budget exceeded");
+}
+
+// Calls main() of every call in the batch: finish(i, pcall(prepare(i)))
+static const char* s_batchWrapper = "local prepare, finish, pcall = ...\n"
+                                    "return function(n)\n"
+                                    "    for i = 1, n do\n"
+                                    "        finish(i, pcall(prepare(i)))\n"
+                                    "    end\n"
+                                    "end\n";
+
+void LuaVm::instructionBudget(int budget)
+{
+    s_instructionBudget = budget;
+}
+
+int LuaVm::instructionBudget(void)
+{
+    return s_instructionBudget;
+}
+
+int LuaVm::call(lua_State* state, int arguments, int results, bool& exceeded)
+{
+    int           budget    = s_instructionBudget;
+    LuaAllocator* allocator = LuaAllocator::of(state);
+    s_exceeded              = false;
+    if (budget > 0) {
+        lua_sethook(state, s_budgetHook, LUA_MASKCOUNT, budget);
+    }
+    if (allocator) {
+        allocator->enforce(true);
+    }
+    int result = lua_pcall(state, arguments, results, 0);
+    if (allocator) {
+        allocator->enforce(false);
+    }
+    if (budget > 0) {
+        lua_sethook(state, NULL, 0, 0);
+    }
+    exceeded   = s_exceeded;
+    s_exceeded = false;
+    return result;
+}
+
+uint64_t LuaVm::cpuTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + static_cast<uint64_t>(now.tv_nsec) / 1000;
+}
+
+LuaVm::LuaVm()
+{
+    _state = _allocator.newState();
+    if (!_state) {
+        throw std::runtime_error("Can't initiate LUA context!");
+    }
+    luaL_openlibs(_state);
+    lua_pushcfunction(_state, luaopen_fty);
+    lua_call(_state, 0, 0);
+
+    for (int i = RULE_RESULT_TO_LOW_CRITICAL; i <= RULE_RESULT_UNKNOWN; i++) {
+        std::string upper = Rule::resultToString(i);
+        transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        lua_pushnumber(_state, i);
+        lua_setglobal(_state, upper.c_str());
+    }
+
+    if (luaL_loadstring(_state, s_batchWrapper) != 0) {
+        lua_close(_state);
+        throw std::runtime_error("Can't compile LUA batch wrapper!");
+    }
+    lua_pushlightuserdata(_state, this);
+    lua_pushcclosure(_state, s_prepare, 1);
+    lua_pushlightuserdata(_state, this);
+    lua_pushcclosure(_state, s_finish, 1);
+    lua_getglobal(_state, "pcall");
+    if (lua_pcall(_state, 3, 1, 0) != 0) {
+        lua_close(_state);
+        throw std::runtime_error("Can't create LUA batch wrapper!");
+    }
+    _batch = luaL_ref(_state, LUA_REGISTRYINDEX);
+}
+
+LuaVm::~LuaVm()
+{
+    lua_close(_state);
+}
+
+std::shared_ptr<LuaVm> LuaVm::local(void)
+{
+    static thread_local std::shared_ptr<LuaVm> vm;
+    if (!vm) {
+        vm = std::make_shared<LuaVm>();
+        std::lock_guard<std::mutex> lock(s_statesMutex);
+        s_states.push_back(vm);
+    }
+    return vm;
+}
+
+std::vector<std::shared_ptr<LuaVm>> LuaVm::all(void)
+{
+    std::vector<std::shared_ptr<LuaVm>> result;
+    std::lock_guard<std::mutex>         lock(s_statesMutex);
+    for (auto it = s_states.begin(); it != s_states.end();) {
+        if (auto vm = it->lock()) {
+            result.push_back(vm);
+            ++it;
+        } else {
+            it = s_states.erase(it);
+        }
+    }
+    return result;
+}
+
+int LuaVm::newEnvironment(const std::map<std::string, double>& variables)
+{
+    lua_newtable(_state);
+    // names not defined by the rule are looked up in globals
+    lua_newtable(_state);
+    lua_pushvalue(_state, LUA_GLOBALSINDEX);
+    lua_setfield(_state, -2, "__index");
+    lua_setmetatable(_state, -2);
+    int environment = luaL_ref(_state, LUA_REGISTRYINDEX);
+    setVariables(environment, variables);
+    return environment;
+}
+
+void LuaVm::setVariables(int environment, const std::map<std::string, double>& variables)
+{
+    lua_rawgeti(_state, LUA_REGISTRYINDEX, environment);
+    for (const auto& it : variables) {
+        lua_pushnumber(_state, it.second);
+        lua_setfield(_state, -2, it.first.c_str());
+    }
+    lua_pop(_state, 1);
+}
+
+int LuaVm::chunk(const std::string& code)
+{
+    uint64_t hash  = utils::fnv1a64(code.data(), code.size());
+    auto     range = _chunksByHash.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (_chunks.at(it->second)._code == code) {
+            return it->second;
+        }
+    }
+
+    // compiled chunk is shared by the rules, it is charged to the state
+    LuaAllocator::Charge charge(&_allocator, LuaAllocator::STATE);
+    if (LuaBytecodeCache::instance().load(_state, code) != 0) {
+        lua_settop(_state, 0);
+        throw std::runtime_error("Invalid LUA code!");
+    }
+    int chunk = luaL_ref(_state, LUA_REGISTRYINDEX);
+    _chunks.emplace(chunk, Chunk{hash, code, 0});
+    _chunksByHash.emplace(hash, chunk);
+    return chunk;
+}
+
+int LuaVm::load(int environment, const std::string& code, int& chunk)
+{
+    lua_settop(_state, 0);
+    int compiled = this->chunk(code);
+
+    // chunk runs in the environment of the rule, so it defines main() there
+    lua_rawgeti(_state, LUA_REGISTRYINDEX, compiled);
+    lua_rawgeti(_state, LUA_REGISTRYINDEX, environment);
+    lua_setfenv(_state, -2);
+    bool exceeded = false;
+    bool valid    = (call(_state, 0, 0, exceeded) == 0);
+
+    // main() of this rule, not the one of globals
+    if (valid) {
+        lua_rawgeti(_state, LUA_REGISTRYINDEX, environment);
+        lua_pushstring(_state, "main");
+        lua_rawget(_state, -2);
+    }
+    if (!valid || !lua_isfunction(_state, -1)) {
+        lua_settop(_state, 0);
+        _chunks.at(compiled)._users++;
+        releaseChunk(compiled);
+        if (exceeded) {
+            throw std::runtime_error("LUA code exceeded instruction budget!");
+        }
+        throw std::runtime_error(valid ? "Function main not found!" : "Invalid LUA code!");
+    }
+    int main = luaL_ref(_state, LUA_REGISTRYINDEX);
+    lua_settop(_state, 0);
+
+    _chunks.at(compiled)._users++;
+    chunk = compiled;
+    return main;
+}
+
+void LuaVm::unref(int reference)
+{
+    luaL_unref(_state, LUA_REGISTRYINDEX, reference);
+}
+
+void LuaVm::releaseChunk(int chunk)
+{
+    auto it = _chunks.find(chunk);
+    if (it == _chunks.end() || --it->second._users > 0) {
+        return;
+    }
+    auto range = _chunksByHash.equal_range(it->second._hash);
+    for (auto it_hash = range.first; it_hash != range.second; ++it_hash) {
+        if (it_hash->second == chunk) {
+            _chunksByHash.erase(it_hash);
+            break;
+        }
+    }
+    _chunks.erase(it);
+    unref(chunk);
+}
+
+void LuaVm::chunks(std::vector<ChunkUsers>& chunks) const
+{
+    for (const auto& it : _chunks) {
+        chunks.push_back(ChunkUsers{it.second._hash, it.second._users});
+    }
+}
+
+void LuaVm::callBatch(std::vector<BatchCall>& calls)
+{
+    if (calls.empty()) {
+        return;
+    }
+    int previous = _allocator.charge(LuaAllocator::STATE);
+    _calls       = &calls;
+    lua_settop(_state, 0);
+    lua_rawgeti(_state, LUA_REGISTRYINDEX, _batch);
+    lua_pushnumber(_state, static_cast<lua_Number>(calls.size()));
+    _allocator.enforce(true);
+    // errors of main() are caught by the wrapper, this fails only if the wrapper itself does
+    int error = lua_pcall(_state, 1, 0, 0);
+    _allocator.enforce(false);
+    lua_sethook(_state, NULL, 0, 0);
+    if (error != 0) {
+        // calls not finished keep LUA_ERRRUN
+        log_error("LUA batch of %zu calls failed: %s", calls.size(), lua_tostring(_state, -1));
+    }
+    lua_settop(_state, 0);
+    _allocator.charge(previous);
+    _calls     = NULL;
+    s_exceeded = false;
+}
+
+// prepare(i): returns main() of the i-th call and its arguments, arms the budget and the account of the call
+int LuaVm::s_prepare(lua_State* state)
+{
+    LuaVm*     vm   = static_cast<LuaVm*>(lua_touserdata(state, lua_upvalueindex(1)));
+    BatchCall& call = (*vm->_calls)[static_cast<size_t>(lua_tonumber(state, 1)) - 1];
+    lua_settop(state, 0);
+    luaL_checkstack(state, static_cast<int>(call._arguments->size()) + 1, "too many arguments of main()");
+    lua_rawgeti(state, LUA_REGISTRYINDEX, call._main);
+    for (const auto x : *call._arguments) {
+        lua_pushnumber(state, x);
+    }
+    vm->_allocator.charge(call._account);
+    int budget = s_instructionBudget;
+    s_exceeded = false;
+    if (budget > 0) {
+        // it also restarts the count
+        lua_sethook(state, s_budgetHook, LUA_MASKCOUNT, budget);
+    }
+    vm->_callStart = cpuTime();
+    return lua_gettop(state);
+}
+
+// finish(i, ok, result): stores the result of the i-th call, the wrapper runs without the budget
+int LuaVm::s_finish(lua_State* state)
+{
+    uint64_t end = cpuTime();
+    lua_sethook(state, NULL, 0, 0);
+    LuaVm* vm = static_cast<LuaVm*>(lua_touserdata(state, lua_upvalueindex(1)));
+    vm->_allocator.charge(LuaAllocator::STATE);
+    BatchCall& call = (*vm->_calls)[static_cast<size_t>(lua_tonumber(state, 1)) - 1];
+    call._cpuTime   = end - vm->_callStart;
+    call._exceeded  = s_exceeded;
+    s_exceeded      = false;
+    if (!lua_toboolean(state, 2)) {
+        // pcall() of Lua doesn't tell the kind of the error, memory error has a fixed message
+        const char* message = lua_tostring(state, 3);
+        call._error         = (message && strcmp(message, "not enough memory") == 0) ? LUA_ERRMEM : LUA_ERRRUN;
+    } else if (lua_isnumber(state, 3)) {
+        call._error  = 0;
+        call._result = lua_tonumber(state, 3);
+    } else {
+        call._error = LUA_ERRRUN;
+    }
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file luavm.h
+/// @brief Lua state shared by the rules evaluated in one thread
+#pragma once
+
+#include "luaallocator.h"
+#include <cstdint>
+#include <lua5.1/lua.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// Lua state shared by the rules evaluated in one thread
+///
+/// Every rule gets its own environment table with its variables, the chunk of the rule runs in it, so global
+/// names defined by the rule (main() included) don't clash with other rules. Environment falls back to the
+/// globals of the state for the libraries and the result constants (OK, HIGH_CRITICAL, ...), which are set
+/// only once per state.
+///
+/// Code is compiled once per state: rules with the same code (e.g. rules from one template) share the compiled
+/// chunk, which is only run in the environment of every rule, so functions of all those rules share prototypes.
+///
+/// State is not thread safe, every thread has its own one (see local()). Functions and environments are
+/// kept as references in the registry of the state and have to be released by unref(), chunks by
+/// releaseChunk().
+class LuaVm
+{
+public:
+    /// Creates state with standard libraries and result constants
+    ///
+    /// ATTENTION: throws, if state can't be created
+    LuaVm();
+
+    ~LuaVm();
+
+    LuaVm(const LuaVm&) = delete;
+    LuaVm& operator=(const LuaVm&) = delete;
+
+    /// Gets the state of the calling thread, it is created the first time
+    ///
+    /// State lives as long as the thread or any rule holding it.
+    static std::shared_ptr<LuaVm> local(void);
+
+    /// Gets all living states
+    ///
+    /// ATTENTION: states belong to other threads, inspect them only when those threads don't evaluate rules
+    static std::vector<std::shared_ptr<LuaVm>> all(void);
+
+    /// Sets the maximum number of Lua instructions of one call by call(), 0 means no limit
+    static void instructionBudget(int budget);
+    static int  instructionBudget(void);
+
+    /// Calls the function on the stack like lua_pcall(), but stops it when it exceeds the instruction budget
+    ///
+    /// Limits of the memory accounts (see LuaAllocator) are enforced during the call.
+    ///
+    /// @param[in] state - Lua state (shared or private one)
+    /// @param[in] arguments - number of arguments on the stack
+    /// @param[in] results - number of results
+    /// @param[out] exceeded - true if the call was stopped because of the budget
+    /// @return result of lua_pcall()
+    static int call(lua_State* state, int arguments, int results, bool& exceeded);
+
+    /// Gets CPU time of the calling thread [us]
+    static uint64_t cpuTime(void);
+
+    /// One call of main() in a batch, see callBatch()
+    struct BatchCall
+    {
+        // reference to main() of the rule
+        int _main;
+        // memory account charged by the call
+        int                        _account;
+        const std::vector<double>* _arguments;
+        // 0 if main() returned a number, LUA_ERRRUN if it failed or returned something else, LUA_ERRMEM if it
+        // exceeded the memory limit
+        int    _error    = LUA_ERRRUN;
+        bool   _exceeded = false;
+        double _result   = 0;
+        // CPU time of the call [us]
+        uint64_t _cpuTime = 0;
+    };
+
+    /// Calls main() of several rules by one call of Lua
+    ///
+    /// Wrapper compiled in the state loops over the calls and runs every main() in a protected call with its own
+    /// instruction budget and memory account, so a failing rule doesn't stop the others. Rules sharing one chunk
+    /// (e.g. rules from one template) are evaluated this way without crossing the C/Lua boundary rule by rule.
+    ///
+    /// @param[in,out] calls - calls and their results
+    void callBatch(std::vector<BatchCall>& calls);
+
+    /// Gets the raw state
+    lua_State* state(void)
+    {
+        return _state;
+    }
+
+    /// Gets the allocator of the state
+    LuaAllocator& allocator(void)
+    {
+        return _allocator;
+    }
+
+    /// Creates environment of a rule
+    ///
+    /// @param[in] variables - variables of the rule
+    /// @return reference to the environment
+    int newEnvironment(const std::map<std::string, double>& variables);
+
+    /// Sets variables of the rule
+    ///
+    /// @param[in] environment - reference to the environment of the rule
+    /// @param[in] variables - variables of the rule
+    void setVariables(int environment, const std::map<std::string, double>& variables);
+
+    /// Runs the code of the rule in its environment
+    ///
+    /// Code is compiled only if there is no chunk with the same code in the state yet.
+    ///
+    /// ATTENTION: throws, if code is not valid or it doesn't define main()
+    ///
+    /// @param[in] environment - reference to the environment of the rule
+    /// @param[in] code - code of the rule
+    /// @param[out] chunk - chunk used by the rule, must be released by releaseChunk()
+    /// @return reference to the function main()
+    int load(int environment, const std::string& code, int& chunk);
+
+    /// Releases the reference
+    void unref(int reference);
+
+    /// Releases one use of the chunk, chunk is dropped when no rule uses it
+    void releaseChunk(int chunk);
+
+    /// Number of rules using one chunk
+    struct ChunkUsers
+    {
+        // hash of the code
+        uint64_t _hash;
+        size_t   _users;
+    };
+
+    /// Gets the chunks of the state
+    ///
+    /// @param[out] chunks - chunks (one per distinct code) and number of their users
+    void chunks(std::vector<ChunkUsers>& chunks) const;
+
+    /// Gets memory used by the state [KiB]
+    int memory(void) const
+    {
+        return lua_gc(_state, LUA_GCCOUNT, 0);
+    }
+
+private:
+    struct Chunk
+    {
+        uint64_t    _hash;
+        std::string _code;
+        size_t      _users;
+    };
+
+    /// Gets compiled chunk of the code, it is compiled if needed
+    /// @return reference to the chunk
+    int chunk(const std::string& code);
+
+    /// Functions called by the batch wrapper before and after main() of every call
+    static int s_prepare(lua_State* state);
+    static int s_finish(lua_State* state);
+
+    /// Allocator must outlive the state
+    LuaAllocator _allocator;
+    lua_State*   _state = NULL;
+
+    /// Compiled chunks by their reference
+    std::unordered_map<int, Chunk> _chunks;
+
+    /// References of the chunks by hash of the code
+    std::unordered_multimap<uint64_t, int> _chunksByHash;
+
+    /// Reference to the batch wrapper
+    int _batch = LUA_NOREF;
+
+    /// Calls of the running batch and start of the current call
+    std::vector<BatchCall>* _calls     = NULL;
+    uint64_t                _callStart = 0;
+};
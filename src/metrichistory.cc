@@ -0,0 +1,223 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "metrichistory.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <fty_log.h>
+
+bool MetricAggregates::get(const std::string& name, double& value) const
+{
+    if (name == "mean") {
+        value = _mean;
+    } else if (name == "min") {
+        value = _min;
+    } else if (name == "max") {
+        value = _max;
+    } else if (name == "rate") {
+        value = _rate;
+    } else if (name == "count") {
+        value = static_cast<double>(_count);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool MetricAggregates::isKnown(const std::string& name)
+{
+    double dummy;
+    return MetricAggregates().get(name, dummy);
+}
+
+void MetricHistory::Ring::clear(void)
+{
+    _first    = 0;
+    _end      = 0;
+    _sum      = 0;
+    _maxFirst = 0;
+    _maxEnd   = 0;
+    _minFirst = 0;
+    _minEnd   = 0;
+}
+
+void MetricHistory::Ring::dropOldest(void)
+{
+    _sum -= _values[_first % CAPACITY];
+    if (_maxFirst != _maxEnd && _maxQueue[_maxFirst % CAPACITY] == _first) {
+        _maxFirst++;
+    }
+    if (_minFirst != _minEnd && _minQueue[_minFirst % CAPACITY] == _first) {
+        _minFirst++;
+    }
+    _first++;
+    if (_first == _end) {
+        // no rounding errors accumulated in an empty ring
+        _sum = 0;
+    }
+}
+
+void MetricHistory::Ring::add(double value, uint64_t timestamp)
+{
+    // NaN or infinity would stay in the sum and break the order of the monotonic queues
+    if (!std::isfinite(value)) {
+        return;
+    }
+    // sample read again from shm or delivered late
+    if (_first != _end && _timestamps[(_end - 1) % CAPACITY] >= timestamp) {
+        return;
+    }
+    if (_end - _first == CAPACITY) {
+        dropOldest();
+    }
+    while (_first != _end && _timestamps[_first % CAPACITY] + _window < timestamp) {
+        dropOldest();
+    }
+
+    uint64_t seq                = _end++;
+    _values[seq % CAPACITY]     = value;
+    _timestamps[seq % CAPACITY] = timestamp;
+    _sum += value;
+
+    while (_maxFirst != _maxEnd && _values[_maxQueue[(_maxEnd - 1) % CAPACITY] % CAPACITY] <= value) {
+        _maxEnd--;
+    }
+    _maxQueue[_maxEnd++ % CAPACITY] = seq;
+
+    while (_minFirst != _minEnd && _values[_minQueue[(_minEnd - 1) % CAPACITY] % CAPACITY] >= value) {
+        _minEnd--;
+    }
+    _minQueue[_minEnd++ % CAPACITY] = seq;
+}
+
+void MetricHistory::Ring::aggregates(MetricAggregates& result) const
+{
+    result        = MetricAggregates();
+    result._count = _end - _first;
+    if (result._count == 0) {
+        return;
+    }
+    uint64_t oldest = _first % CAPACITY;
+    uint64_t newest = (_end - 1) % CAPACITY;
+
+    result._mean = _sum / static_cast<double>(result._count);
+    result._max  = _values[_maxQueue[_maxFirst % CAPACITY] % CAPACITY];
+    result._min  = _values[_minQueue[_minFirst % CAPACITY] % CAPACITY];
+    if (_timestamps[newest] > _timestamps[oldest]) {
+        result._rate = (_values[newest] - _values[oldest]) /
+                       static_cast<double>(_timestamps[newest] - _timestamps[oldest]);
+    }
+}
+
+MetricHistory::MetricHistory(size_t rings)
+    : _rings(rings)
+{
+    _free.reserve(rings);
+    for (size_t i = rings; i > 0; --i) {
+        _free.push_back(static_cast<uint32_t>(i - 1));
+    }
+}
+
+void MetricHistory::release(uint32_t ring)
+{
+    _rings[ring]._topic = TOPIC_NONE;
+    _rings[ring]._next  = NO_RING;
+    _rings[ring].clear();
+    _free.push_back(ring);
+}
+
+void MetricHistory::track(const std::vector<std::pair<TopicId, uint64_t>>& requests)
+{
+    // release rings which are not requested anymore
+    for (auto& head : _heads) {
+        uint32_t* link = &head;
+        while (*link != NO_RING) {
+            uint32_t ring = *link;
+            auto     it   = std::find(requests.begin(), requests.end(),
+                std::make_pair(_rings[ring]._topic, _rings[ring]._window));
+            if (it == requests.end()) {
+                *link = _rings[ring]._next;
+                release(ring);
+            } else {
+                link = &_rings[ring]._next;
+            }
+        }
+    }
+
+    // allocate rings for new requests
+    for (const auto& request : requests) {
+        if (request.first == TOPIC_NONE) {
+            continue;
+        }
+        if (request.first >= _heads.size()) {
+            _heads.resize(request.first + 1, NO_RING);
+        }
+        bool found = false;
+        for (uint32_t ring = _heads[request.first]; ring != NO_RING; ring = _rings[ring]._next) {
+            if (_rings[ring]._window == request.second) {
+                found = true;
+                break;
+            }
+        }
+        if (found) {
+            continue;
+        }
+        if (_free.empty()) {
+            log_warning("no history available for '%s' (window %" PRIu64 " s), all %zu rings are used",
+                TopicTable::instance().name(request.first).c_str(), request.second, _rings.size());
+            continue;
+        }
+        uint32_t ring = _free.back();
+        _free.pop_back();
+        _rings[ring].clear();
+        _rings[ring]._topic   = request.first;
+        _rings[ring]._window  = request.second;
+        _rings[ring]._next    = _heads[request.first];
+        _heads[request.first] = ring;
+    }
+}
+
+void MetricHistory::add(TopicId topic, double value, uint64_t timestamp)
+{
+    if (topic >= _heads.size()) {
+        return;
+    }
+    for (uint32_t ring = _heads[topic]; ring != NO_RING; ring = _rings[ring]._next) {
+        _rings[ring].add(value, timestamp);
+    }
+}
+
+bool MetricHistory::get(TopicId topic, uint64_t window, MetricAggregates& aggregates) const
+{
+    if (topic >= _heads.size()) {
+        return false;
+    }
+    for (uint32_t ring = _heads[topic]; ring != NO_RING; ring = _rings[ring]._next) {
+        if (_rings[ring]._window == window) {
+            _rings[ring].aggregates(aggregates);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t MetricHistory::used(void) const
+{
+    return _rings.size() - _free.size();
+}
@@ -0,0 +1,131 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file metrichistory.h
+/// @brief History of metric samples with window aggregates
+#pragma once
+
+#include "topictable.h"
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Aggregates of the metric samples in a time window
+struct MetricAggregates
+{
+    double   _mean  = 0;
+    double   _min   = 0;
+    double   _max   = 0;
+    // change of the value per second between the oldest and the newest sample
+    double   _rate  = 0;
+    uint64_t _count = 0;
+
+    /// Gets aggregate by name (mean, min, max, rate, count)
+    ///
+    /// @param[in] name - name of the aggregate
+    /// @param[out] value - value of the aggregate
+    /// @return true if the name is known
+    bool get(const std::string& name, double& value) const;
+
+    /// Checks if name of the aggregate is known
+    static bool isKnown(const std::string& name);
+};
+
+/// History of metric samples
+///
+/// History is kept only for topics requested by rules, every (topic, window) pair gets its own ring buffer of
+/// fixed size. Rings are taken from an arena allocated at once, so memory used by the history is bounded and
+/// known in advance. Aggregates are updated incrementally on every sample, min and max with monotonic queues,
+/// so both adding a sample and reading aggregates are O(1) (amortized).
+///
+/// Window is relative to the newest sample: samples older than (newest timestamp - window) are dropped, as well
+/// as the oldest samples if the ring is full. Samples not newer than the newest one are ignored, as well as
+/// samples, which are not finite (NaN, infinity).
+class MetricHistory
+{
+public:
+    /// Number of samples in one ring
+    static constexpr size_t CAPACITY = 64;
+
+    /// Creates history
+    /// @param[in] rings - size of the arena (number of rings), no history is kept with an empty arena
+    MetricHistory(size_t rings = 0);
+
+    /// Sets topics, which need the history
+    ///
+    /// History of pairs requested before is kept, rings of pairs not requested anymore are released.
+    /// @param[in] requests - <topic, window [s]> pairs
+    void track(const std::vector<std::pair<TopicId, uint64_t>>& requests);
+
+    /// Adds sample to all rings of the topic
+    void add(TopicId topic, double value, uint64_t timestamp);
+
+    /// Gets aggregates of the topic in the window
+    ///
+    /// @param[in] topic - topic
+    /// @param[in] window - window [s], must be requested by track() before
+    /// @param[out] aggregates - result
+    /// @return false if history of the topic in this window isn't tracked
+    bool get(TopicId topic, uint64_t window, MetricAggregates& aggregates) const;
+
+    /// Gets number of rings in use
+    size_t used(void) const;
+
+private:
+    static constexpr uint32_t NO_RING = UINT32_MAX;
+
+    struct Ring
+    {
+        TopicId  _topic  = TOPIC_NONE;
+        uint64_t _window = 0;
+        // next ring of the same topic or NO_RING
+        uint32_t _next = NO_RING;
+
+        // sequence numbers of the oldest sample and of the next sample, sample s is at s % CAPACITY
+        uint64_t _first = 0;
+        uint64_t _end   = 0;
+        double   _sum   = 0;
+        double   _values[CAPACITY];
+        uint64_t _timestamps[CAPACITY];
+
+        // monotonic queues of sequence numbers (decreasing values for max, increasing for min)
+        uint64_t _maxFirst = 0;
+        uint64_t _maxEnd   = 0;
+        uint64_t _maxQueue[CAPACITY];
+        uint64_t _minFirst = 0;
+        uint64_t _minEnd   = 0;
+        uint64_t _minQueue[CAPACITY];
+
+        void clear(void);
+        void add(double value, uint64_t timestamp);
+        void dropOldest(void);
+        void aggregates(MetricAggregates& result) const;
+    };
+
+    void release(uint32_t ring);
+
+    /// Preallocated rings
+    std::vector<Ring> _rings;
+
+    /// Free rings
+    std::vector<uint32_t> _free;
+
+    /// First ring of the topic, indexed by topic
+    std::vector<uint32_t> _heads;
+};
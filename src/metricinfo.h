@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 /// @author Alena Chernikava <AlenaChernikava@Eaton.com>
 /// @brief Very simple class to store information about one metric
 #pragma once
+#include "topictable.h"
 #include <string>
 
 class MetricInfo
@@ -31,27 +32,41 @@ public:
         return _source + "@" + _element_name;
     };
 
+    /// Gets identifier of the topic, see TopicTable
+    TopicId getTopicId(void) const
+    {
+        return _topic_id;
+    };
+
     MetricInfo()
         : _value{0}
         , _timestamp{0}
-        , _ttl{5 * 60} {};
+        , _ttl{5 * 60}
+        , _topic_id{TOPIC_NONE} {};
 
     MetricInfo(const std::string& element_name, const std::string& source, const std::string& units, double value,
         uint64_t timestamp, const std::string& destination, uint64_t ttl)
+        : MetricInfo(element_name, source, units, value, timestamp, destination, ttl,
+              TopicTable::instance().intern(source.c_str(), element_name.c_str())){};
+
+    /// Creates metric with already interned topic (source@element_name)
+    MetricInfo(const std::string& element_name, const std::string& source, const std::string& units, double value,
+        uint64_t timestamp, const std::string& destination, uint64_t ttl, TopicId topic_id)
         : _element_name(element_name)
         , _source(source)
         , _units(units)
         , _value(value)
         , _timestamp(timestamp)
         , _element_destination_name(destination)
-        , _ttl(ttl){};
+        , _ttl(ttl)
+        , _topic_id{topic_id} {};
 
     double getValue(void) const
     {
         return _value;
     };
 
-    std::string getElementName(void) const
+    const std::string& getElementName(void) const
     {
         return _element_name;
     };
@@ -74,12 +89,12 @@ public:
         return _ttl;
     };
 
-    std::string getUnits(void) const
+    const std::string& getUnits(void) const
     {
         return _units;
     };
 
-    std::string getSource(void) const
+    const std::string& getSource(void) const
     {
         return _source;
     };
@@ -108,6 +123,9 @@ private:
 
     // time to live [s]
     uint64_t _ttl;
+
+    // interned topic
+    TopicId _topic_id;
 };
 
 inline bool operator==(const MetricInfo& lhs, const MetricInfo& rhs)
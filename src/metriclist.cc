@@ -17,36 +17,107 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "metriclist.h"
+#include "utils.h"
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <czmq.h>
 
-void MetricList::addMetric(const MetricInfo& metricInfo)
+void MetricList::addMetric(const MetricInfo& metricInfo, uint64_t fingerprint)
 {
-    // try to find topic
-    auto it = _knownMetrics.find(metricInfo.generateTopic());
-    if (it != _knownMetrics.cend()) {
-        // if it was found -> replace with new value
-        it->second = metricInfo;
-    } else {
+    addMetric(metricInfo.getTopicId(), metricInfo._element_name, metricInfo._source, metricInfo._units,
+        metricInfo._value, metricInfo._timestamp, metricInfo._ttl, fingerprint);
+}
+
+
+void MetricList::addMetric(TopicId topic, std::string_view element_name, std::string_view source,
+    std::string_view units, double value, uint64_t timestamp, uint64_t ttl, uint64_t fingerprint)
+{
+    uint32_t index = slot(topic);
+    if (index == NO_SLOT) {
         // if it wasn't found -> insert new metric
-        _knownMetrics.emplace(metricInfo.generateTopic(), metricInfo);
+        if (topic >= _slots.size()) {
+            _slots.resize(topic + 1, NO_SLOT);
+        }
+        index         = static_cast<uint32_t>(_topics.size());
+        _slots[topic] = index;
+        _topics.push_back(topic);
+        _values.push_back(value);
+        _timestamps.push_back(timestamp);
+        _ttls.push_back(ttl);
+        _fingerprints.push_back(fingerprint);
+        _metadata.push_back(Metadata{std::string(element_name), std::string(source), std::string(units)});
+        _expiries.emplace(timestamp + ttl, topic);
+    } else {
+        if (_timestamps[index] + _ttls[index] != timestamp + ttl) {
+            _expiries.emplace(timestamp + ttl, topic);
+        }
+        // if it was found -> replace with new value, element and source are given by the topic
+        if (_metadata[index]._units != units) {
+            _metadata[index]._units.assign(units.data(), units.size());
+        }
+        _values[index]       = value;
+        _timestamps[index]   = timestamp;
+        _ttls[index]         = ttl;
+        _fingerprints[index] = fingerprint;
     }
-    _lastInsertedMetric = metricInfo;
+    _history.add(topic, value, timestamp);
+
+    // assignment reuses the buffers of the previous last metric
+    const Metadata& metadata = _metadata[index];
+
+    _lastInsertedMetric._element_name = metadata._element_name;
+    _lastInsertedMetric._source       = metadata._source;
+    _lastInsertedMetric._units        = metadata._units;
+    _lastInsertedMetric._value        = value;
+    _lastInsertedMetric._timestamp    = timestamp;
+    _lastInsertedMetric._ttl          = ttl;
+    _lastInsertedMetric._topic_id     = topic;
+    _lastInsertedMetric._element_destination_name.clear();
+}
+
+
+bool MetricList::isKnownSample(TopicId topic, uint64_t fingerprint) const
+{
+    uint32_t index = slot(topic);
+    if (index == NO_SLOT) {
+        return false;
+    }
+    return _fingerprints[index] != 0 && _fingerprints[index] == fingerprint;
+}
+
+
+uint64_t MetricList::fingerprint(uint64_t timestamp, const char* value, uint64_t salt)
+{
+    uint64_t hash = utils::fnv1a64(reinterpret_cast<const char*>(&timestamp), sizeof(timestamp));
+    hash          = utils::fnv1a64(reinterpret_cast<const char*>(&salt), sizeof(salt), hash);
+    hash          = utils::fnv1a64(value, strlen(value), hash);
+    return hash != 0 ? hash : 1;
 }
 
 
 double MetricList::findAndCheck(const std::string& topic) const
 {
-    auto it = _knownMetrics.find(topic);
-    if (it == _knownMetrics.cend()) {
+    return findAndCheck(TopicTable::instance().find(topic));
+}
+
+
+double MetricList::findAndCheck(TopicId topic) const
+{
+    return findAndCheck(topic, static_cast<uint64_t>(::time(NULL)));
+}
+
+
+double MetricList::findAndCheck(TopicId topic, uint64_t now) const
+{
+    uint32_t index = slot(topic);
+    if (index == NO_SLOT) {
         return std::nan("");
     } else {
-        uint64_t currentTimestamp = static_cast<uint64_t>(::time(NULL));
-        if ((currentTimestamp - it->second._timestamp) > it->second._ttl) {
+        if ((now - _timestamps[index]) > _ttls[index]) {
             return std::nan("");
         } else {
-            return it->second._value;
+            return _values[index];
         }
     }
 }
@@ -54,36 +125,115 @@ double MetricList::findAndCheck(const std::string& topic) const
 
 double MetricList::find(const std::string& topic) const
 {
-    auto it = _knownMetrics.find(topic);
-    if (it == _knownMetrics.cend()) {
+    return find(TopicTable::instance().find(topic));
+}
+
+
+double MetricList::find(TopicId topic) const
+{
+    uint32_t index = slot(topic);
+    if (index == NO_SLOT) {
         return std::nan("");
     } else {
-        return it->second._value;
+        return _values[index];
     }
 }
 
 
+uint64_t MetricList::getTimestamp(TopicId topic) const
+{
+    uint32_t index = slot(topic);
+    return index == NO_SLOT ? 0 : _timestamps[index];
+}
+
+
+uint64_t MetricList::getTtl(TopicId topic) const
+{
+    uint32_t index = slot(topic);
+    return index == NO_SLOT ? 0 : _ttls[index];
+}
+
+
+const std::string& MetricList::getElementName(TopicId topic) const
+{
+    static const std::string empty;
+
+    uint32_t index = slot(topic);
+    return index == NO_SLOT ? empty : _metadata[index]._element_name;
+}
+
+
+const std::string& MetricList::getSource(TopicId topic) const
+{
+    static const std::string empty;
+
+    uint32_t index = slot(topic);
+    return index == NO_SLOT ? empty : _metadata[index]._source;
+}
+
+
 MetricInfo MetricList::getMetricInfo(const std::string& topic) const
 {
-    auto it = _knownMetrics.find(topic);
-    if (it == _knownMetrics.cend()) {
+    return getMetricInfo(TopicTable::instance().find(topic));
+}
+
+
+MetricInfo MetricList::getMetricInfo(TopicId topic) const
+{
+    uint32_t index = slot(topic);
+    if (index == NO_SLOT) {
         return MetricInfo();
     } else {
-        return it->second;
+        const Metadata& metadata = _metadata[index];
+        return MetricInfo(metadata._element_name, metadata._source, metadata._units, _values[index],
+            _timestamps[index], "", _ttls[index], topic);
+    }
+}
+
+
+void MetricList::removeSlot(uint32_t index)
+{
+    uint32_t last = static_cast<uint32_t>(_topics.size() - 1);
+    _slots[_topics[index]] = NO_SLOT;
+    if (index != last) {
+        _topics[index]       = _topics[last];
+        _values[index]       = _values[last];
+        _timestamps[index]   = _timestamps[last];
+        _ttls[index]         = _ttls[last];
+        _fingerprints[index] = _fingerprints[last];
+        _metadata[index]     = std::move(_metadata[last]);
+
+        _slots[_topics[index]] = index;
     }
+    _topics.pop_back();
+    _values.pop_back();
+    _timestamps.pop_back();
+    _ttls.pop_back();
+    _fingerprints.pop_back();
+    _metadata.pop_back();
 }
 
 
 void MetricList::removeOldMetrics()
 {
-    uint64_t currentTimestamp = static_cast<uint64_t>(::time(NULL));
+    std::vector<MetricInfo> expired;
+    removeOldMetrics(static_cast<uint64_t>(::time(NULL)), expired);
+}
+
+
+void MetricList::removeOldMetrics(uint64_t now, std::vector<MetricInfo>& expired)
+{
+    // metric is too old, when (now - timestamp) > ttl
+    while (!_expiries.empty() && _expiries.top().first < now) {
+        Expiry expiry = _expiries.top();
+        _expiries.pop();
 
-    for (std::map<std::string, MetricInfo>::iterator iter = _knownMetrics.begin(); iter != _knownMetrics.end();
-        /* empty */) {
-        if ((currentTimestamp - iter->second._timestamp) > iter->second.getTtl()) {
-            _knownMetrics.erase(iter++);
-        } else {
-            ++iter;
+        uint32_t index = slot(expiry.second);
+        if (index == NO_SLOT || _timestamps[index] + _ttls[index] != expiry.first) {
+            // metric was removed or updated since
+            continue;
         }
+        expired.push_back(getMetricInfo(expiry.second));
+        removeSlot(index);
     }
 }
@@ -21,14 +21,28 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 /// @brief This class is intended to handle set of current known metrics
 #pragma once
 
+#include "metrichistory.h"
 #include "metricinfo.h"
-#include <map>
+#include <functional>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 /// This class is intended to handle set of current known metrics.
 ///
 /// You can create it, ad new metrics, find known metrics by topic,
 /// and remove metrics that are not valid.
+///
+/// Metrics are stored in slots: values, timestamps, TTLs and fingerprints are kept in parallel contiguous
+/// arrays, names and units separately, as they are not needed for lookups. Interned topics are dense, so
+/// the slot of a topic is found by direct indexing, without hashing.
+///
+/// Expiry times (timestamp + TTL) are tracked in a min-heap, so removing old metrics touches only metrics which
+/// really expired.
+///
+/// Topics requested by rules also keep the history of their samples, see MetricHistory.
 class MetricList
 {
 public:
@@ -43,7 +57,40 @@ public:
     /// This will add new metric if it isn't known to the list and update the value if it is known already.
     /// Also it will update value of last added Metric.
     /// @param[in] metricInfo - metric to add
-    void addMetric(const MetricInfo& metricInfo);
+    /// @param[in] fingerprint - fingerprint of the sample, see fingerprint()
+    void addMetric(const MetricInfo& metricInfo, uint64_t fingerprint = 0);
+
+    /// Adds new sample of the metric
+    ///
+    /// Same as addMetric(const MetricInfo&), but no temporary MetricInfo is needed: known metric is updated in
+    /// place, so no memory is allocated for metrics already present in the list.
+    /// @param[in] topic - interned topic (source@element_name)
+    /// @param[in] element_name - asset name
+    /// @param[in] source - metric name
+    /// @param[in] units - units of the value
+    /// @param[in] value - value of the sample
+    /// @param[in] timestamp - timestamp of the sample
+    /// @param[in] ttl - time to live of the sample [s]
+    /// @param[in] fingerprint - fingerprint of the sample, see fingerprint()
+    void addMetric(TopicId topic, std::string_view element_name, std::string_view source,
+        std::string_view units, double value, uint64_t timestamp, uint64_t ttl, uint64_t fingerprint = 0);
+
+    /// Checks if the sample is the one already stored for the topic
+    ///
+    /// @param[in] topic - interned topic we are looking for
+    /// @param[in] fingerprint - fingerprint of the sample, see fingerprint()
+    /// @return true if the topic is known and its last sample has the same fingerprint
+    bool isKnownSample(TopicId topic, uint64_t fingerprint) const;
+
+    /// Computes fingerprint of the sample
+    ///
+    /// Fingerprint is computed from raw value (before conversion), so the unchanged samples can be detected
+    /// without parsing them.
+    /// @param[in] timestamp - timestamp of the sample
+    /// @param[in] value - raw value of the sample
+    /// @param[in] salt - changing the salt invalidates all known fingerprints
+    /// @return fingerprint, never 0
+    static uint64_t fingerprint(uint64_t timestamp, const char* value, uint64_t salt);
 
     /// Finds a value of the metric in the list and checks if it is still valid.
     ///
@@ -53,6 +100,16 @@ public:
     /// @return NAN   - if metric is too old or it is not present in the list, value - otherwise
     double findAndCheck(const std::string& topic) const;
 
+    /// Same as findAndCheck(const std::string&), but looks for interned topic
+    double findAndCheck(TopicId topic) const;
+
+    /// Same as findAndCheck(TopicId), but checks validity against given time
+    ///
+    /// Allows to use one time snapshot for all lookups of one cycle.
+    /// @param[in] topic - interned topic we are looking for
+    /// @param[in] now - current time
+    double findAndCheck(TopicId topic, uint64_t now) const;
+
     /// Finds a value of the metric in the list
     ///
     /// To check is value is NAN or not use isnan() function from math.h
@@ -60,6 +117,29 @@ public:
     /// @return NAN - if metric is not present in the list, value - otherwise
     double find(const std::string& topic) const;
 
+    /// Same as find(const std::string&), but looks for interned topic
+    double find(TopicId topic) const;
+
+    /// Gets timestamp of the metric
+    /// @param[in] topic - interned topic we are looking for
+    /// @return timestamp or 0 if metric is not present in the list
+    uint64_t getTimestamp(TopicId topic) const;
+
+    /// Gets time to live of the metric
+    /// @param[in] topic - interned topic we are looking for
+    /// @return TTL [s] or 0 if metric is not present in the list
+    uint64_t getTtl(TopicId topic) const;
+
+    /// Gets asset name of the metric
+    /// @param[in] topic - interned topic we are looking for
+    /// @return asset name or empty string if metric is not present in the list
+    const std::string& getElementName(TopicId topic) const;
+
+    /// Gets metric name of the metric
+    /// @param[in] topic - interned topic we are looking for
+    /// @return metric name or empty string if metric is not present in the list
+    const std::string& getSource(TopicId topic) const;
+
     /// Gets metric by the topic
     /// @param[in] topic - topic we are looking for
     /// @return MetricInfo       - if metric was found or
@@ -67,21 +147,102 @@ public:
     ///                            ( isUnknown() is true)
     MetricInfo getMetricInfo(const std::string& topic) const;
 
+    /// Same as getMetricInfo(const std::string&), but looks for interned topic
+    MetricInfo getMetricInfo(TopicId topic) const;
+
     /// Removes old metrics from the list
     void removeOldMetrics(void);
 
+    /// Removes old metrics from the list and reports them
+    ///
+    /// @param[in] now - current time
+    /// @param[out] expired - removed metrics are appended
+    void removeOldMetrics(uint64_t now, std::vector<MetricInfo>& expired);
+
+    /// Gets number of metrics in the list
+    size_t size(void) const
+    {
+        return _topics.size();
+    }
+
+    /// Sets size of the history arena
+    ///
+    /// The whole history is dropped, topics have to be tracked again.
+    /// @param[in] rings - number of rings, see MetricHistory
+    void resizeHistory(size_t rings)
+    {
+        _history = MetricHistory(rings);
+    }
+
+    /// Sets topics, which need the history
+    /// @param[in] requests - <topic, window [s]> pairs
+    void trackHistory(const std::vector<std::pair<TopicId, uint64_t>>& requests)
+    {
+        _history.track(requests);
+    }
+
+    /// Gets aggregates of the topic history in the window
+    ///
+    /// History survives expiration of the metric, check the current value if it matters.
+    /// @param[in] topic - interned topic
+    /// @param[in] window - window [s]
+    /// @param[out] aggregates - result
+    /// @return false if history of the topic in this window isn't tracked
+    bool getAggregates(TopicId topic, uint64_t window, MetricAggregates& aggregates) const
+    {
+        return _history.get(topic, window, aggregates);
+    }
+
     /// Gets the last added metric
     ///
     /// @return last added (or updated) metric
-    MetricInfo getLastMetric(void) const
+    const MetricInfo& getLastMetric(void) const
     {
         return _lastInsertedMetric;
     };
 
 private:
-    /// Metric list <topic, Metric>
-    std::map<std::string, MetricInfo> _knownMetrics;
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    /// Names of the metric, not needed for lookups
+    struct Metadata
+    {
+        std::string _element_name;
+        std::string _source;
+        std::string _units;
+    };
+
+    /// Gets slot of the topic
+    /// @return slot or NO_SLOT if the topic isn't in the list
+    uint32_t slot(TopicId topic) const
+    {
+        return topic < _slots.size() ? _slots[topic] : NO_SLOT;
+    }
+
+    /// Removes the slot, the last slot takes its place
+    void removeSlot(uint32_t slot);
+
+    /// <expiry time, topic>
+    typedef std::pair<uint64_t, TopicId> Expiry;
+
+    /// Slot indexed by interned topic (NO_SLOT if topic is not in the list)
+    std::vector<uint32_t> _slots;
+
+    /// Data indexed by slot
+    std::vector<TopicId>  _topics;
+    std::vector<double>   _values;
+    std::vector<uint64_t> _timestamps;
+    std::vector<uint64_t> _ttls;
+    std::vector<uint64_t> _fingerprints;
+    std::vector<Metadata> _metadata;
+
+    /// Min-heap of expiry times. Entries are not removed when a metric is updated or removed, they are
+    /// ignored when popped, if they don't match the metric anymore.
+    std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>> _expiries;
 
     /// Keep track of last inserted metric
     MetricInfo _lastInsertedMetric;
+
+    /// History of topics requested by rules
+    MetricHistory _history;
 };
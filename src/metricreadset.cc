@@ -0,0 +1,121 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "metricreadset.h"
+#include "alertconfiguration.h"
+#include <algorithm>
+#include <fty_log.h>
+
+// Extracts regular expression for the metric name from the topic pattern
+//
+// Pattern "^end_warranty_date@.+" gives "^end_warranty_date$", so only this family of metrics is read
+// from shm. If the metric part can't be isolated safely, every metric is read and filtered afterwards.
+static std::string s_metric_re(const std::string& pattern)
+{
+    if (pattern.empty() || pattern[0] != '^') {
+        return ".*";
+    }
+    std::string::size_type at = pattern.find('@');
+    if (at == std::string::npos) {
+        return ".*";
+    }
+    std::string metric = pattern.substr(1, at - 1);
+    if (metric.empty() || metric.find_first_of("|()") != std::string::npos) {
+        return ".*";
+    }
+    return "^" + metric + "$";
+}
+
+void MetricReadSet::update(const std::vector<std::string>& topics, const std::vector<std::string>& patterns)
+{
+    _keys.clear();
+    _topics.clear();
+    _families.clear();
+
+    for (const auto& topic : topics) {
+        std::string::size_type at = topic.find('@');
+        if (at == std::string::npos || at == 0 || at == topic.size() - 1) {
+            log_warning("topic '%s' has no element, ignore it", topic.c_str());
+            continue;
+        }
+        _keys.emplace_back(topic.substr(0, at), topic.substr(at + 1));
+        _topics.push_back(topic);
+    }
+    std::sort(_topics.begin(), _topics.end());
+
+    for (const auto& pattern : patterns) {
+        std::shared_ptr<zrex_t> rex(zrex_new(pattern.c_str()), [](zrex_t* rex) {
+            zrex_destroy(&rex);
+        });
+        if (!rex || !zrex_valid(rex.get())) {
+            log_error("pattern '%s' can't be compiled (%s), ignore it", pattern.c_str(),
+                rex ? zrex_strerror(rex.get()) : "no memory");
+            continue;
+        }
+        _families.push_back(Family{s_metric_re(pattern), rex});
+    }
+    log_debug("read set updated: %zu topics, %zu patterns", _keys.size(), _families.size());
+}
+
+bool MetricReadSet::update(const AlertConfiguration& ac)
+{
+    if (_generation == ac.getTopicsGeneration()) {
+        return false;
+    }
+    std::vector<std::string> topics;
+    std::vector<std::string> patterns;
+    ac.getNeededTopics(topics, patterns);
+    update(topics, patterns);
+    _generation = ac.getTopicsGeneration();
+    return true;
+}
+
+void MetricReadSet::read(fty::shm::shmMetrics& result) const
+{
+    for (const auto& key : _keys) {
+        fty_proto_t* metric = NULL;
+        // metric which was not published yet is not an error
+        if (fty::shm::read_metric(key.second, key.first, &metric) == 0 && metric) {
+            result.add(metric);
+        }
+    }
+
+    for (const auto& family : _families) {
+        fty::shm::shmMetrics family_result;
+        fty::shm::read_metrics(".*", family._metric_re, family_result);
+        for (auto& metric : family_result) {
+            std::string topic = std::string(fty_proto_type(metric)) + "@" + fty_proto_name(metric);
+            if (zrex_matches(family._topic_re.get(), topic.c_str())) {
+                result.add(fty_proto_dup(metric));
+            }
+        }
+    }
+}
+
+bool MetricReadSet::matches(const std::string& topic) const
+{
+    if (std::binary_search(_topics.begin(), _topics.end(), topic)) {
+        return true;
+    }
+    for (const auto& family : _families) {
+        if (zrex_matches(family._topic_re.get(), topic.c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
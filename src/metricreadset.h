@@ -0,0 +1,95 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file metricreadset.h
+/// @brief Set of metrics which have to be read from shared memory
+#pragma once
+
+#include <cstdint>
+#include <czmq.h>
+#include <fty_shm.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class AlertConfiguration;
+
+/// Set of metrics which have to be read from shared memory every polling interval.
+///
+/// Set is built from the topics consumed by rules: exact topics ("metric@element") are read one
+/// by one, pattern rules are read by families and filtered by a compiled matcher. Patterns are matched by
+/// zrex as by RegexRule, so the set reads exactly the metrics the pattern rules consume.
+///
+/// Set is not thread safe, not even its const methods (zrex keeps the state of the last match).
+class MetricReadSet
+{
+public:
+    MetricReadSet(){};
+
+    /// Rebuilds the set
+    ///
+    /// @param[in] topics - exact topics ("metric@element")
+    /// @param[in] patterns - regular expressions of pattern rules
+    void update(const std::vector<std::string>& topics, const std::vector<std::string>& patterns);
+
+    /// Rebuilds the set from topics needed by rules, if they were changed since the last time
+    ///
+    /// Caller must hold mtxAlertConfig.
+    /// @param[in] ac - configuration of rules (see AlertConfiguration::getTopicsGeneration())
+    /// @return true if the set was rebuilt
+    bool update(const AlertConfiguration& ac);
+
+    /// Reads all metrics of the set from shared memory
+    ///
+    /// @param[out] result - metrics read
+    void read(fty::shm::shmMetrics& result) const;
+
+    /// Checks if topic belongs to the set
+    ///
+    /// @param[in] topic - topic to check
+    /// @return true/false
+    bool matches(const std::string& topic) const;
+
+    /// Gets number of exact topics in the set
+    size_t size(void) const
+    {
+        return _keys.size();
+    }
+
+private:
+    struct Family
+    {
+        // regular expression for the metric name, used to pre-filter shm
+        std::string _metric_re;
+        // compiled regular expression of the whole topic
+        std::shared_ptr<zrex_t> _topic_re;
+    };
+
+    /// Exact topics split to <metric, element>
+    std::vector<std::pair<std::string, std::string>> _keys;
+
+    /// Sorted exact topics
+    std::vector<std::string> _topics;
+
+    /// Families of metrics needed by pattern rules
+    std::vector<Family> _families;
+
+    /// Generation of topics of rules the set was built from, UINT64_MAX if none yet
+    uint64_t _generation = UINT64_MAX;
+};
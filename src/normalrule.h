@@ -66,6 +66,7 @@ public:
             throw std::runtime_error("property 'target' in json must be an Array");
         }
         target >>= _metrics;
+        _resolveTopics();
         single.getMember("rule_name") >>= _name;
         single.getMember("element") >>= _element;
         // rule_class
@@ -105,8 +106,23 @@ public:
             throw std::runtime_error("parameter 'results' in json must be an array.");
         }
         outcomes >>= _outcomes;
+        _debounce.fill(single);
 
+        // aggregates
+        _fillAggregates(single);
+
+        // expression is evaluated natively instead of Lua code
         std::string tmp;
+        if (single.findMember("expression") != NULL) {
+            single.getMember("expression") >>= tmp;
+            try {
+                expression(tmp);
+            } catch (const std::exception& e) {
+                log_warning("something with expression: %s", e.what());
+                return 2;
+            }
+            return 0;
+        }
         single.getMember("evaluation") >>= tmp;
         try {
             code(tmp);
@@ -102,6 +102,7 @@ public:
             throw std::runtime_error("parameter 'results' in json must be an array.");
         }
         outcomes >>= _outcomes;
+        _debounce.fill(pattern);
 
         std::string tmp;
         pattern.getMember("evaluation") >>= tmp;
@@ -118,14 +119,20 @@ public:
 
     int evaluate(const MetricList& metricList, PureAlert& pureAlert)
     {
-        _metrics = {metricList.getLastMetric().generateTopic()};
-        int rv   = LuaRule::evaluate(metricList, pureAlert);
+        return evaluate(metricList, metricList.getLastMetric().getTopicId(), pureAlert);
+    };
+
+    int evaluate(const MetricList& metricList, TopicId trigger, PureAlert& pureAlert)
+    {
+        // the only input is the triggering metric
+        _topics.assign(1, trigger);
+        int rv = LuaRule::evaluate(metricList, pureAlert);
         if (rv != 0) {
             return rv;
         }
         // regexp rule is special, it has to generate alert for the element,
         // that triggert the evaluation
-        pureAlert._element = metricList.getLastMetric().getElementName();
+        pureAlert._element = metricList.getElementName(trigger);
         return 0;
     };
 
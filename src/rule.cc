@@ -212,6 +212,14 @@ std::vector<std::string> Rule::getNeededTopics(void) const
     return _metrics;
 }
 
+void Rule::_resolveTopics(void)
+{
+    _topics.clear();
+    for (const auto& metric : _metrics) {
+        _topics.push_back(TopicTable::instance().intern(metric));
+    }
+}
+
 
 RuleNameMatcher::RuleNameMatcher(const std::string& name)
     : _name(name)
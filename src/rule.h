@@ -21,6 +21,7 @@
 /// @brief General representation of rule
 #pragma once
 
+#include "debounce.h"
 #include "metriclist.h"
 #include "purealert.h"
 #include <cxxtools/jsondeserializer.h>
@@ -158,6 +159,20 @@ public:
     ///         non 0 if there were some errors during the evaluation
     virtual int evaluate(const MetricList& metricList, PureAlert& pureAlert) = 0;
 
+    /// Evaluates the rule for the metric, which triggered the evaluation
+    ///
+    /// Rules bound to the triggering metric (threshold on one metric, pattern) override it, others ignore
+    /// the trigger and read everything from the list.
+    /// @param[in] metricList - a list of known metrics
+    /// @param[in] trigger - topic of the metric which triggered the evaluation, the metric is in metricList
+    /// @param[out] pureAlert - result of evaluation
+    /// @return 0 if evaluation was correct
+    ///         non 0 if there were some errors during the evaluation
+    virtual int evaluate(const MetricList& metricList, TopicId /* trigger */, PureAlert& pureAlert)
+    {
+        return evaluate(metricList, pureAlert);
+    }
+
     /// Checks if topic is necessary for rule evaluation
     /// @param[in] topic - topic to check
     /// @return true/false
@@ -167,6 +182,24 @@ public:
     /// @return a set of topics
     virtual std::vector<std::string> getNeededTopics(void) const;
 
+    /// Returns a window of the history needed for rule evaluation
+    /// @return window [s] or 0 if the rule doesn't need history of its topics
+    virtual uint64_t historyWindow(void) const
+    {
+        return 0;
+    }
+
+    /// Gets the debounce of the transitions of alerts of the rule
+    Debounce& debounce(void)
+    {
+        return _debounce;
+    }
+
+    const Debounce& debounce(void) const
+    {
+        return _debounce;
+    }
+
     /// Checks if rules have same names
     /// @param[in] rule - rule to check
     /// @return true/false
@@ -242,9 +275,15 @@ public:
     virtual ~Rule(){};
 
 protected:
+    /// Interns topics of _metrics to _topics, must be called whenever _metrics are changed
+    void _resolveTopics(void);
+
     /// Vector of metrics to be evaluated
     std::vector<std::string> _metrics;
 
+    /// Identifiers of _metrics in the same order, the evaluation looks metrics up by them
+    std::vector<TopicId> _topics;
+
     /// Every rule should have a rule name
     ///
     /// ASSUMPTION: rule name has only ascii characters.
@@ -261,6 +300,9 @@ protected:
     /// Human readable info about this rule purpose like "internal temperature"
     std::string _rule_class;
 
+    /// Debounce of the transitions of alerts, read by fill()
+    Debounce _debounce;
+
 private:
     /// User is able to define his own constants, that can be used in evaluation function
     ///
@@ -283,6 +325,12 @@ public:
     RuleNameMatcher(const std::string& name);
     bool operator()(const Rule& rule) override;
 
+    /// Name of matching rules, lets the configuration look the rule up instead of matching all rules
+    const std::string& name(void) const
+    {
+        return _name;
+    }
+
 private:
     std::string _name;
 };
@@ -293,6 +341,12 @@ public:
     RuleElementMatcher(const std::string& element);
     bool operator()(const Rule& rule) override;
 
+    /// Element of matching rules, lets the configuration use its index instead of matching all rules
+    const std::string& element(void) const
+    {
+        return _element;
+    }
+
 private:
     std::string _element;
 };
@@ -0,0 +1,170 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "ruleworkerpool.h"
+#include "utils.h"
+#include <exception>
+#include <fty_log.h>
+
+RuleWorkerPool::RuleWorkerPool(size_t workers)
+{
+    start(workers);
+}
+
+RuleWorkerPool::~RuleWorkerPool()
+{
+    stop();
+}
+
+void RuleWorkerPool::resize(size_t workers)
+{
+    if (workers == 0) {
+        workers = 1;
+    }
+    if (workers == _shards) {
+        return;
+    }
+    stop();
+    start(workers);
+}
+
+size_t RuleWorkerPool::shard(const std::string& rulename) const
+{
+    if (_shards == 1) {
+        return 0;
+    }
+    return utils::fnv1a64(rulename.data(), rulename.size()) % _shards;
+}
+
+void RuleWorkerPool::start(size_t workers)
+{
+    _shards = workers == 0 ? 1 : workers;
+    _exit   = false;
+    _round  = 0;
+    // the caller is the worker of the first shard
+    for (size_t i = 1; i < _shards; ++i) {
+        _threads.emplace_back(&RuleWorkerPool::workerLoop, this, i);
+    }
+    log_debug("rule worker pool started with %zu workers", _shards);
+}
+
+void RuleWorkerPool::stop(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _exit = true;
+    }
+    _wake.notify_all();
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+    _threads.clear();
+}
+
+void RuleWorkerPool::run(const std::vector<Job>& jobs)
+{
+    std::exception_ptr error;
+    if (_threads.empty()) {
+        for (const auto& job : jobs) {
+            if (!job) {
+                continue;
+            }
+            try {
+                job();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _jobs    = &jobs;
+        _error   = nullptr;
+        _running = _threads.size();
+        _round++;
+    }
+    _wake.notify_all();
+
+    // workers use jobs (and whatever they reference) until they finish, so wait for them on every path
+    if (!jobs.empty() && jobs[0]) {
+        try {
+            jobs[0]();
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] {
+            return _running == 0;
+        });
+        _jobs = nullptr;
+        if (!error) {
+            error = _error;
+        }
+        _error = nullptr;
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void RuleWorkerPool::workerLoop(size_t index)
+{
+    uint64_t round = 0;
+    while (true) {
+        const std::vector<Job>* jobs = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this, round] {
+                return _exit || _round != round;
+            });
+            if (_exit) {
+                return;
+            }
+            round = _round;
+            jobs  = _jobs;
+        }
+
+        std::exception_ptr error;
+        if (jobs && index < jobs->size() && (*jobs)[index]) {
+            try {
+                (*jobs)[index]();
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (error && !_error) {
+                _error = error;
+            }
+            _running--;
+        }
+        _done.notify_one();
+    }
+}
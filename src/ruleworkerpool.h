@@ -0,0 +1,99 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file ruleworkerpool.h
+/// @brief Pool of threads evaluating rules
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Pool of threads evaluating rules
+///
+/// Rules are partitioned to shards by a stable hash of the rule name and every shard is always processed by
+/// the same worker. So Lua state and alerts of one rule are never touched by two threads at the same time,
+/// while different rules are evaluated in parallel.
+///
+/// Pool with one worker doesn't start any thread, the work is done by the caller.
+class RuleWorkerPool
+{
+public:
+    /// Job of one shard
+    typedef std::function<void(void)> Job;
+
+    /// Creates pool
+    /// @param[in] workers - number of workers (0 means 1)
+    RuleWorkerPool(size_t workers = 1);
+
+    /// Stops all workers
+    ~RuleWorkerPool();
+
+    RuleWorkerPool(const RuleWorkerPool&) = delete;
+    RuleWorkerPool& operator=(const RuleWorkerPool&) = delete;
+
+    /// Changes number of workers
+    ///
+    /// Must not be called while run() is in progress.
+    /// @param[in] workers - number of workers (0 means 1)
+    void resize(size_t workers);
+
+    /// Gets number of workers (shards)
+    size_t size(void) const
+    {
+        return _shards;
+    }
+
+    /// Gets shard of the rule
+    /// @param[in] rulename - name of the rule
+    /// @return shard index in range 0 .. size() - 1
+    size_t shard(const std::string& rulename) const;
+
+    /// Runs jobs of all shards and waits until all of them are finished
+    ///
+    /// Job of the first shard is run by the caller. If any job throws, the other jobs still run and the first
+    /// caught exception is rethrown after all workers finished their jobs (the caller's one takes precedence).
+    /// @param[in] jobs - one job per shard (empty function means nothing to do)
+    void run(const std::vector<Job>& jobs);
+
+private:
+    void start(size_t workers);
+    void stop(void);
+    void workerLoop(size_t index);
+
+    size_t                   _shards = 1;
+    std::vector<std::thread> _threads;
+
+    std::mutex              _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    // jobs of the current run, valid until all workers finish it
+    const std::vector<Job>* _jobs = nullptr;
+    // incremented with every run, wakes workers up
+    uint64_t _round = 0;
+    // the first exception thrown by a worker in the current round
+    std::exception_ptr _error;
+    // number of workers still running the current round
+    size_t _running = 0;
+    bool   _exit    = false;
+};
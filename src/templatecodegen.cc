@@ -0,0 +1,746 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file templatecodegen.cc
+/// @brief Build time translator of the Lua code of rule templates to native evaluators (see TemplateEvaluator)
+///
+/// Usage: fty-alert-engine-codegen <output.cc> <template.rule>...
+///
+/// Code of every 'single' and 'threshold' template is translated to a C++ function, the output registers them by
+/// the name of the template. Only a subset of Lua is translated: definitions of global functions with numeric
+/// parameters, local variables, assignments, if/elseif/else, return of one value, arithmetic, comparisons,
+/// and/or/not of booleans and calls of the functions defined before, of math.abs, math.floor, math.ceil,
+/// math.sqrt, math.max, math.min and of the module fty. Values are typed (number or boolean) and everything,
+/// where Lua could give other result than C++ (nil, strings, mixed types, truthiness of numbers), is refused.
+/// Refused template is evaluated by Lua, the reason is noted in the output.
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxtools/jsondeserializer.h>
+#include <cxxtools/serializationinfo.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Token
+{
+    enum Type
+    {
+        NAME,
+        NUMBER,
+        STRING,
+        SYMBOL,
+        END
+    };
+    Type        _type;
+    std::string _text;
+};
+
+// Splits the code to tokens
+std::vector<Token> s_tokenize(const std::string& code)
+{
+    static const char* symbols[] = {"==", "~=", "<=", ">=", "..", "<", ">", "=", "+", "-", "*", "/", "%", "^", "(",
+        ")", ",", ";", ".", "{", "}", "[", "]", "#", ":"};
+
+    std::vector<Token> tokens;
+    size_t             i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        if (isspace(static_cast<unsigned char>(c))) {
+            i++;
+        } else if (code.compare(i, 2, "--") == 0) {
+            if (code.compare(i, 4, "--[[") == 0 || code.compare(i, 4, "--[=") == 0) {
+                throw std::runtime_error("long comments are not supported");
+            }
+            while (i < code.size() && code[i] != '\n') {
+                i++;
+            }
+        } else if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            size_t start = i;
+            while (i < code.size() && (isalnum(static_cast<unsigned char>(code[i])) || code[i] == '_')) {
+                i++;
+            }
+            tokens.push_back(Token{Token::NAME, code.substr(start, i - start)});
+        } else if (isdigit(static_cast<unsigned char>(c)) ||
+                   (c == '.' && i + 1 < code.size() && isdigit(static_cast<unsigned char>(code[i + 1])))) {
+            size_t start = i;
+            while (i < code.size() && (isalnum(static_cast<unsigned char>(code[i])) || code[i] == '.' ||
+                                          ((code[i] == '+' || code[i] == '-') && tolower(code[i - 1]) == 'e'))) {
+                i++;
+            }
+            tokens.push_back(Token{Token::NUMBER, code.substr(start, i - start)});
+        } else if (c == '"' || c == '\'' || code.compare(i, 2, "[[") == 0 || code.compare(i, 2, "[=") == 0) {
+            tokens.push_back(Token{Token::STRING, std::string(1, c)});
+            i = code.size();
+        } else {
+            bool found = false;
+            for (const char* symbol : symbols) {
+                size_t length = strlen(symbol);
+                if (code.compare(i, length, symbol) == 0) {
+                    tokens.push_back(Token{Token::SYMBOL, symbol});
+                    i += length;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                throw std::runtime_error(std::string("unexpected character '") + c + "'");
+            }
+        }
+    }
+    tokens.push_back(Token{Token::END, ""});
+    return tokens;
+}
+
+// Double literal, which gives exactly the value of the Lua number
+std::string s_number(const std::string& text)
+{
+    char*  end   = NULL;
+    double value = (text.size() > 2 && text[0] == '0' && tolower(text[1]) == 'x')
+                       ? static_cast<double>(strtoul(text.c_str(), &end, 16))
+                       : strtod(text.c_str(), &end);
+    if (*end != '\0' || !std::isfinite(value)) {
+        throw std::runtime_error("malformed number '" + text + "'");
+    }
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+    std::string result = buffer;
+    if (result.find_first_of(".e") == std::string::npos) {
+        result += ".0";
+    }
+    return result;
+}
+
+// C++ string literal of the text
+std::string s_literal(const std::string& text)
+{
+    std::string result = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (c == '\n') {
+            result += "\\n\"\n    \"";
+        } else if (isprint(static_cast<unsigned char>(c))) {
+            result += c;
+        } else {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\%03o", static_cast<unsigned char>(c));
+            result += buffer;
+        }
+    }
+    return result + "\"";
+}
+
+/// Translator of the code of one template
+class Translator
+{
+public:
+    /// Translates the code, main() is translated to function evaluate()
+    /// ATTENTION: throws, if the code can't be translated
+    Translator(const std::string& code);
+
+    /// Gets the C++ functions
+    const std::string& output(void) const
+    {
+        return _output;
+    }
+
+    size_t inputs(void) const
+    {
+        return _inputs;
+    }
+
+    const std::vector<std::string>& globals(void) const
+    {
+        return _globals;
+    }
+
+private:
+    enum Type
+    {
+        NUMBER,
+        BOOLEAN
+    };
+
+    struct Expression
+    {
+        std::string _code;
+        Type        _type;
+    };
+
+    struct Local
+    {
+        std::string _name;
+        Type        _type;
+    };
+
+    struct Function
+    {
+        std::string _name;
+        size_t      _params;
+        Type        _type;
+    };
+
+    // function being translated
+    struct Context
+    {
+        bool _main;
+        bool _returns = false;
+        Type _type    = NUMBER;
+    };
+
+    const Token& peek(void) const
+    {
+        return _tokens[_position];
+    }
+
+    const Token& next(void)
+    {
+        return _tokens[_position++];
+    }
+
+    bool accept(const std::string& text)
+    {
+        if (peek()._type != Token::STRING && peek()._text == text) {
+            _position++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(const std::string& text)
+    {
+        if (!accept(text)) {
+            throw std::runtime_error("'" + text + "' expected near '" + peek()._text + "'");
+        }
+    }
+
+    std::string name(void);
+
+    void function(void);
+    // both return true, if the code always ends by return
+    bool block(Context& context, const std::string& indent, std::string& out);
+    bool statement(Context& context, const std::string& indent, std::string& out);
+
+    Expression expression(int limit = 0);
+    Expression simple(void);
+    Expression call(const std::string& function, std::vector<Expression>& arguments);
+    std::vector<Expression> arguments(void);
+    Expression variable(const std::string& name);
+
+    static bool blockEnd(const Token& token)
+    {
+        return token._type == Token::END ||
+               (token._type == Token::NAME &&
+                   (token._text == "end" || token._text == "else" || token._text == "elseif"));
+    }
+
+    std::vector<Token> _tokens;
+    size_t             _position = 0;
+    std::string        _output;
+
+    std::map<std::string, Function>           _functions;
+    std::vector<std::map<std::string, Local>> _scopes;
+    std::vector<std::string>                  _globals;
+    // the current function reads globals
+    bool   _usesGlobals = false;
+    size_t _locals      = 0;
+    size_t _inputs      = 0;
+    bool   _hasMain     = false;
+};
+
+Translator::Translator(const std::string& code)
+    : _tokens(s_tokenize(code))
+{
+    while (peek()._type != Token::END) {
+        if (accept(";")) {
+            continue;
+        }
+        if (peek()._text != "function") {
+            throw std::runtime_error("only function definitions are supported at the top level");
+        }
+        function();
+    }
+    if (!_hasMain) {
+        throw std::runtime_error("function main not found");
+    }
+}
+
+std::string Translator::name(void)
+{
+    static const char* keywords[] = {"and", "break", "do", "else", "elseif", "end", "false", "for", "function",
+        "if", "in", "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"};
+    const Token& token = next();
+    if (token._type != Token::NAME) {
+        throw std::runtime_error("name expected near '" + token._text + "'");
+    }
+    for (const char* keyword : keywords) {
+        if (token._text == keyword) {
+            throw std::runtime_error("name expected near '" + token._text + "'");
+        }
+    }
+    return token._text;
+}
+
+void Translator::function(void)
+{
+    expect("function");
+    std::string function = name();
+    if (_functions.count(function) || _hasMain) {
+        throw std::runtime_error("function " + function + " is defined after main() or twice");
+    }
+    Context context;
+    context._main = (function == "main");
+
+    _scopes.assign(1, {});
+    _usesGlobals = false;
+    std::vector<std::string> params;
+    expect("(");
+    if (!accept(")")) {
+        do {
+            params.push_back(name());
+        } while (accept(","));
+        expect(")");
+    }
+
+    std::string body;
+    for (size_t i = 0; i < params.size(); ++i) {
+        std::string local         = "p_" + params[i];
+        _scopes.back()[params[i]] = Local{local, NUMBER};
+        if (context._main) {
+            body += "    double " + local + " = v[" + std::to_string(i) + "];\n";
+        }
+    }
+    bool returns = block(context, "    ", body);
+    expect("end");
+    if (!context._returns) {
+        throw std::runtime_error("function " + function + " returns nothing");
+    }
+
+    std::string globals = _usesGlobals ? "const double* g" : "const double* /* g */";
+    std::string header;
+    if (context._main) {
+        if (context._type != NUMBER) {
+            throw std::runtime_error("main() returns a boolean");
+        }
+        _hasMain = true;
+        _inputs  = params.size();
+        header   = "double evaluate(const double* " + std::string(params.empty() ? "/* v */" : "v") + ", " +
+                 globals + ")";
+        if (!returns) {
+            body += "    throw std::runtime_error(\"LUA main function did not returned number!\");\n";
+        }
+    } else {
+        header = std::string(context._type == NUMBER ? "double " : "bool ") + "f_" + function + "(" + globals;
+        for (const auto& param : params) {
+            header += ", double p_" + param;
+        }
+        header += ")";
+        // falling off the end returns nil, which is false in conditions and an error in arithmetic
+        if (!returns) {
+            body += context._type == NUMBER ? "    throw std::runtime_error(\"LUA calling main() failed!\");\n"
+                                             : "    return false;\n";
+        }
+        _functions[function] = Function{"f_" + function, params.size(), context._type};
+    }
+    _output += "\nstatic " + header + "\n{\n" + body + "}\n";
+}
+
+bool Translator::block(Context& context, const std::string& indent, std::string& out)
+{
+    bool returns = false;
+    _scopes.push_back({});
+    while (!blockEnd(peek())) {
+        returns = statement(context, indent, out);
+    }
+    _scopes.pop_back();
+    return returns;
+}
+
+bool Translator::statement(Context& context, const std::string& indent, std::string& out)
+{
+    if (accept(";")) {
+        return false;
+    }
+    if (accept("local")) {
+        std::string local = name();
+        expect("=");
+        Expression value = expression();
+        std::string cname = "l_" + local + "_" + std::to_string(++_locals);
+        out += indent + (value._type == NUMBER ? "double " : "bool ") + cname + " = " + value._code + ";\n";
+        _scopes.back()[local] = Local{cname, value._type};
+        return false;
+    }
+    if (accept("if")) {
+        std::string keyword = "if";
+        bool        returns = true;
+        do {
+            Expression condition = expression();
+            if (condition._type != BOOLEAN) {
+                throw std::runtime_error("condition is not a boolean");
+            }
+            expect("then");
+            out += indent + keyword + " (" + condition._code + ") {\n";
+            returns = block(context, indent + "    ", out) && returns;
+            out += indent + "}";
+            keyword = " else if";
+        } while (accept("elseif"));
+        if (accept("else")) {
+            out += " else {\n";
+            returns = block(context, indent + "    ", out) && returns;
+            out += indent + "}";
+        } else {
+            returns = false;
+        }
+        out += "\n";
+        expect("end");
+        return returns;
+    }
+    if (accept("return")) {
+        if (blockEnd(peek()) || peek()._text == ";") {
+            throw std::runtime_error("return without a value");
+        }
+        Expression value = expression();
+        if (peek()._text == ",") {
+            throw std::runtime_error("return of several values");
+        }
+        if (context._returns && context._type != value._type) {
+            throw std::runtime_error("function returns values of different types");
+        }
+        context._returns = true;
+        context._type    = value._type;
+        out += indent + "return " + value._code + ";\n";
+        accept(";");
+        if (!blockEnd(peek())) {
+            throw std::runtime_error("'end' expected after return");
+        }
+        return true;
+    }
+    if (peek()._type == Token::NAME && _tokens[_position + 1]._text == "=") {
+        std::string target = name();
+        expect("=");
+        Expression value = expression();
+        for (auto scope = _scopes.rbegin(); scope != _scopes.rend(); ++scope) {
+            auto it = scope->find(target);
+            if (it != scope->end()) {
+                if (it->second._type != value._type) {
+                    throw std::runtime_error("assignment of other type to " + target);
+                }
+                out += indent + it->second._name + " = " + value._code + ";\n";
+                return false;
+            }
+        }
+        throw std::runtime_error("assignment to global " + target);
+    }
+    throw std::runtime_error("unsupported statement near '" + peek()._text + "'");
+}
+
+// Lua 5.1 priorities of binary operators (left, right)
+struct Priority
+{
+    const char* _operator;
+    int         _left;
+    int         _right;
+};
+
+const Priority s_priorities[] = {{"+", 6, 6}, {"-", 6, 6}, {"*", 7, 7}, {"/", 7, 7}, {"%", 7, 7}, {"^", 10, 9},
+    {"..", 5, 4}, {"==", 3, 3}, {"~=", 3, 3}, {"<", 3, 3}, {"<=", 3, 3}, {">", 3, 3}, {">=", 3, 3},
+    {"and", 2, 2}, {"or", 1, 1}};
+
+const int s_unaryPriority = 8;
+
+Translator::Expression Translator::expression(int limit)
+{
+    Expression left;
+    if (accept("not")) {
+        Expression operand = expression(s_unaryPriority);
+        if (operand._type != BOOLEAN) {
+            throw std::runtime_error("'not' of a number");
+        }
+        left = Expression{"(!" + operand._code + ")", BOOLEAN};
+    } else if (accept("-")) {
+        Expression operand = expression(s_unaryPriority);
+        if (operand._type != NUMBER) {
+            throw std::runtime_error("unary minus of a boolean");
+        }
+        left = Expression{"(-" + operand._code + ")", NUMBER};
+    } else {
+        left = simple();
+    }
+
+    while (true) {
+        const Token&    token    = peek();
+        const Priority* priority = NULL;
+        for (const auto& it : s_priorities) {
+            if (token._type != Token::STRING && token._text == it._operator) {
+                priority = &it;
+            }
+        }
+        if (!priority || priority->_left <= limit) {
+            return left;
+        }
+        next();
+        Expression  right = expression(priority->_right);
+        std::string op    = priority->_operator;
+        if (op == "and" || op == "or") {
+            if (left._type != BOOLEAN || right._type != BOOLEAN) {
+                throw std::runtime_error("'" + op + "' of numbers");
+            }
+            left = Expression{"(" + left._code + (op == "and" ? " && " : " || ") + right._code + ")", BOOLEAN};
+        } else if (op == "==" || op == "~=") {
+            if (left._type != right._type) {
+                throw std::runtime_error("comparison of a number and a boolean");
+            }
+            left = Expression{"(" + left._code + (op == "==" ? " == " : " != ") + right._code + ")", BOOLEAN};
+        } else {
+            if (left._type != NUMBER || right._type != NUMBER || op == "..") {
+                throw std::runtime_error("'" + op + "' of booleans or strings");
+            }
+            if (op == "^") {
+                left = Expression{"std::pow(" + left._code + ", " + right._code + ")", NUMBER};
+            } else if (op == "%") {
+                left = Expression{"templateevaluator::mod(" + left._code + ", " + right._code + ")", NUMBER};
+            } else {
+                bool comparison = (op == "<" || op == "<=" || op == ">" || op == ">=");
+                left = Expression{"(" + left._code + " " + op + " " + right._code + ")", comparison ? BOOLEAN : NUMBER};
+            }
+        }
+    }
+}
+
+std::vector<Translator::Expression> Translator::arguments(void)
+{
+    std::vector<Expression> result;
+    expect("(");
+    if (!accept(")")) {
+        do {
+            result.push_back(expression());
+        } while (accept(","));
+        expect(")");
+    }
+    return result;
+}
+
+Translator::Expression Translator::simple(void)
+{
+    const Token& token = peek();
+    if (token._type == Token::NUMBER) {
+        next();
+        return Expression{s_number(token._text), NUMBER};
+    }
+    if (token._type == Token::STRING) {
+        throw std::runtime_error("strings are not supported");
+    }
+    if (accept("true")) {
+        return Expression{"true", BOOLEAN};
+    }
+    if (accept("false")) {
+        return Expression{"false", BOOLEAN};
+    }
+    if (accept("(")) {
+        Expression inner = expression();
+        expect(")");
+        return inner;
+    }
+    std::string first = name();
+    if (accept(".")) {
+        std::string             function  = first + "." + name();
+        std::vector<Expression> arguments = this->arguments();
+        return call(function, arguments);
+    }
+    if (peek()._text == "(") {
+        std::vector<Expression> arguments = this->arguments();
+        return call(first, arguments);
+    }
+    return variable(first);
+}
+
+Translator::Expression Translator::variable(const std::string& name)
+{
+    for (auto scope = _scopes.rbegin(); scope != _scopes.rend(); ++scope) {
+        auto it = scope->find(name);
+        if (it != scope->end()) {
+            return Expression{it->second._name, it->second._type};
+        }
+    }
+    if (_functions.count(name)) {
+        throw std::runtime_error("function " + name + " used as a value");
+    }
+    // variable of the rule or a result, resolved by TemplateEvaluator::bind()
+    size_t index = 0;
+    while (index < _globals.size() && _globals[index] != name) {
+        index++;
+    }
+    if (index == _globals.size()) {
+        _globals.push_back(name);
+    }
+    _usesGlobals = true;
+    return Expression{"g[" + std::to_string(index) + "]", NUMBER};
+}
+
+Translator::Expression Translator::call(const std::string& function, std::vector<Expression>& arguments)
+{
+    std::string list;
+    for (const auto& argument : arguments) {
+        if (argument._type != NUMBER) {
+            throw std::runtime_error("boolean argument of " + function);
+        }
+        list += (list.empty() ? "" : ", ") + argument._code;
+    }
+
+    static const std::map<std::string, std::string> unary = {{"math.abs", "std::fabs"},
+        {"math.floor", "std::floor"}, {"math.ceil", "std::ceil"}, {"math.sqrt", "std::sqrt"}};
+    static const std::map<std::string, std::string> variadic = {{"math.max", "templateevaluator::max"},
+        {"math.min", "templateevaluator::min"}, {"fty.avg", "templateevaluator::avg"},
+        {"fty.maxdev", "templateevaluator::maxdev"}, {"fty.imbalance", "templateevaluator::imbalance"}};
+
+    auto it = _functions.find(function);
+    if (it != _functions.end()) {
+        if (arguments.size() != it->second._params) {
+            throw std::runtime_error("wrong number of arguments of " + function);
+        }
+        _usesGlobals = true;
+        return Expression{it->second._name + "(g" + (list.empty() ? "" : ", ") + list + ")", it->second._type};
+    }
+    if (unary.count(function)) {
+        if (arguments.size() != 1) {
+            throw std::runtime_error("wrong number of arguments of " + function);
+        }
+        return Expression{unary.at(function) + "(" + list + ")", NUMBER};
+    }
+    if (variadic.count(function)) {
+        // fty module takes at most 64 values
+        if (arguments.empty() || arguments.size() > 64) {
+            throw std::runtime_error("wrong number of arguments of " + function);
+        }
+        return Expression{variadic.at(function) + "(" + list + ")", NUMBER};
+    }
+    if (function == "fty.clamp") {
+        if (arguments.size() != 3) {
+            throw std::runtime_error("wrong number of arguments of " + function);
+        }
+        return Expression{"luafty::clamp(" + list + ")", NUMBER};
+    }
+    throw std::runtime_error("unsupported function " + function);
+}
+
+// Translated template
+struct Translated
+{
+    std::string _name;
+    std::string _space;
+};
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <output.cc> <template.rule>..." << std::endl;
+        return 1;
+    }
+
+    std::ostringstream out;
+    out << "// Generated by fty-alert-engine-codegen from the rule templates, do not edit\n\n"
+        << "#include \"templateevaluator.h\"\n#include <cmath>\n#include <stdexcept>\n";
+
+    std::vector<Translated> translated;
+    // code already translated -> its namespace
+    std::map<std::string, std::string> spaces;
+    for (int i = 2; i < argc; ++i) {
+        std::string path = argv[i];
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        if (name.size() > 5 && name.compare(name.size() - 5, 5, ".rule") == 0) {
+            name.resize(name.size() - 5);
+        }
+
+        std::string code;
+        try {
+            std::ifstream               f(path);
+            cxxtools::SerializationInfo si;
+            cxxtools::JsonDeserializer  json(f);
+            json.deserialize(si);
+            const cxxtools::SerializationInfo& rule = si.getMember(0);
+            if ((rule.name() != "single" && rule.name() != "threshold") || !rule.findMember("evaluation")) {
+                continue;
+            }
+            rule.getMember("evaluation") >>= code;
+        } catch (const std::exception& e) {
+            std::cerr << path << ": " << e.what() << std::endl;
+            return 1;
+        }
+
+        std::string space = "t" + std::to_string(spaces.size());
+        try {
+            auto known = spaces.find(code);
+            if (known == spaces.end()) {
+                Translator translator(code);
+                out << "\n// " << name << "\nnamespace " << space << " {\n" << translator.output();
+                out << "\nstatic const char* const code = " << s_literal(code) << ";\n";
+                out << "static const char* const globals[] = {";
+                for (const auto& global : translator.globals()) {
+                    out << s_literal(global) << ", ";
+                }
+                out << "NULL};\nstatic const size_t count  = " << translator.globals().size() << ";\n";
+                out << "static const size_t inputs = " << translator.inputs() << ";\n\n} // namespace " << space
+                    << "\n";
+                spaces[code] = space;
+                translated.push_back(Translated{name, space});
+            } else {
+                out << "\n// " << name << ": same code as " << known->second << "\n";
+                translated.push_back(Translated{name, known->second});
+            }
+        } catch (const std::exception& e) {
+            out << "\n// " << name << ": not translated (" << e.what() << ")\n";
+        }
+    }
+
+    out << "\nconst std::vector<TemplateEvaluator::Template>& TemplateEvaluator::templates(void)\n{\n"
+        << "    static const std::vector<Template> templates = {\n";
+    for (const auto& it : translated) {
+        const std::string& space = it._space;
+        out << "        {" << s_literal(it._name) << ", " << space << "::code, " << space << "::inputs, " << space
+            << "::globals, " << space << "::count, " << space << "::evaluate},\n";
+    }
+    out << "    };\n    return templates;\n}\n";
+
+    // output is rewritten only if changed, so the library is not rebuilt needlessly
+    std::string   output = out.str();
+    std::ifstream old(argv[1]);
+    std::string   previous((std::istreambuf_iterator<char>(old)), std::istreambuf_iterator<char>());
+    if (previous != output) {
+        std::ofstream f(argv[1]);
+        f << output;
+        if (!f) {
+            std::cerr << argv[1] << ": can't write the output" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
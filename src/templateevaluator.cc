@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "templateevaluator.h"
+#include "rule.h"
+#include <algorithm>
+#include <unordered_map>
+
+// templates() is defined by the generated templateevaluators.cc
+
+bool TemplateEvaluator::load(const std::string& code)
+{
+    // index by the code, built on the first use
+    static const std::unordered_map<std::string, const Template*> index = []() {
+        std::unordered_map<std::string, const Template*> result;
+        for (const auto& it : templates()) {
+            result.emplace(it._code, &it);
+        }
+        return result;
+    }();
+
+    _bound    = false;
+    _template = NULL;
+    _globals.clear();
+    auto it = index.find(code);
+    if (it == index.end()) {
+        return false;
+    }
+    _template = it->second;
+    return true;
+}
+
+bool TemplateEvaluator::bind(const std::map<std::string, double>& variables)
+{
+    _bound = false;
+    if (!_template) {
+        return false;
+    }
+    std::vector<double> globals;
+    for (size_t i = 0; i < _template->_globalCount; ++i) {
+        std::string name = _template->_globals[i];
+        // variables of the rule hide the globals of the state, like in the environment of the rule
+        auto variable = variables.find(name);
+        if (variable != variables.end()) {
+            globals.push_back(variable->second);
+            continue;
+        }
+        bool found = false;
+        for (int result = RULE_RESULT_TO_LOW_CRITICAL; result <= RULE_RESULT_UNKNOWN; result++) {
+            std::string upper = Rule::resultToString(result);
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+            if (upper == name) {
+                globals.push_back(result);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    _globals = std::move(globals);
+    _bound   = true;
+    return true;
+}
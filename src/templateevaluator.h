@@ -0,0 +1,163 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file templateevaluator.h
+/// @brief Native evaluators of the Lua code of shipped rule templates, generated at build time
+#pragma once
+
+#include "luafty.h"
+#include <cmath>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+/// Native evaluator of a rule, whose code is the code of a shipped template
+///
+/// Code of the templates in src/rule_templates is translated to C++ functions by fty-alert-engine-codegen when the
+/// engine is built (see templatecodegen.cc), the functions are registered by the name of the template. Rule,
+/// whose code is exactly the code of some template, is evaluated by the function, names the code reads from the
+/// environment (thresholds, results) are resolved by bind(). Other code (e.g. edited rules) is left to Lua.
+class TemplateEvaluator
+{
+public:
+    /// Generated function: values of parameters of main(), values of names read from the environment
+    typedef double (*Function)(const double* values, const double* globals);
+
+    /// Template translated at build time
+    struct Template
+    {
+        // name of the template file without the extension
+        const char* _name;
+        // code of the template
+        const char* _code;
+        // number of parameters of main()
+        size_t             _inputs;
+        const char* const* _globals;
+        size_t             _globalCount;
+        Function           _function;
+    };
+
+    TemplateEvaluator(){};
+
+    /// Gets all templates translated at build time
+    static const std::vector<Template>& templates(void);
+
+    /// Finds the template with the code
+    ///
+    /// @param[in] code - Lua code of the rule
+    /// @return true if the code is the code of a translated template
+    bool load(const std::string& code);
+
+    /// Resolves names read by the code to the variables of the rule or to the results (OK, HIGH_CRITICAL, ...)
+    ///
+    /// @param[in] variables - variables of the rule
+    /// @return false if some name is unknown (Lua has to evaluate it)
+    bool bind(const std::map<std::string, double>& variables);
+
+    /// Checks if the template is found and bound
+    bool isValid(void) const
+    {
+        return _template && _bound;
+    }
+
+    /// Gets the name of the template, NULL if not found
+    const char* name(void) const
+    {
+        return _template ? _template->_name : NULL;
+    }
+
+    /// Gets number of parameters of main()
+    size_t inputs(void) const
+    {
+        return _template ? _template->_inputs : 0;
+    }
+
+    /// Evaluates the code
+    ///
+    /// ATTENTION: throws, if the code fails in Lua with these values
+    ///
+    /// @param[in] values - values of parameters, at least inputs() of them
+    /// @return value returned by main()
+    double evaluate(const std::vector<double>& values) const
+    {
+        return _template->_function(values.data(), _globals.data());
+    }
+
+private:
+    const Template*     _template = NULL;
+    bool                _bound    = false;
+    std::vector<double> _globals;
+};
+
+/// Functions used by the generated code, with the semantics of Lua
+namespace templateevaluator {
+
+/// Lua operator %
+inline double mod(double a, double b)
+{
+    return a - std::floor(a / b) * b;
+}
+
+/// math.max(), the first one wins on NaN
+inline double max(double value)
+{
+    return value;
+}
+
+template <typename... T>
+double max(double first, double second, T... rest)
+{
+    return max(second > first ? second : first, rest...);
+}
+
+/// math.min(), the first one wins on NaN
+inline double min(double value)
+{
+    return value;
+}
+
+template <typename... T>
+double min(double first, double second, T... rest)
+{
+    return min(second < first ? second : first, rest...);
+}
+
+/// fty.avg(), fty.maxdev(), fty.imbalance()
+template <typename... T>
+double avg(T... values)
+{
+    const double array[] = {values...};
+    return luafty::avg(array, sizeof...(T));
+}
+
+template <typename... T>
+double maxdev(T... values)
+{
+    const double array[] = {values...};
+    return luafty::maxdev(array, sizeof...(T));
+}
+
+template <typename... T>
+double imbalance(T... values)
+{
+    const double array[] = {values...};
+    return luafty::imbalance(array, sizeof...(T));
+}
+
+} // namespace templateevaluator
@@ -0,0 +1,320 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "thresholdchain.h"
+#include "rule.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
+// Splits the code to tokens, returns false for anything not expected in a threshold chain
+static bool s_tokenize(const std::string& code, std::vector<std::string>& tokens)
+{
+    size_t i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        if (isspace(static_cast<unsigned char>(c))) {
+            i++;
+        } else if (isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            size_t start = i;
+            while (i < code.size() && (isalnum(static_cast<unsigned char>(code[i])) || code[i] == '_')) {
+                i++;
+            }
+            tokens.push_back(code.substr(start, i - start));
+        } else if (isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            char* end = NULL;
+            strtod(code.c_str() + i, &end);
+            size_t length = static_cast<size_t>(end - (code.c_str() + i));
+            if (length == 0) {
+                return false;
+            }
+            tokens.push_back(code.substr(i, length));
+            i += length;
+        } else if ((c == '<' || c == '>' || c == '=' || c == '~') && i + 1 < code.size() && code[i + 1] == '=') {
+            tokens.push_back(code.substr(i, 2));
+            i += 2;
+        } else if (c == '<' || c == '>' || c == '(' || c == ')' || c == ',' || c == ';') {
+            tokens.push_back(std::string(1, c));
+            i++;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool s_isKeyword(const std::string& token)
+{
+    static const std::vector<std::string> keywords = {"and", "break", "do", "else", "elseif", "end", "false", "for",
+        "function", "if", "in", "local", "nil", "not", "or", "repeat", "return", "then", "true", "until", "while"};
+    return std::find(keywords.begin(), keywords.end(), token) != keywords.end();
+}
+
+// Gets result of the rule by the name of Lua constant (OK, HIGH_CRITICAL, ...)
+static bool s_result(const std::string& token, int& result)
+{
+    for (int i = RULE_RESULT_TO_LOW_CRITICAL; i <= RULE_RESULT_UNKNOWN; i++) {
+        std::string upper = Rule::resultToString(i);
+        transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        if (upper == token) {
+            result = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds the end of the group opened by the parenthesis at first
+static size_t s_closing(const std::vector<std::string>& tokens, size_t first, size_t end)
+{
+    int depth = 0;
+    for (size_t i = first; i < end; ++i) {
+        if (tokens[i] == "(") {
+            depth++;
+        } else if (tokens[i] == ")" && --depth == 0) {
+            return i;
+        }
+    }
+    return end;
+}
+
+bool ThresholdChain::parseOperand(const std::string& token, const std::vector<std::string>& params, Operand& operand)
+{
+    auto param = std::find(params.begin(), params.end(), token);
+    if (param != params.end()) {
+        operand = Operand{true, static_cast<uint32_t>(param - params.begin())};
+        return true;
+    }
+    if (isdigit(static_cast<unsigned char>(token[0])) || token[0] == '.') {
+        operand = Operand{false, static_cast<uint32_t>(_constants.size())};
+        _constants.push_back(strtod(token.c_str(), NULL));
+        return true;
+    }
+    int result;
+    if (!isalpha(static_cast<unsigned char>(token[0])) && token[0] != '_') {
+        return false;
+    }
+    if (s_isKeyword(token) || s_result(token, result)) {
+        return false;
+    }
+    // threshold, value is known after bind()
+    for (const auto& threshold : _thresholds) {
+        if (threshold.first == token) {
+            operand = Operand{false, threshold.second};
+            return true;
+        }
+    }
+    operand = Operand{false, static_cast<uint32_t>(_constants.size())};
+    _thresholds.emplace_back(token, operand._index);
+    _constants.push_back(NAN);
+    return true;
+}
+
+bool ThresholdChain::parseCondition(
+    const std::vector<std::string>& tokens, size_t first, size_t end, const std::vector<std::string>& params)
+{
+    static const std::map<std::string, Operator> operators = {{"<", LESS}, {"<=", LESS_EQUAL}, {">", GREATER},
+        {">=", GREATER_EQUAL}, {"==", EQUAL}, {"~=", NOT_EQUAL}};
+
+    // (condition)
+    while (first < end && tokens[first] == "(" && s_closing(tokens, first, end) == end - 1) {
+        first++;
+        end--;
+    }
+
+    size_t start = first;
+    for (size_t i = first; i <= end; ++i) {
+        if (i < end && tokens[i] == "(") {
+            i = s_closing(tokens, i, end);
+            if (i == end) {
+                return false;
+            }
+            continue;
+        }
+        if (i < end && tokens[i] != "and" && tokens[i] != "or") {
+            continue;
+        }
+
+        // comparison [start, i), optionally in parentheses
+        size_t from = start;
+        size_t to   = i;
+        while (from < to && tokens[from] == "(" && s_closing(tokens, from, to) == to - 1) {
+            from++;
+            to--;
+        }
+        if (to - from != 3 || operators.count(tokens[from + 1]) == 0) {
+            return false;
+        }
+        Comparison comparison;
+        if (!parseOperand(tokens[from], params, comparison._left) ||
+            !parseOperand(tokens[from + 2], params, comparison._right)) {
+            return false;
+        }
+        comparison._operator    = operators.at(tokens[from + 1]);
+        comparison._endOfClause = (i == end || tokens[i] == "or");
+        _comparisons.push_back(comparison);
+        start = i + 1;
+    }
+    return start == end + 1;
+}
+
+bool ThresholdChain::parse(const std::string& code)
+{
+    _parsed = false;
+    _bound  = false;
+    _inputs = 0;
+    _comparisons.clear();
+    _branches.clear();
+    _constants.clear();
+    _thresholds.clear();
+
+    std::vector<std::string> tokens;
+    if (!s_tokenize(code, tokens) || tokens.size() < 4 || tokens[0] != "function" || tokens[1] != "main" ||
+        tokens[2] != "(") {
+        return false;
+    }
+
+    // function main(p1, p2, ...)
+    std::vector<std::string> params;
+    size_t                   i = 3;
+    while (i < tokens.size() && tokens[i] != ")") {
+        if (s_isKeyword(tokens[i]) || !(isalpha(static_cast<unsigned char>(tokens[i][0])) || tokens[i][0] == '_')) {
+            return false;
+        }
+        params.push_back(tokens[i++]);
+        if (i < tokens.size() && tokens[i] == ",") {
+            i++;
+        } else if (i < tokens.size() && tokens[i] != ")") {
+            return false;
+        }
+    }
+    if (i == tokens.size() || params.empty()) {
+        return false;
+    }
+    i++;
+
+    // if (condition) then return RESULT end; ...
+    while (i < tokens.size() && tokens[i] != "return") {
+        if (tokens[i] == ";") {
+            i++;
+            continue;
+        }
+        if (tokens[i] != "if") {
+            return false;
+        }
+        size_t then = std::find(tokens.begin() + static_cast<long>(i), tokens.end(), "then") - tokens.begin();
+        if (then == tokens.size()) {
+            return false;
+        }
+        Branch branch;
+        branch._first = static_cast<uint32_t>(_comparisons.size());
+        if (!parseCondition(tokens, i + 1, then, params)) {
+            return false;
+        }
+        branch._end = static_cast<uint32_t>(_comparisons.size());
+        i           = then + 1;
+        if (i + 1 >= tokens.size() || tokens[i] != "return" || !s_result(tokens[i + 1], branch._result)) {
+            return false;
+        }
+        i += 2;
+        if (i < tokens.size() && tokens[i] == ";") {
+            i++;
+        }
+        if (i == tokens.size() || tokens[i] != "end") {
+            return false;
+        }
+        i++;
+        _branches.push_back(branch);
+    }
+
+    // return RESULT; end
+    if (i + 1 >= tokens.size() || !s_result(tokens[i + 1], _default)) {
+        return false;
+    }
+    i += 2;
+    while (i < tokens.size() && tokens[i] == ";") {
+        i++;
+    }
+    if (i + 1 != tokens.size() || tokens[i] != "end") {
+        return false;
+    }
+
+    _inputs = params.size();
+    _parsed = true;
+    _bound  = _thresholds.empty();
+    return true;
+}
+
+bool ThresholdChain::bind(const std::map<std::string, double>& variables)
+{
+    _bound = false;
+    if (!_parsed) {
+        return false;
+    }
+    for (const auto& threshold : _thresholds) {
+        auto it = variables.find(threshold.first);
+        if (it == variables.end()) {
+            return false;
+        }
+        _constants[threshold.second] = it->second;
+    }
+    _bound = true;
+    return true;
+}
+
+int ThresholdChain::evaluate(const std::vector<double>& values) const
+{
+    for (const auto& branch : _branches) {
+        bool clause = true;
+        for (uint32_t i = branch._first; i < branch._end; ++i) {
+            const Comparison& comparison = _comparisons[i];
+            if (clause) {
+                double left  = value(comparison._left, values);
+                double right = value(comparison._right, values);
+                switch (comparison._operator) {
+                    case LESS:
+                        clause = left < right;
+                        break;
+                    case LESS_EQUAL:
+                        clause = left <= right;
+                        break;
+                    case GREATER:
+                        clause = left > right;
+                        break;
+                    case GREATER_EQUAL:
+                        clause = left >= right;
+                        break;
+                    case EQUAL:
+                        clause = left == right;
+                        break;
+                    case NOT_EQUAL:
+                        clause = left != right;
+                        break;
+                }
+            }
+            if (comparison._endOfClause) {
+                if (clause) {
+                    return branch._result;
+                }
+                clause = true;
+            }
+        }
+    }
+    return _default;
+}
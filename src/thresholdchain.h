@@ -0,0 +1,134 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file thresholdchain.h
+/// @brief Native evaluation of Lua rules made of threshold comparisons
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/// Native evaluator of the canonical threshold chain
+///
+/// Most of the rules shipped in templates have code like
+///
+///     function main(v1,v2,v3)
+///         if (v1 > high_critical or v2 > high_critical or v3 > high_critical) then return HIGH_CRITICAL end;
+///         ...
+///         return OK;
+///     end
+///
+/// Such code is recognized by parse() and evaluated without Lua: conditions are kept as a flat array of
+/// comparisons (or-ed clauses of and-ed comparisons), thresholds are resolved by bind(). Code of any other
+/// shape is refused, so the rule is evaluated by Lua.
+class ThresholdChain
+{
+public:
+    ThresholdChain(){};
+
+    /// Recognizes the code
+    ///
+    /// @param[in] code - Lua code of the rule
+    /// @return true if the code is a threshold chain
+    bool parse(const std::string& code);
+
+    /// Resolves names of thresholds to the values
+    ///
+    /// @param[in] variables - variables of the rule
+    /// @return false if some name is not a variable of the rule (Lua has to evaluate it)
+    bool bind(const std::map<std::string, double>& variables);
+
+    /// Checks if the chain is parsed and bound
+    bool isValid(void) const
+    {
+        return _parsed && _bound;
+    }
+
+    /// Gets number of parameters of main()
+    size_t inputs(void) const
+    {
+        return _inputs;
+    }
+
+    /// Evaluates the chain
+    ///
+    /// @param[in] values - values of parameters, at least inputs() of them
+    /// @return result of the rule (RULE_RESULT_*)
+    int evaluate(const std::vector<double>& values) const;
+
+private:
+    enum Operator : uint8_t
+    {
+        LESS,
+        LESS_EQUAL,
+        GREATER,
+        GREATER_EQUAL,
+        EQUAL,
+        NOT_EQUAL
+    };
+
+    /// Operand is a parameter (index of the value) or a constant (index to _constants)
+    struct Operand
+    {
+        bool     _input;
+        uint32_t _index;
+    };
+
+    struct Comparison
+    {
+        Operand  _left;
+        Operand  _right;
+        Operator _operator;
+        // the last comparison of and-ed clause
+        bool _endOfClause;
+    };
+
+    /// if (condition) then return result end
+    struct Branch
+    {
+        // range in _comparisons
+        uint32_t _first;
+        uint32_t _end;
+        int      _result;
+    };
+
+    bool parseCondition(const std::vector<std::string>& tokens, size_t first, size_t end,
+        const std::vector<std::string>& params);
+    bool parseOperand(const std::string& token, const std::vector<std::string>& params, Operand& operand);
+
+    double value(const Operand& operand, const std::vector<double>& values) const
+    {
+        return operand._input ? values[operand._index] : _constants[operand._index];
+    }
+
+    bool   _parsed = false;
+    bool   _bound  = false;
+    size_t _inputs = 0;
+
+    std::vector<Comparison> _comparisons;
+    std::vector<Branch>     _branches;
+    int                     _default = 0;
+
+    /// Values of constants: numbers are known from the code, thresholds are set by bind()
+    std::vector<double> _constants;
+
+    /// Names of thresholds and their index in _constants
+    std::vector<std::pair<std::string, uint32_t>> _thresholds;
+};
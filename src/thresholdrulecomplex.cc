@@ -50,6 +50,7 @@ int ThresholdRuleComplex::fill(const cxxtools::SerializationInfo& si)
     for (const auto& ccm : cxxtools_Char_metrics) {
         _metrics.push_back(cxxtools::Utf8Codec::encode(ccm));
     }
+    _resolveTopics();
 
     si_getValueUtf8(threshold, "rule_name", _name);
     si_getValueUtf8(threshold, "element", _element);
@@ -88,8 +89,23 @@ int ThresholdRuleComplex::fill(const cxxtools::SerializationInfo& si)
         throw std::runtime_error("parameter 'results' in json must be an array.");
     }
     outcomes >>= _outcomes;
+    _debounce.fill(threshold);
 
+    // aggregates
+    _fillAggregates(threshold);
+
+    // expression is evaluated natively instead of Lua code
     std::string tmp;
+    if (threshold.findMember("expression") != NULL) {
+        threshold.getMember("expression") >>= tmp;
+        try {
+            expression(tmp);
+        } catch (const std::exception& e) {
+            log_error("something with expression: %s", e.what());
+            return 2;
+        }
+        return 0;
+    }
     threshold.getMember("evaluation") >>= tmp;
     try {
         code(tmp);
@@ -97,6 +97,7 @@ public:
             throw std::runtime_error("parameter 'results' in json must be an array.");
         }
         outcomes >>= _outcomes;
+        _debounce.fill(threshold);
         return 0;
     }
 
@@ -22,13 +22,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include "rule.h"
+#include <cmath>
 #include <cxxtools/serializationinfo.h>
 #include <fty_log.h>
+#include <vector>
 
 class ThresholdRuleSimple : public Rule
 {
 public:
     ThresholdRuleSimple(){};
+    ThresholdRuleSimple(const ThresholdRuleSimple&) = delete;
+    ThresholdRuleSimple& operator=(const ThresholdRuleSimple&) = delete;
 
     std::string whoami() const
     {
@@ -90,7 +94,7 @@ public:
             throw std::runtime_error("parameter 'values' in json must be an array");
         }
         values >>= tmp_values;
-        globalVariables(tmp_values);
+        Rule::globalVariables(tmp_values);
 
         // outcomes
         auto outcomes = threshold.getMember("results");
@@ -99,68 +103,100 @@ public:
             throw std::runtime_error("parameter 'results' in json must be an array.");
         }
         outcomes >>= _outcomes;
+        _debounce.fill(threshold);
+
+        // hysteresis
+        _hysteresis = 0;
+        if (threshold.findMember("hysteresis") != NULL) {
+            threshold.getMember("hysteresis") >>= _hysteresis;
+            if (!(_hysteresis >= 0)) {
+                log_error("parameter 'hysteresis' in json must be a non negative number.");
+                throw std::runtime_error("parameter 'hysteresis' in json must be a non negative number.");
+            }
+        }
+        _pack();
         return 0;
     }
 
     int evaluate(const MetricList& metricList, PureAlert& pureAlert)
     {
-        // ASSUMPTION: constants are in values
-        //  high_critical
-        //  high_warning
-        //  low_warning
-        //  low_critical
-        const auto GV           = getGlobalVariables();
-        auto       valueToCheck = GV.find("high_critical");
-        if (valueToCheck != GV.cend()) {
-            if (valueToCheck->second < metricList.getLastMetric().getValue()) {
-                auto outcome        = _outcomes.find("high_critical");
-                pureAlert           = PureAlert(ALERT_START, metricList.getLastMetric().getTimestamp(),
-                    outcome->second._description, this->_element, this->_rule_class);
-                pureAlert._severity = outcome->second._severity;
-                pureAlert._actions  = outcome->second._actions;
-                return 0;
-            }
+        return evaluate(metricList, metricList.getLastMetric().getTopicId(), pureAlert);
+    };
+
+    int evaluate(const MetricList& metricList, TopicId trigger, PureAlert& pureAlert)
+    {
+        double value = metricList.find(trigger);
+        // metric expired, nothing to evaluate
+        if (std::isnan(value)) {
+            log_debug("Don't have everything for '%s' yet", _name.c_str());
+            return RULE_RESULT_UNKNOWN;
         }
-        valueToCheck = GV.find("high_warning");
-        if (valueToCheck != GV.cend()) {
-            if (valueToCheck->second < metricList.getLastMetric().getValue()) {
-                auto outcome        = _outcomes.find("high_warning");
-                pureAlert           = PureAlert(ALERT_START, metricList.getLastMetric().getTimestamp(),
-                    outcome->second._description, this->_element, this->_rule_class);
-                pureAlert._severity = outcome->second._severity;
-                pureAlert._actions  = outcome->second._actions;
-                return 0;
-            }
+        double limits[BAND_SIZE];
+        _limits(limits);
+        double level = _level(value, limits[0], limits[1], limits[2], limits[3]);
+        return _alert(_settle(static_cast<int>(level), value), metricList.getTimestamp(trigger), pureAlert);
+    };
+
+    /// Evaluates simple threshold rules together
+    ///
+    /// Values and limits are gathered to contiguous arrays and classified by one loop (see classify()), alerts are
+    /// made afterwards. Gives the same results as evaluate() of every rule.
+    /// @param[in] rules - rules to evaluate
+    /// @param[in] triggers - topic of the metric triggering every rule
+    /// @param[in] metricList - known metrics
+    /// @param[out] alerts - alert of every rule
+    /// @param[out] results - result of evaluate() of every rule
+    static void evaluateBatch(const std::vector<ThresholdRuleSimple*>& rules, const std::vector<TopicId>& triggers,
+        const MetricList& metricList, std::vector<PureAlert>& alerts, std::vector<int>& results)
+    {
+        const size_t count = rules.size();
+        alerts.assign(count, PureAlert());
+        results.assign(count, RULE_RESULT_UNKNOWN);
+        if (count == 0) {
+            return;
         }
-        valueToCheck = GV.find("low_critical");
-        if (valueToCheck != GV.cend()) {
-            if (valueToCheck->second > metricList.getLastMetric().getValue()) {
-                auto outcome        = _outcomes.find("low_critical");
-                pureAlert           = PureAlert(ALERT_START, metricList.getLastMetric().getTimestamp(),
-                    outcome->second._description, this->_element, this->_rule_class);
-                pureAlert._severity = outcome->second._severity;
-                pureAlert._actions  = outcome->second._actions;
-                return 0;
+
+        std::vector<double> values(count);
+        std::vector<double> limits(BAND_SIZE * count);
+        for (size_t i = 0; i < count; ++i) {
+            double band[BAND_SIZE];
+            rules[i]->_limits(band);
+            values[i] = metricList.find(triggers[i]);
+            for (size_t j = 0; j < BAND_SIZE; ++j) {
+                limits[j * count + i] = band[j];
             }
         }
-        valueToCheck = GV.find("low_warning");
-        if (valueToCheck != GV.cend()) {
-            if (valueToCheck->second > metricList.getLastMetric().getValue()) {
-                auto outcome        = _outcomes.find("low_warning");
-                pureAlert           = PureAlert(ALERT_START, metricList.getLastMetric().getTimestamp(),
-                    outcome->second._description, this->_element, this->_rule_class);
-                pureAlert._severity = outcome->second._severity;
-                pureAlert._actions  = outcome->second._actions;
-                return 0;
+        std::vector<double> levels(count);
+        classify(count, values.data(), &limits[0], &limits[count], &limits[2 * count], &limits[3 * count],
+            levels.data());
+
+        for (size_t i = 0; i < count; ++i) {
+            // metric expired, nothing to evaluate
+            if (std::isnan(values[i])) {
+                log_debug("Don't have everything for '%s' yet", rules[i]->_name.c_str());
+                continue;
             }
+            int level  = rules[i]->_settle(static_cast<int>(levels[i]), values[i]);
+            results[i] = rules[i]->_alert(level, metricList.getTimestamp(triggers[i]), alerts[i]);
         }
-        // if we are here -> no alert was detected
-        // TODO actions
-        pureAlert = PureAlert(
-            ALERT_RESOLVED, metricList.getLastMetric().getTimestamp(), "ok", this->_element, this->_rule_class);
-        pureAlert.print();
-        return 0;
-    };
+    }
+
+    /// Classifies values by the limits of their bands, see _level()
+    ///
+    /// The loop has no branches and works only with doubles in separate arrays, so the compiler vectorizes it.
+    static void classify(size_t count, const double* values, const double* highCritical, const double* highWarning,
+        const double* lowCritical, const double* lowWarning, double* levels)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            levels[i] = _level(values[i], highCritical[i], highWarning[i], lowCritical[i], lowWarning[i]);
+        }
+    }
+
+    void globalVariables(const std::map<std::string, double>& vars)
+    {
+        Rule::globalVariables(vars);
+        _pack();
+    }
 
     bool isTopicInteresting(const std::string& topic) const
     {
@@ -173,6 +209,125 @@ public:
     };
 
 private:
+    /// Number of thresholds, in the order of the evaluation: high_critical, high_warning, low_critical, low_warning
+    static constexpr size_t BAND_SIZE = 4;
+
+    /// Thresholds of the rule packed for the evaluation
+    struct Band
+    {
+        // NaN if the threshold is not set, no value crosses it then
+        double _limits[BAND_SIZE] = {NAN, NAN, NAN, NAN};
+        // outcome of crossing the threshold, points to _outcomes
+        const Outcome* _outcomes[BAND_SIZE] = {NULL, NULL, NULL, NULL};
+    };
+
+    /// Gets the level of the value: 0 if ok, 1 + index of the first crossed threshold otherwise
+    static double _level(double value, double highCritical, double highWarning, double lowCritical, double lowWarning)
+    {
+        // from the last one, so the first crossed threshold wins
+        double level = value < lowWarning ? 4.0 : 0.0;
+        level        = value < lowCritical ? 3.0 : level;
+        level        = value > highWarning ? 2.0 : level;
+        level        = value > highCritical ? 1.0 : level;
+        return level;
+    }
+
+    /// Gets the limits of the band for the next evaluation
+    ///
+    /// With hysteresis, thresholds crossed by the last level are left only after crossing them back by the margin.
+    void _limits(double* limits) const
+    {
+        for (size_t i = 0; i < BAND_SIZE; ++i) {
+            limits[i] = _band._limits[i];
+        }
+        switch (_last) {
+            case 1:
+                limits[0] -= _hysteresis;
+                limits[1] -= _hysteresis;
+                break;
+            case 2:
+                limits[1] -= _hysteresis;
+                break;
+            case 3:
+                limits[2] += _hysteresis;
+                limits[3] += _hysteresis;
+                break;
+            case 4:
+                limits[3] += _hysteresis;
+                break;
+        }
+    }
+
+    /// Remembers the level of the evaluation, counts the transition suppressed by the hysteresis
+    ///
+    /// The transition is counted once, when the held level starts differing from the level without the hysteresis.
+    int _settle(int level, double value)
+    {
+        bool held = false;
+        if (_hysteresis > 0) {
+            const double* limits = _band._limits;
+            held = static_cast<int>(_level(value, limits[0], limits[1], limits[2], limits[3])) != level;
+            if (held && !_held) {
+                _debounce.suppress();
+            }
+        }
+        _held = held;
+        _last = level;
+        return level;
+    }
+
+    /// Makes the alert of the level
+    /// @param[in] timestamp - timestamp of the triggering metric
+    int _alert(int level, uint64_t timestamp, PureAlert& pureAlert) const
+    {
+        if (level == 0) {
+            // if we are here -> no alert was detected
+            // TODO actions
+            pureAlert = PureAlert(ALERT_RESOLVED, timestamp, "ok", this->_element, this->_rule_class);
+            pureAlert.print();
+            return 0;
+        }
+        const Outcome* outcome = _band._outcomes[level - 1];
+        pureAlert = PureAlert(ALERT_START, timestamp, outcome->_description, this->_element,
+            this->_rule_class);
+        pureAlert._severity = outcome->_severity;
+        pureAlert._actions  = outcome->_actions;
+        return 0;
+    }
+
+    /// Packs the thresholds and their outcomes to _band
+    void _pack(void)
+    {
+        static const char* names[BAND_SIZE] = {"high_critical", "high_warning", "low_critical", "low_warning"};
+        const auto GV = getGlobalVariables();
+        _band         = Band();
+        for (size_t i = 0; i < BAND_SIZE; ++i) {
+            auto limit = GV.find(names[i]);
+            if (limit == GV.cend()) {
+                continue;
+            }
+            auto outcome = _outcomes.find(names[i]);
+            if (outcome == _outcomes.cend()) {
+                log_error("Rule '%s' has no result '%s', the threshold is ignored", _name.c_str(), names[i]);
+                continue;
+            }
+            _band._limits[i]   = limit->second;
+            _band._outcomes[i] = &outcome->second;
+        }
+    }
+
     // needed metric topic
     std::string _metric;
+
+    // points to _outcomes, so the rule is not copyable
+    Band _band;
+
+    // margin of the thresholds, see _limits()
+    double _hysteresis = 0;
+
+    // level of the last evaluation
+    int _last = 0;
+
+    // the last level was held by the hysteresis
+    bool _held = false;
 };
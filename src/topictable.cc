@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "topictable.h"
+#include <mutex>
+
+TopicTable& TopicTable::instance(void)
+{
+    static TopicTable table;
+    return table;
+}
+
+TopicTable::~TopicTable()
+{
+    for (auto& chunk : _chunks) {
+        delete[] chunk.load();
+    }
+}
+
+void TopicTable::locate(TopicId id, size_t& chunk, size_t& offset)
+{
+    // chunk k starts at identifier FIRST_CHUNK * (2^k - 1)
+    uint64_t n = uint64_t(id) + FIRST_CHUNK;
+    chunk      = size_t(__builtin_clzll(FIRST_CHUNK) - __builtin_clzll(n));
+    offset     = size_t(n - (uint64_t(FIRST_CHUNK) << chunk));
+}
+
+TopicId TopicTable::findLocked(const std::string& topic) const
+{
+    auto it = _ids.find(topic);
+    return it != _ids.end() ? it->second : TOPIC_NONE;
+}
+
+TopicId TopicTable::internLocked(const std::string& topic)
+{
+    TopicId id = findLocked(topic);
+    if (id != TOPIC_NONE) {
+        return id;
+    }
+    id = static_cast<TopicId>(_size.load(std::memory_order_relaxed));
+
+    size_t chunk, offset;
+    locate(id, chunk, offset);
+    std::string* names = _chunks[chunk].load(std::memory_order_relaxed);
+    if (!names) {
+        names = new std::string[FIRST_CHUNK << chunk];
+        _chunks[chunk].store(names, std::memory_order_release);
+    }
+    names[offset] = topic;
+    // the topic is complete before readers can see the identifier
+    _size.store(size_t(id) + 1, std::memory_order_release);
+    _ids.emplace(topic, id);
+    return id;
+}
+
+TopicId TopicTable::intern(const std::string& topic)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        TopicId                             id = findLocked(topic);
+        if (id != TOPIC_NONE) {
+            return id;
+        }
+    }
+    std::unique_lock<std::shared_mutex> lock(_mutex);
+    return internLocked(topic);
+}
+
+TopicId TopicTable::intern(const char* source, const char* element)
+{
+    // buffer is reused, so no allocation is done for already known topics
+    thread_local std::string topic;
+    topic.assign(source).append(1, '@').append(element);
+
+    return intern(topic);
+}
+
+TopicId TopicTable::find(const std::string& topic) const
+{
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    return findLocked(topic);
+}
+
+TopicId TopicTable::find(const char* source, const char* element) const
+{
+    thread_local std::string topic;
+    topic.assign(source).append(1, '@').append(element);
+
+    return find(topic);
+}
+
+const std::string& TopicTable::name(TopicId id) const
+{
+    static const std::string empty;
+
+    if (id >= _size.load(std::memory_order_acquire)) {
+        return empty;
+    }
+    size_t chunk, offset;
+    locate(id, chunk, offset);
+    return _chunks[chunk].load(std::memory_order_acquire)[offset];
+}
+
+size_t TopicTable::size(void) const
+{
+    return _size.load(std::memory_order_acquire);
+}
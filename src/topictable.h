@@ -0,0 +1,114 @@
+/*
+Copyright (C) 2014 - 2020 Eaton
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/// @file topictable.h
+/// @brief Process wide table of interned metric topics
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+/// Identifier of the interned topic
+typedef uint32_t TopicId;
+
+/// Identifier of no topic
+constexpr TopicId TOPIC_NONE = std::numeric_limits<TopicId>::max();
+
+/// Process wide table of interned topics ("metric@element")
+///
+/// Every topic gets a dense identifier (0, 1, 2, ...) the first time it is seen, so metrics, rules and
+/// evaluation filters can be indexed by a number instead of hashing the same string again and again.
+/// Identifiers are never released: topics are bounded by assets x metrics. Table is thread safe: name() of
+/// an interned identifier doesn't lock at all, find() takes a shared lock, only adding a topic is exclusive.
+class TopicTable
+{
+public:
+    /// Gets the table of the process
+    static TopicTable& instance(void);
+
+    /// Gets identifier of the topic, topic is added if it isn't known yet
+    ///
+    /// @param[in] topic - topic ("metric@element")
+    /// @return identifier of the topic
+    TopicId intern(const std::string& topic);
+
+    /// Gets identifier of the topic "source@element", topic is added if it isn't known yet
+    ///
+    /// @param[in] source - metric name
+    /// @param[in] element - asset name
+    /// @return identifier of the topic
+    TopicId intern(const char* source, const char* element);
+
+    /// Gets identifier of known topic
+    ///
+    /// @param[in] topic - topic ("metric@element")
+    /// @return identifier of the topic or TOPIC_NONE if the topic isn't known
+    TopicId find(const std::string& topic) const;
+
+    /// Gets identifier of known topic "source@element"
+    ///
+    /// @param[in] source - metric name
+    /// @param[in] element - asset name
+    /// @return identifier of the topic or TOPIC_NONE if the topic isn't known
+    TopicId find(const char* source, const char* element) const;
+
+    /// Gets topic of the identifier
+    ///
+    /// Returned reference stays valid for the whole life of the process. Doesn't lock.
+    /// @param[in] id - identifier of the topic
+    /// @return topic or empty string if the identifier is unknown
+    const std::string& name(TopicId id) const;
+
+    /// Gets number of interned topics
+    size_t size(void) const;
+
+private:
+    TopicTable(){};
+    ~TopicTable();
+
+    /// Number of topics in the first chunk, chunk k holds FIRST_CHUNK << k topics
+    static constexpr size_t FIRST_CHUNK = 1024;
+
+    /// Number of chunks, enough for every identifier
+    static constexpr size_t CHUNKS = 32;
+
+    /// Gets chunk of the identifier and its position in the chunk
+    static void locate(TopicId id, size_t& chunk, size_t& offset);
+
+    /// Gets identifier of the topic, _mutex must be locked exclusively
+    TopicId internLocked(const std::string& topic);
+
+    /// Gets identifier of known topic, _mutex must be locked
+    TopicId findLocked(const std::string& topic) const;
+
+    /// Guards _ids and adding of topics
+    mutable std::shared_mutex _mutex;
+
+    /// Topics indexed by identifier in chunks, which are never moved, so they are read without locking
+    std::atomic<std::string*> _chunks[CHUNKS] = {};
+
+    /// Number of topics published in _chunks
+    std::atomic<size_t> _size{0};
+
+    /// Identifiers indexed by topic
+    std::unordered_map<std::string, TopicId> _ids;
+};
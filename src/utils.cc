@@ -195,4 +195,13 @@ std::string join(const char** str_arr, const char* separator)
     }
 }
 
+uint64_t fnv1a64(const char* data, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
 } // namespace utils
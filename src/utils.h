@@ -87,4 +87,13 @@ std::string join(const char** str_arr, uint32_t length, const char* separator);
 /// item is encountered \note Use this version only for arrays that are NULL terminated!
 std::string join(const char** str_arr, const char* separator);
 
+/// Computes 64 bits FNV-1a hash of the data
+///
+/// Hash is stable across runs and platforms (unlike std::hash), so it can be persisted or used for sharding.
+/// @param[in] data - data to hash
+/// @param[in] size - size of data
+/// @param[in] hash - initial value, allows to chain several calls
+/// @return hash of the data
+uint64_t fnv1a64(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL);
+
 } // namespace utils
@@ -2,6 +2,12 @@
 #include <fty_log.h>
 #include "src/rule.h"
 #include "src/alertconfiguration.h"
+#include "src/luabytecodecache.h"
+#include "src/luarule.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
 
 static bool double_equals(double d1, double d2)
 {
@@ -165,4 +171,398 @@ TEST_CASE("alertconfiguration test")
                "function main(abc_sss1, abc_sss2) local new_value = abc_sss1*a1 + abc_sss2*a2 if  ( new_value > 0 ) "
                "then return HIGH_WARNING end if ( new_value < -10 ) then return HIGH_CRITICAL end return OK end");
     }
+
+    // rules sharing one Lua state don't see variables and functions of each other
+    LuaRule::sharedVm(true);
+    {
+        std::unique_ptr<Rule> single;
+        std::unique_ptr<Rule> complex;
+        std::ifstream         f1(dir + "single.rule");
+        std::ifstream         f2(dir + "complexthreshold.rule");
+        REQUIRE(readRule(f1, single) == 0);
+        REQUIRE(readRule(f2, complex) == 0);
+        LuaRule* singleLua  = dynamic_cast<LuaRule*>(single.get());
+        LuaRule* complexLua = dynamic_cast<LuaRule*>(complex.get());
+        REQUIRE(singleLua);
+        REQUIRE(complexLua);
+
+        CHECK(singleLua->luaEvaluate({1, 0}) == RULE_RESULT_TO_HIGH_WARNING);
+        CHECK(singleLua->luaEvaluate({0, 0}) == RULE_RESULT_OK);
+        CHECK(complexLua->luaEvaluate({20, 5}) == RULE_RESULT_TO_LOW_CRITICAL);
+        CHECK(complexLua->luaEvaluate({30, 25}) == RULE_RESULT_TO_HIGH_WARNING);
+
+        // variables are changed in the environment of the rule only
+        complex->globalVariables(
+            {{"low_critical", 0}, {"low_warning", 0}, {"high_warning", 100}, {"high_critical", 200}});
+        CHECK(complexLua->luaEvaluate({30, 25}) == RULE_RESULT_OK);
+        CHECK(singleLua->luaEvaluate({1, 0}) == RULE_RESULT_TO_HIGH_WARNING);
+
+        // code is bound by the first evaluation, rules with the same code share the compiled chunk
+        std::unique_ptr<Rule>          copy;
+        std::ifstream                  f4(dir + "complexthreshold.rule");
+        std::vector<LuaVm::ChunkUsers> chunks;
+        auto                           shared = [&chunks]() {
+            return std::count_if(chunks.begin(), chunks.end(), [](const LuaVm::ChunkUsers& chunk) {
+                return chunk._users == 2;
+            });
+        };
+        REQUIRE(readRule(f4, copy) == 0);
+        LuaVm::local()->chunks(chunks);
+        CHECK(chunks.size() == 2);
+        CHECK(shared() == 0);
+        CHECK(dynamic_cast<LuaRule*>(copy.get())->luaEvaluate({30, 25}) == RULE_RESULT_TO_HIGH_WARNING);
+        chunks.clear();
+        LuaVm::local()->chunks(chunks);
+        CHECK(chunks.size() == 2);
+        CHECK(shared() == 1);
+        copy.reset();
+        chunks.clear();
+        LuaVm::local()->chunks(chunks);
+        CHECK(chunks.size() == 2);
+
+        std::ifstream f3(dir + "complexthreshold_lua_error.rule");
+        CHECK(readRule(f3, rule) == 2);
+    }
+    LuaRule::sharedVm(false);
+
+    // compiled code survives the restart, stale entries are dropped
+    {
+        LuaVm             vm;
+        LuaBytecodeCache& cache = LuaBytecodeCache::instance();
+        const std::string file  = (std::filesystem::temp_directory_path() / "fty-alert-engine-test.cache").native();
+        const std::string code1 = "function main(x) return x end";
+        const std::string code2 = "function main(x) return -x end";
+        std::remove(file.c_str());
+
+        CHECK(cache.open(file) == 0);
+        REQUIRE(cache.load(vm.state(), code1) == 0);
+        REQUIRE(cache.load(vm.state(), code2) == 0);
+        CHECK(cache.load(vm.state(), "function main(") != 0);
+        lua_settop(vm.state(), 0);
+        CHECK(cache.size() == 2);
+        CHECK(cache.save() == 0);
+
+        CHECK(cache.open(file) == 2);
+        REQUIRE(cache.load(vm.state(), code1) == 0);
+        REQUIRE(lua_pcall(vm.state(), 0, 0, 0) == 0);
+        lua_getglobal(vm.state(), "main");
+        lua_pushnumber(vm.state(), 42);
+        REQUIRE(lua_pcall(vm.state(), 1, 1, 0) == 0);
+        CHECK(lua_tonumber(vm.state(), -1) == 42);
+        lua_settop(vm.state(), 0);
+        CHECK(cache.save() == 0);
+        CHECK(cache.open(file) == 1);
+
+        // corrupted entry is dropped, its code is compiled again
+        REQUIRE(cache.load(vm.state(), code1) == 0);
+        REQUIRE(cache.load(vm.state(), code2) == 0);
+        lua_settop(vm.state(), 0);
+        CHECK(cache.save() == 0);
+        {
+            std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+            f.seekg(-1, std::ios::end);
+            char last = static_cast<char>(f.get());
+            f.seekp(-1, std::ios::end);
+            f.put(static_cast<char>(last ^ 1));
+        }
+        CHECK(cache.open(file) == 1);
+        REQUIRE(cache.load(vm.state(), code1) == 0);
+        REQUIRE(cache.load(vm.state(), code2) == 0);
+        REQUIRE(lua_pcall(vm.state(), 0, 0, 0) == 0);
+        lua_getglobal(vm.state(), "main");
+        lua_pushnumber(vm.state(), 42);
+        REQUIRE(lua_pcall(vm.state(), 1, 1, 0) == 0);
+        CHECK(lua_tonumber(vm.state(), -1) == -42);
+        lua_settop(vm.state(), 0);
+        CHECK(cache.size() == 2);
+
+        // file of other version is ignored
+        {
+            std::ofstream out(file, std::ios::trunc);
+            out << "something else\n";
+        }
+        CHECK(cache.open(file) == 0);
+        std::remove(file.c_str());
+        cache.open("");
+    }
+}
+
+TEST_CASE("alert list test")
+{
+    AlertConfiguration::B entry;
+    std::ifstream         f("test/testrules/pattern.rule");
+    REQUIRE(readRule(f, entry.first) == 0);
+    PureAlert toSend;
+
+    SECTION("lookup")
+    {
+        CHECK(entry.second.find("asset-1") == NULL);
+        CHECK(entry.second.add(PureAlert(ALERT_START, 1, "first", "asset-1", "WARNING", {}))._element == "asset-1");
+        CHECK_THROWS_AS(
+            entry.second.add(PureAlert(ALERT_START, 2, "again", "asset-1", "WARNING", {})), std::logic_error);
+        REQUIRE(entry.second.find("asset-1") != NULL);
+        CHECK(entry.second.find("asset-1")->_description == "first");
+        entry.second.clear();
+        CHECK(entry.second.empty());
+        CHECK(entry.second.find("asset-1") == NULL);
+    }
+
+    SECTION("update keeps order")
+    {
+        AlertConfiguration config("");
+        for (const char* element : {"asset-3", "asset-1", "asset-2"}) {
+            CHECK(config.updateAlert(entry, PureAlert(ALERT_START, 1, "start", element, "WARNING", {}), toSend) == 0);
+        }
+        // resolved alert of a new element is stored too, alert of a known element is updated in place
+        CHECK(config.updateAlert(entry, PureAlert(ALERT_RESOLVED, 2, "ok", "asset-4", "OK", {}), toSend) == 0);
+        CHECK(config.updateAlert(entry, PureAlert(ALERT_RESOLVED, 2, "ok", "asset-1", "OK", {}), toSend) == 0);
+        CHECK(config.updateAlert(entry, PureAlert(ALERT_RESOLVED, 3, "ok", "asset-1", "OK", {}), toSend) == -1);
+        CHECK(config.updateAlert(entry, PureAlert(ALERT_START, 4, "again", "asset-1", "CRITICAL", {}), toSend) == 0);
+        CHECK(toSend._severity == "CRITICAL");
+
+        REQUIRE(entry.second.size() == 4);
+        std::vector<std::string> elements;
+        std::vector<std::string> expected = {"asset-3", "asset-1", "asset-2", "asset-4"};
+        for (const auto& alert : entry.second) {
+            elements.push_back(alert._element);
+        }
+        CHECK(elements == expected);
+        CHECK(entry.second.find("asset-1")->_timestamp == 4);
+    }
+}
+
+// run explicitly: ./fty-alert-engine-test "alert list benchmark"
+TEST_CASE("alert list benchmark", "[.]")
+{
+    AlertConfiguration::B entry;
+    std::ifstream         f("test/testrules/pattern.rule");
+    REQUIRE(readRule(f, entry.first) == 0);
+    AlertConfiguration config("");
+    PureAlert          toSend;
+
+    // warranty rule has an alert for every asset, every asset is evaluated in every round
+    const size_t             assets = 10000;
+    const size_t             rounds = 10;
+    std::vector<std::string> elements;
+    for (size_t i = 0; i < assets; ++i) {
+        elements.push_back("asset-" + std::to_string(i));
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        const char* status = (round % 2 == 0) ? ALERT_START : ALERT_RESOLVED;
+        for (const auto& element : elements) {
+            config.updateAlert(entry, PureAlert(status, round, "warranty", element, "WARNING", {}), toSend);
+        }
+    }
+    auto duration = std::chrono::steady_clock::now() - start;
+    CHECK(entry.second.size() == assets);
+    log_info("%zu assets: %.1f ns per update", assets,
+        double(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()) / double(assets * rounds));
+}
+
+TEST_CASE("rule handles test")
+{
+    const std::string dir = (std::filesystem::temp_directory_path() / "fty-alert-engine-handles").native();
+    std::filesystem::remove_all(dir);
+    AlertConfiguration config(dir);
+    config.readConfiguration();
+
+    std::set<std::string>        topics;
+    std::vector<PureAlert>       alertsToSend;
+    AlertConfiguration::iterator it;
+    {
+        std::ifstream f("test/testrules/check_update_threshold_simple.rule");
+        REQUIRE(config.addRule(f, topics, alertsToSend, it) == 0);
+    }
+    TopicId humidity = TopicTable::instance().find("average.humidity@DC-Roztoky");
+    REQUIRE(config.getRulesByTopic(humidity).size() == 1);
+    CHECK(config.getRulesByTopic(humidity)[0] == &*it);
+    CHECK(config.getRulesByTopic(humidity)[0]->first == "check_update_threshold_simple");
+    CHECK(config.getRulesByMetric("average.humidity@DC-Roztoky") ==
+          std::vector<std::string>{"check_update_threshold_simple"});
+    CHECK(config.getRulesByTopic(TopicTable::instance().intern("unknown@topic")).empty());
+
+    // updated rule has a new handle, the old one is not in the index anymore
+    uint64_t generation = config.getTopicsGeneration();
+    {
+        std::ifstream f("test/testrules/check_update_threshold_simple2.rule");
+        REQUIRE(config.updateRule(f, "check_update_threshold_simple", topics, alertsToSend, it) == 0);
+    }
+    CHECK(config.getTopicsGeneration() != generation);
+    REQUIRE(config.getRulesByTopic(humidity).size() == 1);
+    CHECK(config.getRulesByTopic(humidity)[0] == &*it);
+    CHECK(config.getRulesByTopic(humidity)[0]->second.first->getGlobalVariables()["high_critical"] == 90);
+
+    std::map<std::string, std::vector<PureAlert>> deleted;
+    CHECK(config.deleteRule("check_update_threshold_simple", deleted) == 0);
+    CHECK(config.getRulesByTopic(humidity).empty());
+    CHECK(config.size() == 0);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("element index test")
+{
+    const std::string dir = (std::filesystem::temp_directory_path() / "fty-alert-engine-elements").native();
+    std::filesystem::remove_all(dir);
+    AlertConfiguration config(dir);
+    config.readConfiguration();
+
+    // rules of two elements consuming the same topic
+    std::set<std::string>        topics;
+    std::vector<PureAlert>       alertsToSend;
+    AlertConfiguration::iterator it;
+    for (const char* name : {"a", "b", "c", "d"}) {
+        std::string        element = (std::string(name) == "b") ? "ups-2" : "ups-1";
+        std::istringstream f(std::string("{\"threshold\": {\"rule_name\": \"") + name + "@" + element +
+                             "\", \"target\": \"load.default@shared\", \"element\": \"" + element +
+                             "\", \"values\": [{\"high_warning\": \"80\"}], \"results\": [{\"high_warning\": "
+                             "{\"action\": [], \"severity\": \"WARNING\", \"description\": \"high\"}}]}}");
+        REQUIRE(config.addRule(f, topics, alertsToSend, it) == 0);
+    }
+    TopicId shared = TopicTable::instance().find("load.default@shared");
+    CHECK(config.getRulesByTopic(shared).size() == 4);
+
+    std::map<std::string, std::vector<PureAlert>> deleted;
+    std::vector<std::string>                      rulesDeleted;
+    {
+        RuleNameMatcher matcher("a@ups-1");
+        CHECK(config.deleteRules(&matcher, deleted, rulesDeleted) == 0);
+        CHECK(rulesDeleted == std::vector<std::string>{"a@ups-1"});
+    }
+    // the last rule took the place of the deleted one
+    REQUIRE(config.getRulesByTopic(shared).size() == 3);
+    CHECK(config.getRulesByTopic(shared)[0]->first == "d@ups-1");
+
+    rulesDeleted.clear();
+    {
+        RuleElementMatcher matcher("ups-1");
+        CHECK(config.deleteRules(&matcher, deleted, rulesDeleted) == 0);
+    }
+    std::sort(rulesDeleted.begin(), rulesDeleted.end());
+    CHECK(rulesDeleted == std::vector<std::string>{"c@ups-1", "d@ups-1"});
+    REQUIRE(config.getRulesByTopic(shared).size() == 1);
+    CHECK(config.getRulesByTopic(shared)[0]->first == "b@ups-2");
+
+    // nothing left of the element
+    rulesDeleted.clear();
+    {
+        RuleElementMatcher matcher("ups-1");
+        CHECK(config.deleteRules(&matcher, deleted, rulesDeleted) == 0);
+    }
+    CHECK(rulesDeleted.empty());
+    CHECK(config.size() == 1);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("expired metric test")
+{
+    const std::string dir = (std::filesystem::temp_directory_path() / "fty-alert-engine-expired").native();
+    std::filesystem::remove_all(dir);
+    AlertConfiguration config(dir);
+    config.readConfiguration();
+
+    std::set<std::string>        topics;
+    std::vector<PureAlert>       alertsToSend;
+    AlertConfiguration::iterator simple, pattern;
+    {
+        std::ifstream f("test/testrules/simplethreshold.rule");
+        REQUIRE(config.addRule(f, topics, alertsToSend, simple) == 0);
+    }
+    {
+        std::ifstream f("test/testrules/pattern.rule");
+        REQUIRE(config.addRule(f, topics, alertsToSend, pattern) == 0);
+    }
+    PureAlert toSend;
+    REQUIRE(config.updateAlert(simple->second, PureAlert(ALERT_START, 10, "high", "fff", "WARNING", {}), toSend) == 0);
+    REQUIRE(
+        config.updateAlert(pattern->second, PureAlert(ALERT_START, 10, "soon", "ups-1", "WARNING", {}), toSend) == 0);
+    REQUIRE(
+        config.updateAlert(pattern->second, PureAlert(ALERT_START, 10, "soon", "ups-2", "WARNING", {}), toSend) == 0);
+
+    std::map<std::string, std::vector<PureAlert>> resolved;
+    // metric nobody consumes
+    config.resolveExpired(TopicTable::instance().intern("unknown@fff"), "fff", 20, resolved);
+    CHECK(resolved.empty());
+
+    // alert of the rule element is resolved
+    config.resolveExpired(TopicTable::instance().find("abc@fff"), "fff", 20, resolved);
+    REQUIRE(resolved["simplethreshold"].size() == 1);
+    CHECK(resolved["simplethreshold"][0]._status == ALERT_RESOLVED);
+    CHECK(resolved["simplethreshold"][0]._element == "fff");
+    CHECK(resolved["simplethreshold"][0]._timestamp == 20);
+    CHECK(resolved["simplethreshold"][0]._description == "Metric expired");
+    CHECK(simple->second.second.find("fff")->_status == ALERT_RESOLVED);
+
+    // already resolved alert is not sent again
+    resolved.clear();
+    config.resolveExpired(TopicTable::instance().find("abc@fff"), "fff", 30, resolved);
+    CHECK(resolved.empty());
+
+    // pattern rule resolves only the alert of the expired metric
+    config.resolveExpired(TopicTable::instance().find("^end_warranty_date@.+"), "ups-1", 30, resolved);
+    REQUIRE(resolved["warranty2"].size() == 1);
+    CHECK(resolved["warranty2"][0]._element == "ups-1");
+    CHECK(pattern->second.second.find("ups-1")->_status == ALERT_RESOLVED);
+    CHECK(pattern->second.second.find("ups-2")->_status == ALERT_START);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("debounced transition test")
+{
+    const std::string dir = (std::filesystem::temp_directory_path() / "fty-alert-engine-debounced").native();
+    std::filesystem::remove_all(dir);
+    AlertConfiguration config(dir);
+    config.readConfiguration();
+
+    std::set<std::string>        topics;
+    std::vector<PureAlert>       alertsToSend;
+    AlertConfiguration::iterator it;
+    {
+        std::istringstream f(
+            "{\"threshold\": {\"rule_name\": \"debounced\", \"target\": \"load.default@ups-3\", \"element\": "
+            "\"ups-3\", \"values\": [{\"high_warning\": \"80\"}], \"results\": [{\"high_warning\": {\"action\": [], "
+            "\"severity\": \"WARNING\", \"description\": \"high\"}}], \"debounce\": {\"count\": 2, \"time\": 10}}}");
+        REQUIRE(config.addRule(f, topics, alertsToSend, it) == 0);
+    }
+    auto& entry = it->second;
+
+    // metric evaluated only when it changes (change-only processing)
+    MetricList list;
+    auto       evaluate = [&](double value, uint64_t timestamp) {
+        MetricInfo metric("ups-3", "load.default", "%", value, timestamp, "", 60);
+        list.addMetric(metric);
+        PureAlert pureAlert, toSend;
+        CHECK(entry.first->evaluate(list, metric.getTopicId(), pureAlert) == 0);
+        pureAlert._ttl = 180;
+        return config.updateAlert(entry, pureAlert, toSend) == 0;
+    };
+    CHECK(evaluate(50, 100));
+    CHECK_FALSE(evaluate(85, 101));
+    CHECK_FALSE(evaluate(86, 102));
+
+    // the metric doesn't change anymore, the transition is committed by the clock
+    std::map<std::string, std::vector<PureAlert>> committed;
+    config.commitDebounced(105, committed);
+    CHECK(committed.empty());
+    config.commitDebounced(112, committed);
+    REQUIRE(committed["debounced"].size() == 1);
+    CHECK(committed["debounced"][0]._status == ALERT_START);
+    CHECK(committed["debounced"][0]._severity == "WARNING");
+    CHECK(committed["debounced"][0]._timestamp == 112);
+    CHECK(committed["debounced"][0]._ttl == 180);
+    CHECK(entry.second.find("ups-3")->_status == ALERT_START);
+    committed.clear();
+    config.commitDebounced(120, committed);
+    CHECK(committed.empty());
+
+    // touched rule drops the pending resolution with its alerts
+    CHECK_FALSE(evaluate(50, 130));
+    CHECK_FALSE(evaluate(40, 131));
+    alertsToSend.clear();
+    REQUIRE(config.touchRule("debounced", alertsToSend) == 0);
+    CHECK(alertsToSend.size() == 1);
+    config.commitDebounced(200, committed);
+    CHECK(committed.empty());
+    CHECK(entry.second.size() == 0);
+    std::filesystem::remove_all(dir);
 }
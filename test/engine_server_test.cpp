@@ -2,10 +2,41 @@
 #include "src/fty_alert_engine_audit_log.h"
 #include "src/fty_alert_engine_server.h"
 #include "src/luarule.h"
+#include "src/metricreadset.h"
 #include <catch2/catch.hpp>
+#include <cinttypes>
+#include <cmath>
 #include <czmq.h>
 #include <fty_shm.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <filesystem>
+#include <new>
+#include <sstream>
+
+// number of calls of operator new in the test, see "metric decoding benchmark"
+static std::atomic<uint64_t> s_allocations{0};
+
+void* operator new(size_t size)
+{
+    s_allocations++;
+    void* pointer = malloc(size ? size : 1);
+    if (!pointer) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void operator delete(void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t /* size */) noexcept
+{
+    free(pointer);
+}
 
 static zmsg_t* s_poll_alert(mlm_client_t* consumer, const char* assetName, int timeout_ms = 5000)
 {
@@ -1442,3 +1473,227 @@ TEST_CASE("Alert engine server")
     // release audit context
     AlertsEngineAuditLogManager::deinit();
 }
+
+TEST_CASE("metric value test")
+{
+    double value = 0;
+
+    // the whole text in the form of strtod()
+    CHECK(metric_value("42", value) == 0);
+    CHECK(value == 42);
+    CHECK(metric_value(" \t-3.5", value) == 0);
+    CHECK(value == -3.5);
+    CHECK(metric_value("+4", value) == 0);
+    CHECK(value == 4);
+    CHECK(metric_value("1e3", value) == 0);
+    CHECK(value == 1000);
+    CHECK(metric_value(".5", value) == 0);
+    CHECK(value == 0.5);
+    CHECK(metric_value("0x1A", value) == 0);
+    CHECK(value == 26);
+    CHECK(metric_value("-0x1p-2", value) == 0);
+    CHECK(value == -0.25);
+    CHECK(metric_value("-inf", value) == 0);
+    CHECK(std::isinf(value));
+    CHECK(metric_value("nan", value) == 0);
+    CHECK(std::isnan(value));
+
+    // not a number
+    for (const char* text : {"", " ", "+", "+-4", "-+4", "0x", "0x-1", "12abc", "12 ", "1,5", "abc"}) {
+        INFO(text);
+        CHECK(metric_value(text, value) == -1);
+    }
+
+    // out of range
+    CHECK(metric_value("1e999", value) == -2);
+    CHECK(metric_value("1e-400", value) == -2);
+}
+
+// Makes a METRICS message
+static fty_proto_t* s_metric(const char* type, const char* name, const char* value, uint64_t timestamp)
+{
+    fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_type(metric, "%s", type);
+    fty_proto_set_name(metric, "%s", name);
+    fty_proto_set_value(metric, "%s", value);
+    fty_proto_set_unit(metric, "%s", "%");
+    fty_proto_set_ttl(metric, 300);
+    fty_proto_aux_insert(metric, "time", "%" PRIu64, timestamp);
+    return metric;
+}
+
+TEST_CASE("metric processing test")
+{
+    setenv("BIOS_LOG_PATTERN", "%D %c [%t] -%-5p- %M (%l) %m%n", 1);
+    ManageFtyLog::setInstanceFtylog("fty-alert-engine-processing");
+
+    static const char* endpoint = "inproc://fty-ag-processing-test";
+    zactor_t*          server   = zactor_new(mlm_server, static_cast<void*>(const_cast<char*>("Malamute")));
+    zstr_sendx(server, "BIND", endpoint, NULL);
+    mlm_client_t* client = mlm_client_new();
+    REQUIRE(mlm_client_connect(client, endpoint, 1000, "processing") == 0);
+    REQUIRE(mlm_client_set_producer(client, FTY_PROTO_STREAM_ALERTS_SYS) == 0);
+
+    const std::string dir = (std::filesystem::temp_directory_path() / "fty-alert-engine-processing").native();
+    std::filesystem::remove_all(dir);
+    AlertConfiguration config(dir);
+    config.readConfiguration();
+
+    std::set<std::string>        topics;
+    std::vector<PureAlert>       alertsToSend;
+    AlertConfiguration::iterator threshold, lua;
+    {
+        std::istringstream f(
+            "{\"threshold\": {\"rule_name\": \"load@ups-4\", \"target\": \"load.default@ups-4\", "
+            "\"element\": \"ups-4\", \"values\": [{\"high_warning\": \"80\"}], \"results\": [{\"high_warning\": "
+            "{\"action\": [], \"severity\": \"WARNING\", \"description\": \"high\"}}]}}");
+        REQUIRE(config.addRule(f, topics, alertsToSend, threshold) == 0);
+    }
+    {
+        std::istringstream f(
+            "{\"single\": {\"rule_name\": \"sum@ups-5\", \"target\": [\"a.load@ups-5\", \"b.load@ups-5\"], "
+            "\"element\": \"ups-5\", \"values\": [{\"limit\": \"100\"}], \"results\": [{\"high_critical\": "
+            "{\"action\": [], \"severity\": \"CRITICAL\", \"description\": \"high\"}}], \"evaluation\": "
+            "\"function main(a, b) local sum = a + b if sum > limit then return HIGH_CRITICAL end return OK end\"}}");
+        REQUIRE(config.addRule(f, topics, alertsToSend, lua) == 0);
+    }
+    LuaRule* luaRule = dynamic_cast<LuaRule*>(lua->second.first.get());
+    REQUIRE(luaRule);
+
+    clearEvaluateMetrics();
+    MetricList       cache;
+    MetricProcessing processing;
+    processing.changeOnly = true;
+    processing.generation = config.getEvaluationGeneration();
+    uint64_t now          = static_cast<uint64_t>(::time(NULL));
+
+    SECTION("change only")
+    {
+        auto process = [&](const char* value, uint64_t timestamp) {
+            fty::shm::shmMetrics result;
+            result.add(s_metric("load.default", "ups-4", value, timestamp));
+            metric_processing(result, cache, client, processing, config);
+        };
+        process("85", now);
+        CHECK(processing.processed == 1);
+        REQUIRE(threshold->second.second.find("ups-4"));
+        CHECK(threshold->second.second.find("ups-4")->_status == ALERT_START);
+
+        // the same sample is not evaluated again, a new one is
+        process("85", now);
+        CHECK(processing.skipped == 1);
+        CHECK(processing.processed == 1);
+        process("50", now + 1);
+        CHECK(processing.processed == 2);
+        CHECK(threshold->second.second.find("ups-4")->_status == ALERT_RESOLVED);
+        process("50", now + 1);
+        CHECK(processing.skipped == 2);
+
+        // touched rule lost its alerts, the known sample is evaluated again in the new generation
+        REQUIRE(config.touchRule("load@ups-4", alertsToSend) == 0);
+        CHECK(config.getEvaluationGeneration() != processing.generation);
+        processing.generation = config.getEvaluationGeneration();
+        process("50", now + 1);
+        CHECK(processing.skipped == 2);
+        CHECK(processing.processed == 3);
+        REQUIRE(threshold->second.second.find("ups-4"));
+        CHECK(threshold->second.second.find("ups-4")->_status == ALERT_RESOLVED);
+    }
+
+    SECTION("rule with several inputs")
+    {
+        auto process = [&](const char* a, const char* b, uint64_t timestamp) {
+            fty::shm::shmMetrics result;
+            result.add(s_metric("a.load", "ups-5", a, timestamp));
+            result.add(s_metric("b.load", "ups-5", b, timestamp));
+            metric_processing(result, cache, client, processing, config);
+        };
+        process("60", "70", now);
+        CHECK(luaRule->usage()._evaluations == 1);
+        REQUIRE(lua->second.second.find("ups-5"));
+        CHECK(lua->second.second.find("ups-5")->_severity == "CRITICAL");
+
+        // both inputs changed in one batch, the rule is evaluated once with both of them
+        process("10", "20", now + 1);
+        CHECK(processing.processed == 4);
+        CHECK(luaRule->usage()._evaluations == 2);
+        CHECK(lua->second.second.find("ups-5")->_status == ALERT_RESOLVED);
+    }
+
+    SECTION("stream coalescing")
+    {
+        MetricReadSet readSet;
+        readSet.update({"load.default@ups-4"}, {});
+
+        std::unordered_map<TopicId, fty_proto_t*> messages;
+        CHECK(coalesce_metric(messages, s_metric("load.default", "ups-4", "85", now), &readSet));
+        CHECK(coalesce_metric(messages, s_metric("load.default", "ups-4", "50", now + 1), &readSet));
+        // no rule needs the metric
+        CHECK_FALSE(coalesce_metric(messages, s_metric("realpower.default", "ups-4", "400", now), &readSet));
+        CHECK_FALSE(coalesce_metric(messages, s_metric("coalescing.dropped", "ups-4", "1", now), &readSet));
+        // and its topic is not interned
+        CHECK(TopicTable::instance().find("coalescing.dropped@ups-4") == TOPIC_NONE);
+        REQUIRE(messages.size() == 1);
+        // only the newest sample of the topic is processed
+        CHECK(streq(fty_proto_value(messages.begin()->second), "50"));
+        // every metric is accepted without the read set
+        CHECK(coalesce_metric(messages, s_metric("realpower.default", "ups-4", "400", now), NULL));
+        CHECK(messages.size() == 2);
+
+        fty::shm::shmMetrics result;
+        for (auto& message : messages) {
+            result.add(message.second);
+        }
+        messages.clear();
+        metric_processing(result, cache, client, processing, config);
+        CHECK(processing.processed == 2);
+        CHECK(cache.find(TopicTable::instance().find("load.default@ups-4")) == 50);
+        REQUIRE(threshold->second.second.find("ups-4"));
+        CHECK(threshold->second.second.find("ups-4")->_status == ALERT_RESOLVED);
+
+        // metric, whose value is not a number, is neither stored nor interned
+        fty::shm::shmMetrics invalid;
+        invalid.add(s_metric("processing.invalid", "ups-4", "abc", now));
+        metric_processing(invalid, cache, client, processing, config);
+        CHECK(processing.processed == 2);
+        CHECK(TopicTable::instance().find("processing.invalid@ups-4") == TOPIC_NONE);
+    }
+
+    std::filesystem::remove_all(dir);
+    mlm_client_destroy(&client);
+    zactor_destroy(&server);
+}
+
+// run explicitly: ./fty-alert-engine-test "metric decoding benchmark"
+TEST_CASE("metric decoding benchmark", "[.]")
+{
+    // no rule consumes the metrics, so only decoding and storing them is measured
+    AlertConfiguration config("");
+    clearEvaluateMetrics();
+    MetricList           cache;
+    MetricProcessing     processing;
+    fty::shm::shmMetrics result;
+    const size_t         metrics = 10000;
+    const size_t         rounds  = 100;
+    uint64_t             now     = static_cast<uint64_t>(::time(NULL));
+    for (size_t i = 0; i < metrics; ++i) {
+        std::string name = "ups-" + std::to_string(i);
+        result.add(s_metric("load.default", name.c_str(), std::to_string(i % 100).c_str(), now));
+    }
+
+    // the first round interns the topics and creates the slots, then metrics are updated in place
+    metric_processing(result, cache, NULL, processing, config);
+    uint64_t allocations = s_allocations;
+    auto     start       = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        metric_processing(result, cache, NULL, processing, config);
+    }
+    auto duration = std::chrono::steady_clock::now() - start;
+    allocations   = s_allocations - allocations;
+    CHECK(processing.processed == metrics * (rounds + 1));
+    // only buffers of the round are allocated, nothing per metric
+    CHECK(allocations / rounds < metrics / 100);
+    log_info("%zu metrics: %.1f ns and %.4f allocations per metric (%" PRIu64 " allocations per round)", metrics,
+        double(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()) / double(metrics * rounds),
+        double(allocations) / double(metrics * rounds), allocations / rounds);
+}
@@ -0,0 +1,125 @@
+#include <catch2/catch.hpp>
+#include <fty_log.h>
+#include "src/alertconfiguration.h"
+#include "src/expression.h"
+#include "src/luarule.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+static RulePtr s_readRule(const std::string& file)
+{
+    RulePtr       rule;
+    std::ifstream f(file);
+    readRule(f, rule);
+    return rule;
+}
+
+// Values of 3 phases around the thresholds of phase_imbalance rules
+static std::vector<std::vector<double>> s_phases(void)
+{
+    std::vector<std::vector<double>> phases;
+    for (double l1 : {0.0, 50.0, 100.0, 120.0}) {
+        for (double l2 : {0.0, 80.0, 100.0, 111.0}) {
+            for (double l3 : {0.0, 90.0, 100.0, 150.0}) {
+                phases.push_back({l1, l2, l3});
+            }
+        }
+    }
+    return phases;
+}
+
+TEST_CASE("expression test")
+{
+    setenv("BIOS_LOG_PATTERN", "%D %c [%t] -%-5p- %M (%l) %m%n", 1);
+    ManageFtyLog::setInstanceFtylog("fty-alert-expression");
+
+    SECTION("evaluation")
+    {
+        Expression expression;
+        expression.compile("1 + 2 * 3 - -4 / 2", 0);
+        CHECK(expression.isValid());
+        CHECK(expression.evaluate({}) == 9);
+
+        expression.compile("x = v1 * 2; (x > limit or v2 == 0) and not v3 ~= 1 ? x : min(v1, v2, v3)", 3);
+        CHECK(!expression.isValid());
+        CHECK(!expression.bind({{"other", 1}}));
+        REQUIRE(expression.bind({{"limit", 10}}));
+        CHECK(expression.evaluate({6, 5, 1}) == 12);
+        CHECK(expression.evaluate({4, 5, 1}) == 1);
+        CHECK(expression.evaluate({6, 5, 2}) == 2);
+        CHECK(expression.evaluate({4, 0, 1}) == 8);
+
+        expression.compile("avg(v1, v2) + max(v1, 3) + abs(-2)", 2);
+        CHECK(expression.evaluate({1, 3}) == 7);
+
+        expression.compile("v1 > 1 ? HIGH_CRITICAL : OK", 1);
+        CHECK(std::string(Rule::resultToString(static_cast<int>(expression.evaluate({2})))) == "high_critical");
+        CHECK(std::string(Rule::resultToString(static_cast<int>(expression.evaluate({0})))) == "ok");
+    }
+
+    SECTION("errors")
+    {
+        Expression expression;
+        CHECK_THROWS_AS(expression.compile("", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("v1 +", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("v2", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("v1 > 1 ? 2", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("sqrt(v1)", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("abs(v1, 1)", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("max()", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("v1 $ 2", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("(v1", 1), std::runtime_error);
+        CHECK_THROWS_AS(expression.compile("v1 v1", 1), std::runtime_error);
+    }
+
+    SECTION("rule")
+    {
+        RulePtr expression = s_readRule("test/testrules/phase_imbalance_expression.rule");
+        RulePtr lua        = s_readRule("src/rule_templates/phase_imbalance@__rack__.rule");
+        LuaRule* expressionRule = dynamic_cast<LuaRule*>(expression.get());
+        LuaRule* luaRule        = dynamic_cast<LuaRule*>(lua.get());
+        REQUIRE(expressionRule);
+        REQUIRE(luaRule);
+        CHECK(expressionRule->code() == "");
+        for (const auto& values : s_phases()) {
+            CHECK(expressionRule->luaEvaluate(values) == luaRule->luaEvaluate(values));
+        }
+
+        // unknown variable
+        std::string json = "{\"single\": {\"rule_name\": \"bad_expression\", \"target\": [\"a@b\"], "
+                           "\"element\": \"b\", \"values\": [], \"results\": [], "
+                           "\"expression\": \"v1 > unknown ? HIGH_CRITICAL : OK\"}}";
+        std::istringstream f(json);
+        RulePtr            rule;
+        CHECK(readRule(f, rule) == 2);
+    }
+}
+
+// run explicitly: ./fty-alert-engine-test "expression benchmark"
+TEST_CASE("expression benchmark", "[.]")
+{
+    RulePtr  expression     = s_readRule("test/testrules/phase_imbalance_expression.rule");
+    RulePtr  lua            = s_readRule("src/rule_templates/phase_imbalance@__rack__.rule");
+    LuaRule* expressionRule = dynamic_cast<LuaRule*>(expression.get());
+    LuaRule* luaRule        = dynamic_cast<LuaRule*>(lua.get());
+    REQUIRE(expressionRule);
+    REQUIRE(luaRule);
+
+    const size_t                     rounds = 10000;
+    std::vector<std::vector<double>> phases = s_phases();
+    for (LuaRule* rule : {luaRule, expressionRule}) {
+        double sum   = 0;
+        auto   start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            for (const auto& values : phases) {
+                sum += rule->luaEvaluate(values);
+            }
+        }
+        auto duration = std::chrono::steady_clock::now() - start;
+        log_info("%s: %.1f ns per evaluation (checksum %g)", rule == luaRule ? "lua" : "expression",
+            double(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()) /
+                double(rounds * phases.size()),
+            sum);
+    }
+}
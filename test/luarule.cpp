@@ -0,0 +1,403 @@
+#include <catch2/catch.hpp>
+#include <fty_log.h>
+#include "src/alertconfiguration.h"
+#include "src/luarule.h"
+#include "src/metriclist.h"
+#include "src/thresholdchain.h"
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <unistd.h>
+
+// Values around every threshold of the rule
+static std::vector<double> s_grid(const std::map<std::string, double>& vars)
+{
+    std::vector<double> grid = {-1000, 0, 1000, NAN};
+    for (const auto& var : vars) {
+        grid.push_back(var.second - 1);
+        grid.push_back(var.second);
+        grid.push_back(var.second + 1);
+    }
+    return grid;
+}
+
+// Single rule with the code and one input per argument of main()
+static RulePtr s_luaRule(const std::string& name, size_t inputs, const std::string& code)
+{
+    std::string targets;
+    for (size_t i = 0; i < inputs; ++i) {
+        targets += std::string(i ? ", " : "") + "\"v" + std::to_string(i) + "@" + name + "\"";
+    }
+    std::istringstream f("{\"single\": {\"rule_name\": \"" + name + "\", \"target\": [" + targets +
+                         "], \"element\": \"" + name + "\", \"values\": [{\"high_warning\": \"10\"}, "
+                         "{\"high_critical\": \"20\"}], \"results\": [], \"evaluation\": \"" + code + "\"}}");
+    RulePtr rule;
+    readRule(f, rule);
+    return rule;
+}
+
+// Phase imbalance computed by Lua, as in the templates before the module fty
+static const char* s_luaImbalance =
+    "function main(f1, f2, f3) local avg = (f1 + f2 + f3) / 3; local deviation = math.max (math.abs (f1 - avg), "
+    "math.abs (f2 - avg), math.abs (f3 - avg)); local percentage = deviation / avg * 100; if (percentage > "
+    "high_critical) then return HIGH_CRITICAL end; if (percentage > high_warning) then return HIGH_WARNING end; "
+    "return OK; end";
+
+TEST_CASE("luarule test")
+{
+    setenv("BIOS_LOG_PATTERN", "%D %c [%t] -%-5p- %M (%l) %m%n", 1);
+    ManageFtyLog::setInstanceFtylog("fty-alert-luarule");
+
+    SECTION("threshold chain")
+    {
+        ThresholdChain chain;
+        CHECK(chain.parse("function main(v1, v2) if v1 >= 25 and (v2 <= 10) or v1 == v2 then return HIGH_WARNING; end; "
+                          "if ((v1 ~= x)) then return LOW_WARNING end return OK end"));
+        CHECK(chain.inputs() == 2);
+        CHECK(!chain.isValid());
+        CHECK(!chain.bind({{"y", 1}}));
+        REQUIRE(chain.bind({{"x", 1}}));
+        CHECK(std::string(Rule::resultToString(chain.evaluate({30, 5}))) == "high_warning");
+        CHECK(std::string(Rule::resultToString(chain.evaluate({7, 7}))) == "high_warning");
+        CHECK(std::string(Rule::resultToString(chain.evaluate({7, 8}))) == "low_warning");
+        CHECK(std::string(Rule::resultToString(chain.evaluate({1, 8}))) == "ok");
+
+        // anything else is left to Lua
+        CHECK(!chain.parse("function main(v1) local x = v1; if x > 10 then return HIGH_CRITICAL end return OK end"));
+        CHECK(!chain.parse("function main(v1, v2) if (v1 > 10 or v2 > 10) and v1 > 0 then return OK end return OK"
+                           " end"));
+        CHECK(!chain.parse("function main(v1) if (v1 > -10) then return HIGH_CRITICAL end return OK end"));
+        CHECK(!chain.parse("function main(s) if s == 'good' then return OK end return WARNING end"));
+        CHECK(!chain.parse("function main(v1) if (v1 > 10) then return HIGH_CRITICAL end return OK end x = 1"));
+    }
+
+    SECTION("instruction budget")
+    {
+        int budget = LuaVm::instructionBudget();
+        LuaVm::instructionBudget(100000);
+        std::string json = "{\"single\": {\"rule_name\": \"endless\", \"target\": [\"a@b\"], \"element\": \"b\", "
+                           "\"values\": [], \"results\": [], \"evaluation\": \"function main(v1) if v1 > 0 then "
+                           "while true do end end return OK end\"}}";
+        std::istringstream f(json);
+        RulePtr            rule;
+        REQUIRE(readRule(f, rule) == 0);
+        LuaRule* lua = dynamic_cast<LuaRule*>(rule.get());
+        REQUIRE(lua);
+
+        // overruns in a row quarantine the rule
+        CHECK_THROWS_AS(lua->luaEvaluate({1}), std::runtime_error);
+        CHECK(lua->luaEvaluate({0}) == RULE_RESULT_OK);
+        for (unsigned i = 0; i < LuaRule::quarantineAfter(); ++i) {
+            CHECK(!lua->usage()._quarantined);
+            CHECK_THROWS_AS(lua->luaEvaluate({1}), std::runtime_error);
+        }
+        CHECK(lua->usage()._quarantined);
+        CHECK(lua->usage()._evaluations == LuaRule::quarantineAfter() + 2);
+        CHECK(lua->usage()._overruns == LuaRule::quarantineAfter() + 1);
+        CHECK_THROWS_AS(lua->luaEvaluate({0}), std::runtime_error);
+
+        // endless code outside of main() is refused
+        std::istringstream f2("{\"single\": {\"rule_name\": \"endless\", \"target\": [\"a@b\"], \"element\": \"b\", "
+                              "\"values\": [], \"results\": [], \"evaluation\": \"while true do end\"}}");
+        CHECK(readRule(f2, rule) == 2);
+        LuaVm::instructionBudget(budget);
+    }
+
+    SECTION("memory limit")
+    {
+        size_t limit = LuaRule::memoryLimit();
+        LuaRule::memoryLimit(64 * 1024);
+        std::string json = "{\"single\": {\"rule_name\": \"greedy\", \"target\": [\"a@b\"], \"element\": \"b\", "
+                           "\"values\": [], \"results\": [], \"evaluation\": \"kept = {} function main(v1) "
+                           "for i = 1, v1 do kept[i] = tostring(i) end return OK end\"}}";
+        std::istringstream f(json);
+        RulePtr            rule;
+        REQUIRE(readRule(f, rule) == 0);
+        LuaRule* lua = dynamic_cast<LuaRule*>(rule.get());
+        REQUIRE(lua);
+
+        CHECK(lua->luaEvaluate({10}) == RULE_RESULT_OK);
+        size_t used = lua->memory();
+        CHECK(used > 0);
+        CHECK(used < 64 * 1024);
+        CHECK_THROWS_AS(lua->luaEvaluate({100000}), std::runtime_error);
+        CHECK(lua->usage()._memoryErrors == 1);
+        CHECK(lua->memory() <= 64 * 1024);
+        CHECK(lua->luaEvaluate({10}) == RULE_RESULT_OK);
+        LuaRule::memoryLimit(limit);
+    }
+
+    SECTION("batch")
+    {
+        bool shared = LuaRule::sharedVm();
+        int  budget = LuaVm::instructionBudget();
+        LuaRule::sharedVm(true);
+        LuaVm::instructionBudget(100000);
+        std::vector<RulePtr> rules;
+        for (const char* limit : {"10", "20", "30"}) {
+            std::string json = std::string("{\"single\": {\"rule_name\": \"batch") + limit +
+                               "\", \"target\": [\"x@" + limit + "\"], \"element\": \"" + limit +
+                               "\", \"values\": [{\"limit\": \"" + limit + "\"}], \"results\": [{\"high_critical\": "
+                               "{\"action\": [], \"severity\": \"CRITICAL\", \"description\": \"high\"}}], "
+                               "\"evaluation\": \"function main(v1) local x = v1 * 2; if x > limit then "
+                               "return HIGH_CRITICAL end if x < 0 then while true do end end return OK end\"}}";
+            std::istringstream f(json);
+            rules.emplace_back();
+            REQUIRE(readRule(f, rules.back()) == 0);
+        }
+        MetricList metrics;
+        metrics.addMetric(MetricInfo("10", "x", "", 6, uint64_t(::time(NULL)), "", 300));
+        metrics.addMetric(MetricInfo("20", "x", "", 6, uint64_t(::time(NULL)), "", 300));
+        metrics.addMetric(MetricInfo("30", "x", "", -1, uint64_t(::time(NULL)), "", 300));
+
+        std::vector<LuaRule*> luaRules;
+        for (const auto& rule : rules) {
+            luaRules.push_back(dynamic_cast<LuaRule*>(rule.get()));
+            REQUIRE(luaRules.back());
+        }
+        std::vector<PureAlert> alerts;
+        std::vector<int>       results;
+        LuaRule::evaluateBatch(luaRules, metrics, alerts, results);
+        REQUIRE(results.size() == 3);
+        CHECK(results[0] == 0);
+        CHECK(alerts[0]._severity == "CRITICAL");
+        CHECK(results[1] == 0);
+        CHECK(alerts[1]._severity == "OK");
+        // endless loop fails only its own rule
+        CHECK(results[2] == -1);
+        CHECK(luaRules[2]->usage()._overruns == 1);
+        CHECK(luaRules[0]->usage()._evaluations == 1);
+        LuaVm::instructionBudget(budget);
+        LuaRule::sharedVm(shared);
+    }
+
+    SECTION("fty library")
+    {
+        RulePtr  luaRule = s_luaRule("lua", 4,
+            "function main(a, b, c, x) local avg = (a + b + c) / 3; local dev = math.max(math.abs(a - avg), "
+            "math.abs(b - avg), math.abs(c - avg)); return avg + 3 * (dev + 5 * (dev / avg * 100 + 7 * "
+            "math.min(math.max(x, b), c))) end");
+        RulePtr  ftyRule = s_luaRule("fty", 4,
+            "function main(a, b, c, x) return fty.avg(a, b, c) + 3 * (fty.maxdev(a, b, c) + 5 * "
+            "(fty.imbalance(a, b, c) + 7 * fty.clamp(x, b, c))) end");
+        LuaRule* lua     = dynamic_cast<LuaRule*>(luaRule.get());
+        LuaRule* fty     = dynamic_cast<LuaRule*>(ftyRule.get());
+        REQUIRE(lua);
+        REQUIRE(fty);
+        std::vector<double> grid = {-1000, -1, -0.0, 0, 0.1, 1, 3, 1e300, INFINITY, NAN};
+        size_t              mismatches = 0;
+        for (double a : grid) {
+            for (double b : grid) {
+                for (double c : grid) {
+                    for (double x : {-5.0, 2.0, double(NAN)}) {
+                        double l = lua->luaEvaluate({a, b, c, x});
+                        double f = fty->luaEvaluate({a, b, c, x});
+                        if (!(l == f || (std::isnan(l) && std::isnan(f)))) {
+                            mismatches++;
+                        }
+                    }
+                }
+            }
+        }
+        CHECK(mismatches == 0);
+
+        // arguments are checked like by math.max()
+        RulePtr  bad     = s_luaRule("bad", 1, "function main(v1) return fty.avg() end");
+        LuaRule* badRule = dynamic_cast<LuaRule*>(bad.get());
+        REQUIRE(badRule);
+        CHECK_THROWS_AS(badRule->luaEvaluate({1}), std::runtime_error);
+    }
+
+    SECTION("templates")
+    {
+        size_t native = 0;
+        for (const auto& entry : std::filesystem::directory_iterator("src/rule_templates")) {
+            if (entry.path().extension() != ".rule") {
+                continue;
+            }
+            RulePtr       rule;
+            std::ifstream f(entry.path());
+            if (readRule(f, rule) != 0) {
+                continue;
+            }
+            LuaRule* lua = dynamic_cast<LuaRule*>(rule.get());
+            if (!lua) {
+                continue;
+            }
+            std::string name = entry.path().filename().string();
+            if (name.find("load.input_3phase") == 0 || name.find("voltage.input_3phase") == 0) {
+                CHECK(lua->nativeEvaluator());
+            }
+            if (name.find("phase_imbalance") == 0) {
+                CHECK(!lua->nativeEvaluator());
+                // same as the code computing it in Lua
+                RulePtr  plain      = s_luaRule("plain", 3, s_luaImbalance);
+                LuaRule* plainRule  = dynamic_cast<LuaRule*>(plain.get());
+                size_t   mismatches = 0;
+                REQUIRE(plainRule);
+                for (double l1 : {0.0, 50.0, 100.0, 120.0}) {
+                    for (double l2 : {0.0, 80.0, 100.0, 111.0}) {
+                        for (double l3 : {0.0, 90.0, 100.0, 150.0}) {
+                            if (lua->luaEvaluate({l1, l2, l3}) != plainRule->luaEvaluate({l1, l2, l3})) {
+                                mismatches++;
+                            }
+                        }
+                    }
+                }
+                INFO(name);
+                CHECK(mismatches == 0);
+            }
+            if (!lua->nativeEvaluator()) {
+                continue;
+            }
+            native++;
+
+            // every combination of values gives the same result as Lua
+            std::vector<double> grid   = s_grid(lua->getGlobalVariables());
+            size_t              inputs = lua->getNeededTopics().size();
+            size_t              count  = 1;
+            for (size_t i = 0; i < inputs; ++i) {
+                count *= grid.size();
+            }
+            size_t mismatches = 0;
+            for (size_t combination = 0; combination < count; ++combination) {
+                std::vector<double> values;
+                for (size_t i = 0, rest = combination; i < inputs; ++i, rest /= grid.size()) {
+                    values.push_back(grid[rest % grid.size()]);
+                }
+                if (lua->luaEvaluate(values) != lua->callMain(values)) {
+                    mismatches++;
+                }
+            }
+            INFO(name);
+            CHECK(mismatches == 0);
+        }
+        CHECK(native >= 3);
+    }
+
+    SECTION("compiled templates")
+    {
+        REQUIRE(!TemplateEvaluator::templates().empty());
+        std::mt19937 random(20201016);
+        size_t       compiled = 0;
+        for (const auto& entry : std::filesystem::directory_iterator("src/rule_templates")) {
+            if (entry.path().extension() != ".rule") {
+                continue;
+            }
+            RulePtr       rule;
+            std::ifstream f(entry.path());
+            if (readRule(f, rule) != 0) {
+                continue;
+            }
+            LuaRule* lua = dynamic_cast<LuaRule*>(rule.get());
+            if (!lua || !lua->compiledTemplate()) {
+                continue;
+            }
+            compiled++;
+            std::string name = entry.path().filename().string();
+            INFO(name);
+
+            // random values around the thresholds, status bits, negative and missing values
+            std::vector<double> grid       = s_grid(lua->getGlobalVariables());
+            size_t              inputs     = lua->getNeededTopics().size();
+            size_t              mismatches = 0;
+            for (size_t round = 0; round < 10000; ++round) {
+                std::vector<double> values;
+                for (size_t i = 0; i < inputs; ++i) {
+                    switch (random() % 4) {
+                        case 0:
+                            values.push_back(grid[random() % grid.size()]);
+                            break;
+                        case 1:
+                            values.push_back(random() % 65536);
+                            break;
+                        case 2:
+                            values.push_back(std::uniform_real_distribution<double>(-1000, 1000)(random));
+                            break;
+                        default:
+                            values.push_back(-double(random() % 65536));
+                    }
+                }
+                double native = lua->luaEvaluate(values);
+                double plain  = lua->callMain(values);
+                if (!(native == plain || (std::isnan(native) && std::isnan(plain)))) {
+                    mismatches++;
+                }
+            }
+            CHECK(mismatches == 0);
+
+            // edited code is left to Lua
+            RulePtr  edited     = s_luaRule("edited", inputs, lua->code() + " ");
+            LuaRule* editedRule = dynamic_cast<LuaRule*>(edited.get());
+            REQUIRE(editedRule);
+            CHECK(!editedRule->compiledTemplate());
+        }
+        // status bits of UPS and phase imbalance at least
+        CHECK(compiled >= 5);
+    }
+}
+
+// run explicitly: ./fty-alert-engine-test "fty library benchmark"
+TEST_CASE("fty library benchmark", "[.]")
+{
+    RulePtr       plain = s_luaRule("plain", 3, s_luaImbalance);
+    RulePtr       rack;
+    std::ifstream f("src/rule_templates/phase_imbalance@__rack__.rule");
+    readRule(f, rack);
+    LuaRule* luaRule = dynamic_cast<LuaRule*>(plain.get());
+    LuaRule* ftyRule = dynamic_cast<LuaRule*>(rack.get());
+    REQUIRE(luaRule);
+    REQUIRE(ftyRule);
+
+    const size_t rounds = 100000;
+    for (LuaRule* rule : {luaRule, ftyRule}) {
+        double sum   = 0;
+        auto   start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            sum += rule->luaEvaluate({100, 80 + double(i % 40), 120});
+        }
+        auto duration = std::chrono::steady_clock::now() - start;
+        log_info("%s: %.1f ns per evaluation (checksum %g)", rule == luaRule ? "lua" : "fty",
+            double(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()) / double(rounds), sum);
+    }
+}
+
+// Gets resident memory of the process [KiB]
+static long s_rss(void)
+{
+    long          size = 0, resident = 0;
+    std::ifstream f("/proc/self/statm");
+    f >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// run explicitly: ./fty-alert-engine-test "shared state benchmark"
+TEST_CASE("shared state benchmark", "[.]")
+{
+    bool         shared = LuaRule::sharedVm();
+    const size_t count  = 2000;
+    // shared mode first, memory freed by the private one would be reused by it
+    for (bool mode : {true, false}) {
+        LuaRule::sharedVm(mode);
+        long                 rss   = s_rss();
+        auto                 start = std::chrono::steady_clock::now();
+        std::vector<RulePtr> rules;
+        for (size_t i = 0; i < count; ++i) {
+            rules.push_back(s_luaRule("rule" + std::to_string(i), 3, s_luaImbalance));
+            REQUIRE(rules.back());
+        }
+        auto   loaded = std::chrono::steady_clock::now() - start;
+        double sum    = 0;
+        for (const auto& rule : rules) {
+            sum += dynamic_cast<LuaRule*>(rule.get())->luaEvaluate({100, 90, 110});
+        }
+        log_info("%s: %zu rules loaded in %.1f ms, %ld KiB after the first evaluation (checksum %g)",
+            mode ? "shared" : "private", count,
+            double(std::chrono::duration_cast<std::chrono::microseconds>(loaded).count()) / 1000, s_rss() - rss,
+            sum);
+    }
+    LuaRule::sharedVm(shared);
+}
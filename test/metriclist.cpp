@@ -0,0 +1,353 @@
+#include "src/metriclist.h"
+#include "src/topictable.h"
+#include <algorithm>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <fty_log.h>
+#include <malloc.h>
+#include <map>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+TEST_CASE("metriclist test")
+{
+    MetricList list;
+    uint64_t   now = static_cast<uint64_t>(::time(NULL));
+
+    SECTION("unknown topic")
+    {
+        CHECK(std::isnan(list.find("metriclist.unknown@asset-1")));
+        CHECK(std::isnan(list.findAndCheck("metriclist.unknown@asset-1")));
+        CHECK(list.getMetricInfo("metriclist.unknown@asset-1").isUnknown());
+        CHECK(list.size() == 0);
+    }
+
+    SECTION("add and update")
+    {
+        MetricInfo m("asset-1", "metriclist.load", "%", 42.0, now, "", 300);
+        list.addMetric(m);
+        CHECK(list.size() == 1);
+        CHECK(list.find("metriclist.load@asset-1") == 42.0);
+        CHECK(list.find(m.getTopicId()) == 42.0);
+        CHECK(list.findAndCheck("metriclist.load@asset-1") == 42.0);
+        CHECK(list.getLastMetric().getValue() == 42.0);
+
+        list.addMetric(m.getTopicId(), "asset-1", "metriclist.load", "W", 43.0, now, 300);
+        CHECK(list.size() == 1);
+        CHECK(list.find("metriclist.load@asset-1") == 43.0);
+
+        MetricInfo info = list.getMetricInfo("metriclist.load@asset-1");
+        CHECK(!info.isUnknown());
+        CHECK(info.getElementName() == "asset-1");
+        CHECK(info.getSource() == "metriclist.load");
+        CHECK(info.getUnits() == "W");
+        CHECK(info.getValue() == 43.0);
+        CHECK(info.getTimestamp() == now);
+        CHECK(info.getTtl() == 300);
+        CHECK(info.getTopicId() == m.getTopicId());
+
+        // fields by the topic, without building the metric
+        CHECK(list.getTimestamp(m.getTopicId()) == now);
+        CHECK(list.getTtl(m.getTopicId()) == 300);
+        CHECK(list.getElementName(m.getTopicId()) == "asset-1");
+        CHECK(list.getSource(m.getTopicId()) == "metriclist.load");
+        TopicId unknown = TopicTable::instance().intern("metriclist.unknown@asset-1");
+        CHECK(list.getTimestamp(unknown) == 0);
+        CHECK(list.getTtl(unknown) == 0);
+        CHECK(list.getElementName(unknown).empty());
+        CHECK(list.getSource(unknown).empty());
+    }
+
+    SECTION("old metrics")
+    {
+        list.addMetric(MetricInfo("asset-1", "metriclist.old", "%", 1.0, now - 100, "", 10));
+        list.addMetric(MetricInfo("asset-2", "metriclist.fresh", "%", 2.0, now, "", 10));
+        list.addMetric(MetricInfo("asset-3", "metriclist.old", "%", 3.0, now - 100, "", 10));
+        CHECK(list.size() == 3);
+
+        // too old, but still in the list
+        CHECK(std::isnan(list.findAndCheck("metriclist.old@asset-1")));
+        CHECK(list.find("metriclist.old@asset-1") == 1.0);
+
+        list.removeOldMetrics();
+        CHECK(list.size() == 1);
+        CHECK(std::isnan(list.find("metriclist.old@asset-1")));
+        CHECK(std::isnan(list.find("metriclist.old@asset-3")));
+        CHECK(list.find("metriclist.fresh@asset-2") == 2.0);
+        CHECK(list.getMetricInfo("metriclist.fresh@asset-2").getElementName() == "asset-2");
+
+        // removed metric can be added again
+        list.addMetric(MetricInfo("asset-1", "metriclist.old", "%", 4.0, now, "", 10));
+        CHECK(list.size() == 2);
+        CHECK(list.findAndCheck("metriclist.old@asset-1") == 4.0);
+    }
+
+    SECTION("expiry events")
+    {
+        list.addMetric(MetricInfo("asset-1", "metriclist.expiry", "%", 1.0, now, "", 10));
+        list.addMetric(MetricInfo("asset-2", "metriclist.expiry", "%", 2.0, now, "", 20));
+        CHECK(list.findAndCheck(TopicTable::instance().find("metriclist.expiry@asset-1"), now + 10) == 1.0);
+        CHECK(std::isnan(list.findAndCheck(TopicTable::instance().find("metriclist.expiry@asset-1"), now + 11)));
+
+        std::vector<MetricInfo> expired;
+        list.removeOldMetrics(now + 10, expired);
+        CHECK(expired.empty());
+        CHECK(list.size() == 2);
+
+        list.removeOldMetrics(now + 11, expired);
+        REQUIRE(expired.size() == 1);
+        CHECK(expired[0].getElementName() == "asset-1");
+        CHECK(expired[0].getValue() == 1.0);
+        CHECK(list.size() == 1);
+
+        // updated metric doesn't expire with its old sample
+        list.addMetric(MetricInfo("asset-2", "metriclist.expiry", "%", 3.0, now + 15, "", 20));
+        expired.clear();
+        list.removeOldMetrics(now + 30, expired);
+        CHECK(expired.empty());
+        CHECK(list.find("metriclist.expiry@asset-2") == 3.0);
+
+        list.removeOldMetrics(now + 36, expired);
+        REQUIRE(expired.size() == 1);
+        CHECK(expired[0].getElementName() == "asset-2");
+        CHECK(list.size() == 0);
+    }
+
+    SECTION("known samples")
+    {
+        TopicId  topic       = TopicTable::instance().intern("metriclist.sample", "asset-1");
+        uint64_t fingerprint = MetricList::fingerprint(now, "42", 0);
+        CHECK(fingerprint != 0);
+        CHECK(fingerprint == MetricList::fingerprint(now, "42", 0));
+        CHECK(fingerprint != MetricList::fingerprint(now, "42.0", 0));
+        CHECK(fingerprint != MetricList::fingerprint(now + 1, "42", 0));
+        CHECK(fingerprint != MetricList::fingerprint(now, "42", 1));
+
+        CHECK(!list.isKnownSample(topic, fingerprint));
+        list.addMetric(topic, "asset-1", "metriclist.sample", "%", 42.0, now, 300, fingerprint);
+        CHECK(list.isKnownSample(topic, fingerprint));
+        CHECK(!list.isKnownSample(topic, MetricList::fingerprint(now + 1, "42", 0)));
+
+        // sample without fingerprint is never known
+        list.addMetric(topic, "asset-1", "metriclist.sample", "%", 42.0, now, 300);
+        CHECK(!list.isKnownSample(topic, fingerprint));
+    }
+
+    SECTION("history")
+    {
+        TopicId          topic = TopicTable::instance().intern("metriclist.history", "asset-1");
+        MetricAggregates aggregates;
+
+        // no arena, no history
+        list.trackHistory({{topic, 10}});
+        CHECK(!list.getAggregates(topic, 10, aggregates));
+
+        list.resizeHistory(2);
+        list.trackHistory({{topic, 10}});
+        CHECK(list.getAggregates(topic, 10, aggregates));
+        CHECK(aggregates._count == 0);
+        CHECK(!list.getAggregates(topic, 20, aggregates));
+
+        list.addMetric(topic, "asset-1", "metriclist.history", "%", 4.0, now, 300);
+        list.addMetric(topic, "asset-1", "metriclist.history", "%", 2.0, now + 2, 300);
+        list.addMetric(topic, "asset-1", "metriclist.history", "%", 6.0, now + 4, 300);
+        // the same sample again is ignored
+        list.addMetric(topic, "asset-1", "metriclist.history", "%", 6.0, now + 4, 300);
+        REQUIRE(list.getAggregates(topic, 10, aggregates));
+        CHECK(aggregates._count == 3);
+        CHECK(aggregates._mean == 4.0);
+        CHECK(aggregates._min == 2.0);
+        CHECK(aggregates._max == 6.0);
+        CHECK(aggregates._rate == 0.5);
+
+        // samples out of the window are dropped
+        list.addMetric(topic, "asset-1", "metriclist.history", "%", 3.0, now + 13, 300);
+        REQUIRE(list.getAggregates(topic, 10, aggregates));
+        CHECK(aggregates._count == 2);
+        CHECK(aggregates._min == 3.0);
+        CHECK(aggregates._max == 6.0);
+
+        double value = 0;
+        CHECK(aggregates.get("count", value));
+        CHECK(value == 2.0);
+        CHECK(!aggregates.get("median", value));
+
+        // arena is exhausted by the third ring, kept rings don't lose their samples
+        list.trackHistory({{topic, 10}, {topic, 20}, {topic, 30}});
+        CHECK(list.getAggregates(topic, 10, aggregates));
+        CHECK(aggregates._count == 2);
+        CHECK(list.getAggregates(topic, 20, aggregates));
+        CHECK(!list.getAggregates(topic, 30, aggregates));
+
+        // ring of the window not requested anymore is reused
+        list.trackHistory({{topic, 30}});
+        CHECK(!list.getAggregates(topic, 10, aggregates));
+        CHECK(list.getAggregates(topic, 30, aggregates));
+        CHECK(aggregates._count == 0);
+    }
+
+    SECTION("history capacity")
+    {
+        TopicId          topic = TopicTable::instance().intern("metriclist.capacity", "asset-1");
+        MetricAggregates aggregates;
+
+        list.resizeHistory(1);
+        list.trackHistory({{topic, 1000}});
+        for (uint64_t i = 0; i < MetricHistory::CAPACITY + 10; ++i) {
+            list.addMetric(topic, "asset-1", "metriclist.capacity", "%", static_cast<double>(i), now + i, 300);
+        }
+        REQUIRE(list.getAggregates(topic, 1000, aggregates));
+        CHECK(aggregates._count == MetricHistory::CAPACITY);
+        CHECK(aggregates._min == 10.0);
+        CHECK(aggregates._max == static_cast<double>(MetricHistory::CAPACITY + 9));
+        CHECK(aggregates._rate == 1.0);
+    }
+
+    SECTION("history of values not finite")
+    {
+        TopicId          topic = TopicTable::instance().intern("metriclist.finite", "asset-1");
+        MetricAggregates aggregates;
+
+        list.resizeHistory(1);
+        list.trackHistory({{topic, 1000}});
+        list.addMetric(topic, "asset-1", "metriclist.finite", "%", 4.0, now, 300);
+        list.addMetric(topic, "asset-1", "metriclist.finite", "%", NAN, now + 1, 300);
+        list.addMetric(topic, "asset-1", "metriclist.finite", "%", INFINITY, now + 2, 300);
+        list.addMetric(topic, "asset-1", "metriclist.finite", "%", 2.0, now + 3, 300);
+        // such samples are skipped, they don't spoil the aggregates of the next ones
+        REQUIRE(list.getAggregates(topic, 1000, aggregates));
+        CHECK(aggregates._count == 2);
+        CHECK(aggregates._mean == 3.0);
+        CHECK(aggregates._min == 2.0);
+        CHECK(aggregates._max == 4.0);
+
+        for (uint64_t i = 0; i < MetricHistory::CAPACITY; ++i) {
+            list.addMetric(topic, "asset-1", "metriclist.finite", "%", -INFINITY, now + 4 + 2 * i, 300);
+            list.addMetric(topic, "asset-1", "metriclist.finite", "%", 1.0, now + 5 + 2 * i, 300);
+        }
+        REQUIRE(list.getAggregates(topic, 1000, aggregates));
+        CHECK(aggregates._count == MetricHistory::CAPACITY);
+        CHECK(aggregates._mean == 1.0);
+        CHECK(aggregates._min == 1.0);
+        CHECK(aggregates._max == 1.0);
+    }
+}
+
+TEST_CASE("topic table test")
+{
+    TopicTable& table = TopicTable::instance();
+
+    // names stay valid and readable while other threads add topics over several chunks
+    const size_t             topics = 5000;
+    std::vector<std::thread> threads;
+    std::atomic<size_t>      mismatches{0};
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            for (size_t i = 0; i < topics; ++i) {
+                std::string topic = "topictable.metric" + std::to_string(i) + "@asset-1";
+                TopicId     id    = table.intern(topic);
+                if (table.name(id) != topic || table.find(topic) != id) {
+                    mismatches++;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    CHECK(mismatches == 0);
+    CHECK(table.size() >= topics);
+
+    TopicId first = table.find("topictable.metric0@asset-1");
+    TopicId last  = table.find("topictable.metric" + std::to_string(topics - 1) + "@asset-1");
+    CHECK(first != TOPIC_NONE);
+    CHECK(last != TOPIC_NONE);
+    CHECK(table.name(first) == "topictable.metric0@asset-1");
+    CHECK(table.intern("topictable.metric0", "asset-1") == first);
+
+    CHECK(table.find("topictable.unknown@asset-1") == TOPIC_NONE);
+    CHECK(table.name(TOPIC_NONE).empty());
+    CHECK(table.name(static_cast<TopicId>(table.size())).empty());
+}
+
+// Gets resident memory of the process [KiB]
+static long s_rss(void)
+{
+    long          size = 0, resident = 0;
+    std::ifstream f("/proc/self/statm");
+    f >> size >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Gets time of one lookup [ns]
+template <typename Find>
+static double s_lookup(size_t lookups, Find find)
+{
+    double sum   = 0;
+    auto   start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        sum += find(i);
+    }
+    auto duration = std::chrono::steady_clock::now() - start;
+    CHECK(!std::isnan(sum));
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()) / double(lookups);
+}
+
+// run explicitly: ./fty-alert-engine-test "metriclist benchmark"
+TEST_CASE("metriclist benchmark", "[.]")
+{
+    uint64_t     now     = static_cast<uint64_t>(::time(NULL));
+    const size_t lookups = 1000000;
+    for (size_t count : {10000, 100000, 1000000}) {
+        std::vector<std::string> elements;
+        for (size_t i = 0; i < count; ++i) {
+            elements.push_back("asset-" + std::to_string(i));
+        }
+        // lookups in random order, as rules read their inputs
+        std::mt19937        random(42);
+        std::vector<size_t> order(lookups);
+        for (auto& index : order) {
+            index = random() % count;
+        }
+
+        // structure of arrays keyed by topic id (topics are interned on the way)
+        malloc_trim(0);
+        long       rss = s_rss();
+        MetricList list;
+        for (size_t i = 0; i < count; ++i) {
+            list.addMetric(MetricInfo(elements[i], "metriclist.bench", "%", double(i), now, "", 300));
+        }
+        long                 listRss = s_rss() - rss;
+        std::vector<TopicId> topics;
+        for (size_t index : order) {
+            topics.push_back(TopicTable::instance().find("metriclist.bench@" + elements[index]));
+        }
+        double listTime = s_lookup(lookups, [&](size_t i) {
+            return list.find(topics[i]);
+        });
+
+        // map of the metrics by topic, as MetricList used to be
+        rss = s_rss();
+        std::map<std::string, MetricInfo> map;
+        for (size_t i = 0; i < count; ++i) {
+            MetricInfo metric(elements[i], "metriclist.bench", "%", double(i), now, "", 300);
+            map.emplace(metric.generateTopic(), metric);
+        }
+        long                     mapRss = s_rss() - rss;
+        std::vector<std::string> names;
+        for (size_t index : order) {
+            names.push_back("metriclist.bench@" + elements[index]);
+        }
+        double mapTime = s_lookup(lookups, [&](size_t i) {
+            return map.find(names[i])->second.getValue();
+        });
+
+        log_info("%zu metrics: list %.1f ns per find, %ld KiB; map %.1f ns per find, %ld KiB", count, listTime,
+            listRss, mapTime, mapRss);
+    }
+}
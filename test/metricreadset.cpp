@@ -0,0 +1,136 @@
+#include "src/alertconfiguration.h"
+#include "src/metricreadset.h"
+#include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include <fty_log.h>
+#include <fty_shm.h>
+#include <set>
+#include <sstream>
+
+// Gets topics of metrics read by the set
+static std::set<std::string> s_read(const MetricReadSet& readSet)
+{
+    fty::shm::shmMetrics  result;
+    std::set<std::string> topics;
+    readSet.read(result);
+    for (auto& metric : result) {
+        topics.insert(std::string(fty_proto_type(metric)) + "@" + fty_proto_name(metric));
+    }
+    return topics;
+}
+
+TEST_CASE("metric read set test")
+{
+    setenv("BIOS_LOG_PATTERN", "%D %c [%t] -%-5p- %M (%l) %m%n", 1);
+    ManageFtyLog::setInstanceFtylog("fty-alert-metric-read-set");
+
+    const std::string shm = (std::filesystem::temp_directory_path() / "fty-alert-engine-read-set").native();
+    std::filesystem::remove_all(shm);
+    std::filesystem::create_directories(shm);
+    REQUIRE(fty_shm_set_test_dir(shm.c_str()) == 0);
+
+    REQUIRE(fty::shm::write_metric("ups-1", "load.default", "20", "%", 300) == 0);
+    REQUIRE(fty::shm::write_metric("ups-2", "load.default", "30", "%", 300) == 0);
+    REQUIRE(fty::shm::write_metric("ups-1", "end_warranty_date", "100", "day", 300) == 0);
+    REQUIRE(fty::shm::write_metric("ups-2", "end_warranty_date", "5", "day", 300) == 0);
+    REQUIRE(fty::shm::write_metric("ups-1", "realpower.default", "400", "W", 300) == 0);
+
+    SECTION("exact topics")
+    {
+        MetricReadSet readSet;
+        readSet.update({"load.default@ups-1", "noelement", "missing.metric@ups-1"}, {});
+        // topic without element is ignored
+        CHECK(readSet.size() == 2);
+        CHECK(s_read(readSet) == std::set<std::string>{"load.default@ups-1"});
+        CHECK(readSet.matches("load.default@ups-1"));
+        CHECK(readSet.matches("missing.metric@ups-1"));
+        CHECK_FALSE(readSet.matches("load.default@ups-2"));
+        CHECK_FALSE(readSet.matches("realpower.default@ups-1"));
+    }
+
+    SECTION("pattern families")
+    {
+        MetricReadSet readSet;
+        readSet.update({}, {"^end_warranty_date@.+"});
+        CHECK(readSet.size() == 0);
+        CHECK(s_read(readSet) == std::set<std::string>{"end_warranty_date@ups-1", "end_warranty_date@ups-2"});
+        CHECK(readSet.matches("end_warranty_date@ups-3"));
+        CHECK_FALSE(readSet.matches("load.default@ups-1"));
+
+        // metric part which can't be isolated reads every metric and filters them by the whole pattern
+        readSet.update({"load.default@ups-1"}, {"^(load.default|end_warranty_date)@ups-2$", "[invalid"});
+        CHECK(s_read(readSet) ==
+              std::set<std::string>{"load.default@ups-1", "load.default@ups-2", "end_warranty_date@ups-2"});
+        CHECK(readSet.matches("end_warranty_date@ups-2"));
+        CHECK_FALSE(readSet.matches("end_warranty_date@ups-1"));
+    }
+
+    SECTION("same matching as pattern rules")
+    {
+        // every shipped pattern rule reads exactly the metrics it consumes
+        for (const char* path : {"src/warranty.rule", "test/testrules/pattern.rule"}) {
+            INFO(path);
+            std::ifstream f(path);
+            RulePtr       rule;
+            REQUIRE(readRule(f, rule) == 0);
+            REQUIRE(rule->whoami() == "pattern");
+
+            MetricReadSet readSet;
+            readSet.update({}, rule->getNeededTopics());
+            for (const char* topic : {"end_warranty_date@ups-1", "end_warranty_date@", "end_warranty_date@a@b",
+                     "xend_warranty_date@ups-1", "end_warranty_dateX@ups-1", "End_warranty_date@ups-1",
+                     "load.default@ups-1", "end_warranty_date"}) {
+                INFO(topic);
+                CHECK(readSet.matches(topic) == rule->isTopicInteresting(topic));
+            }
+        }
+    }
+
+    SECTION("generation of rules")
+    {
+        const std::string dir = (std::filesystem::temp_directory_path() / "fty-alert-engine-read-set-rules").native();
+        std::filesystem::remove_all(dir);
+        AlertConfiguration config(dir);
+        config.readConfiguration();
+
+        MetricReadSet readSet;
+        CHECK(readSet.update(config));
+        CHECK(s_read(readSet).empty());
+        // nothing changed, nothing rebuilt
+        CHECK_FALSE(readSet.update(config));
+
+        std::set<std::string>        topics;
+        std::vector<PureAlert>       alertsToSend;
+        AlertConfiguration::iterator it;
+        {
+            std::istringstream f(
+                "{\"threshold\": {\"rule_name\": \"load@ups-2\", \"target\": \"load.default@ups-2\", "
+                "\"element\": \"ups-2\", \"values\": [{\"high_warning\": \"80\"}], \"results\": [{\"high_warning\": "
+                "{\"action\": [], \"severity\": \"WARNING\", \"description\": \"high\"}}]}}");
+            REQUIRE(config.addRule(f, topics, alertsToSend, it) == 0);
+        }
+        // topic of the new rule is read, once its generation is seen
+        CHECK(readSet.update(config));
+        CHECK(readSet.matches("load.default@ups-2"));
+        CHECK(s_read(readSet) == std::set<std::string>{"load.default@ups-2"});
+        CHECK_FALSE(readSet.update(config));
+
+        {
+            std::ifstream f("test/testrules/pattern.rule");
+            REQUIRE(config.addRule(f, topics, alertsToSend, it) == 0);
+        }
+        CHECK(readSet.update(config));
+        CHECK(s_read(readSet) ==
+              std::set<std::string>{"load.default@ups-2", "end_warranty_date@ups-1", "end_warranty_date@ups-2"});
+
+        std::map<std::string, std::vector<PureAlert>> deleted;
+        CHECK(config.deleteRule("load@ups-2", deleted) == 0);
+        CHECK(readSet.update(config));
+        CHECK_FALSE(readSet.matches("load.default@ups-2"));
+        std::filesystem::remove_all(dir);
+    }
+
+    fty_shm_delete_test_dir();
+    std::filesystem::remove_all(shm);
+}
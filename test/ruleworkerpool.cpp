@@ -0,0 +1,188 @@
+#include "src/alertconfiguration.h"
+#include "src/luarule.h"
+#include "src/ruleworkerpool.h"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <fty_log.h>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+// Single Lua rule with one input
+static RulePtr s_luaRule(const std::string& name, const std::string& code)
+{
+    std::istringstream f("{\"single\": {\"rule_name\": \"" + name + "\", \"target\": [\"v@" + name +
+                         "\"], \"element\": \"" + name + "\", \"values\": [{\"limit\": \"10\"}], \"results\": [], "
+                         "\"evaluation\": \"" + code + "\"}}");
+    RulePtr rule;
+    readRule(f, rule);
+    return rule;
+}
+
+TEST_CASE("rule worker pool test")
+{
+    RuleWorkerPool pool(4);
+    REQUIRE(pool.size() == 4);
+
+    SECTION("sharding")
+    {
+        std::vector<size_t> shards;
+        for (size_t i = 0; i < 100; ++i) {
+            size_t shard = pool.shard("rule-" + std::to_string(i));
+            CHECK(shard < 4);
+            shards.push_back(shard);
+        }
+        // shard depends only on the name and the number of workers
+        RuleWorkerPool other(4);
+        for (size_t i = 0; i < 100; ++i) {
+            CHECK(other.shard("rule-" + std::to_string(i)) == shards[i]);
+        }
+        pool.resize(1);
+        CHECK(pool.size() == 1);
+        CHECK(pool.shard("rule-1") == 0);
+        pool.resize(0);
+        CHECK(pool.size() == 1);
+    }
+
+    SECTION("jobs")
+    {
+        // every job runs once per round, each in its own thread
+        for (size_t workers : {1, 4}) {
+            pool.resize(workers);
+            std::vector<int>                 results(workers, 0);
+            std::vector<std::thread::id>     threads(workers);
+            std::vector<RuleWorkerPool::Job> jobs(workers);
+            for (size_t i = 0; i < workers; ++i) {
+                jobs[i] = [&, i]() {
+                    results[i]++;
+                    threads[i] = std::this_thread::get_id();
+                };
+            }
+            for (int round = 0; round < 10; ++round) {
+                pool.run(jobs);
+            }
+            CHECK(results == std::vector<int>(workers, 10));
+            // the caller runs the first shard
+            CHECK(threads[0] == std::this_thread::get_id());
+            for (size_t i = 1; i < workers; ++i) {
+                CHECK(threads[i] != threads[0]);
+            }
+        }
+
+        // empty jobs and missing ones are skipped
+        std::atomic<int>                 count{0};
+        std::vector<RuleWorkerPool::Job> jobs(2);
+        jobs[1] = [&]() {
+            count++;
+        };
+        pool.run(jobs);
+        CHECK(count == 1);
+    }
+
+    SECTION("exceptions")
+    {
+        for (size_t workers : {1, 4}) {
+            pool.resize(workers);
+            std::atomic<int>                 count{0};
+            std::vector<RuleWorkerPool::Job> jobs(workers, [&]() {
+                count++;
+            });
+            // anything thrown by the last shard reaches the caller, other jobs still run
+            jobs[workers - 1] = [&]() {
+                count++;
+                throw 42;
+            };
+            CHECK_THROWS_AS(pool.run(jobs), int);
+            CHECK(count == int(workers));
+
+            jobs[0] = [&]() {
+                throw std::runtime_error("first");
+            };
+            CHECK_THROWS_AS(pool.run(jobs), std::runtime_error);
+
+            // pool is usable after a failed round
+            jobs.assign(workers, [&]() {
+                count++;
+            });
+            count = 0;
+            CHECK_NOTHROW(pool.run(jobs));
+            CHECK(count == int(workers));
+        }
+    }
+
+    SECTION("bindings of stopped workers")
+    {
+        bool shared = LuaRule::sharedVm();
+        LuaRule::sharedVm(true);
+        RulePtr  rule =
+            s_luaRule("pool", "function main(v1) if v1 > limit then return HIGH_CRITICAL end return OK end");
+        LuaRule* luaRule = dynamic_cast<LuaRule*>(rule.get());
+        REQUIRE(luaRule);
+        size_t states = LuaVm::all().size();
+
+        pool.resize(2);
+        std::vector<RuleWorkerPool::Job> jobs(2);
+        jobs[1] = [&]() {
+            luaRule->callMain({20});
+        };
+        pool.run(jobs);
+        CHECK(LuaVm::all().size() == states + 1);
+
+        // state of the stopped worker is held by the rule until it is released
+        pool.resize(1);
+        CHECK(LuaVm::all().size() == states + 1);
+        luaRule->releaseBindings();
+        CHECK(LuaVm::all().size() == states);
+        CHECK(luaRule->memory() == 0);
+        CHECK(std::string(Rule::resultToString(int(luaRule->callMain({20})))) == "high_critical");
+        LuaRule::sharedVm(shared);
+    }
+}
+
+// run explicitly: ./fty-alert-engine-test "rule worker pool benchmark"
+TEST_CASE("rule worker pool benchmark", "[.]")
+{
+    bool shared = LuaRule::sharedVm();
+    LuaRule::sharedVm(true);
+    std::vector<RulePtr> rules;
+    for (size_t i = 0; i < 1000; ++i) {
+        rules.push_back(s_luaRule("rule-" + std::to_string(i),
+            "function main(v1) local x = 0; for i = 1, 100 do x = x + math.sin(v1 + i) end if x > limit then "
+            "return HIGH_CRITICAL end return OK end"));
+        REQUIRE(rules.back());
+    }
+
+    const size_t rounds = 20;
+    for (size_t workers : {1, 2, 4, 8}) {
+        RuleWorkerPool                     pool(workers);
+        std::vector<std::vector<LuaRule*>> shards(workers);
+        for (const auto& rule : rules) {
+            shards[pool.shard(rule->name())].push_back(dynamic_cast<LuaRule*>(rule.get()));
+        }
+        std::vector<double>              sums(workers, 0);
+        std::vector<RuleWorkerPool::Job> jobs(workers);
+        for (size_t shard = 0; shard < workers; ++shard) {
+            jobs[shard] = [&, shard]() {
+                for (LuaRule* rule : shards[shard]) {
+                    sums[shard] += rule->callMain({double(shard)});
+                }
+            };
+        }
+        // the first round binds the code in the states of the workers
+        pool.run(jobs);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round) {
+            pool.run(jobs);
+        }
+        auto duration = std::chrono::steady_clock::now() - start;
+        log_info("%zu workers: %.1f us per round of %zu rules", workers,
+            double(std::chrono::duration_cast<std::chrono::microseconds>(duration).count()) / double(rounds),
+            rules.size());
+        // workers stop with the pool, their states are freed with the last binding
+        for (const auto& rule : rules) {
+            dynamic_cast<LuaRule*>(rule.get())->releaseBindings();
+        }
+    }
+    LuaRule::sharedVm(shared);
+}
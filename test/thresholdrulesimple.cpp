@@ -0,0 +1,163 @@
+#include "src/alertconfiguration.h"
+#include "src/metriclist.h"
+#include "src/thresholdrulesimple.h"
+#include <catch2/catch.hpp>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+// Simple threshold rule of the element with the thresholds and optional other members
+static std::unique_ptr<Rule> s_simpleRule(
+    const std::string& element, const std::map<std::string, double>& values, const std::string& extra = "")
+{
+    std::string json = "{\"threshold\": {\"rule_name\": \"simple@" + element + "\", \"target\": \"simple.load@" +
+                       element + "\", \"element\": \"" + element + "\", \"values\": [";
+    std::string results;
+    for (const auto& it : values) {
+        json += std::string(results.empty() ? "" : ", ") + "{\"" + it.first + "\": \"" + std::to_string(it.second) +
+                "\"}";
+        results += std::string(results.empty() ? "" : ", ") + "{\"" + it.first +
+                   "\": {\"action\": [], \"severity\": \"" + it.first + "\", \"description\": \"" + it.first +
+                   " of " + element + "\"}}";
+    }
+    json += "], \"results\": [" + results + "]" + extra + "}}";
+    std::istringstream    f(json);
+    std::unique_ptr<Rule> rule;
+    readRule(f, rule);
+    return rule;
+}
+
+TEST_CASE("threshold rule simple test")
+{
+    uint64_t   now = static_cast<uint64_t>(::time(NULL));
+    MetricList list;
+
+    SECTION("bands")
+    {
+        std::unique_ptr<Rule> rule;
+        std::ifstream         f("test/testrules/simplethreshold.rule");
+        REQUIRE(readRule(f, rule) == 0);
+        REQUIRE(dynamic_cast<ThresholdRuleSimple*>(rule.get()));
+
+        // low_critical 30, low_warning 40, high_warning 50, high_critical 60
+        const std::vector<std::pair<double, std::string>> expected = {{0, "low_critical"}, {30, "low_warning"},
+            {35, "low_warning"}, {40, ""}, {45, ""}, {50, ""}, {55, "high_warning"}, {60, "high_warning"},
+            {61, "high_critical"}};
+        for (const auto& it : expected) {
+            MetricInfo metric("fff", "abc", "", it.first, now, "", 300);
+            list.addMetric(metric);
+            PureAlert alert;
+            CHECK(rule->evaluate(list, metric.getTopicId(), alert) == 0);
+            if (it.second.empty()) {
+                CHECK(alert._status == ALERT_RESOLVED);
+            } else {
+                CHECK(alert._status == ALERT_START);
+                CHECK(alert._description == rule->_outcomes[it.second]._description);
+            }
+        }
+
+        // thresholds follow the variables
+        rule->globalVariables({{"high_critical", 100}});
+        MetricInfo metric("fff", "abc", "", 0, now, "", 300);
+        list.addMetric(metric);
+        PureAlert alert;
+        CHECK(rule->evaluate(list, metric.getTopicId(), alert) == 0);
+        CHECK(alert._status == ALERT_RESOLVED);
+    }
+
+    SECTION("batch")
+    {
+        // rules with all, some and no thresholds
+        const std::vector<std::map<std::string, double>> bands = {
+            {{"low_critical", 10}, {"low_warning", 20}, {"high_warning", 80}, {"high_critical", 90}},
+            {{"high_warning", 80}, {"high_critical", 90}}, {{"low_critical", 10}}, {}};
+        const std::vector<double> values = {-5, 10, 15, 20, 50, 80, 85, 95, NAN};
+
+        std::vector<std::unique_ptr<Rule>> owners;
+        std::vector<ThresholdRuleSimple*>  rules;
+        std::vector<MetricInfo>            metrics;
+        for (size_t i = 0; i < bands.size() * values.size(); ++i) {
+            std::string element = "asset-" + std::to_string(i);
+            owners.push_back(s_simpleRule(element, bands[i % bands.size()]));
+            rules.push_back(dynamic_cast<ThresholdRuleSimple*>(owners.back().get()));
+            REQUIRE(rules.back());
+            metrics.emplace_back(element, "simple.load", "", values[i / bands.size()], now, "", 300);
+            // the last metric is expired
+            if (i + 1 < bands.size() * values.size()) {
+                list.addMetric(metrics.back());
+            }
+        }
+        std::vector<TopicId> triggers;
+        for (const auto& metric : metrics) {
+            triggers.push_back(metric.getTopicId());
+        }
+
+        std::vector<PureAlert> alerts;
+        std::vector<int>       results;
+        ThresholdRuleSimple::evaluateBatch(rules, triggers, list, alerts, results);
+        REQUIRE(alerts.size() == rules.size());
+        REQUIRE(results.size() == rules.size());
+        for (size_t i = 0; i < rules.size(); ++i) {
+            PureAlert alert;
+            CHECK(results[i] == rules[i]->evaluate(list, metrics[i].getTopicId(), alert));
+            CHECK(alerts[i]._status == alert._status);
+            CHECK(alerts[i]._severity == alert._severity);
+            CHECK(alerts[i]._description == alert._description);
+            CHECK(alerts[i]._element == alert._element);
+        }
+        CHECK(results.back() == RULE_RESULT_UNKNOWN);
+    }
+
+    SECTION("hysteresis")
+    {
+        std::unique_ptr<Rule> rule =
+            s_simpleRule("asset-h", {{"high_warning", 80}, {"high_critical", 90}}, ", \"hysteresis\": 5");
+        REQUIRE(rule);
+        // value -> severity, the thresholds crossed before are left at 5 below them
+        const std::vector<std::pair<double, std::string>> expected = {{79, ""}, {81, "high_warning"},
+            {78, "high_warning"}, {76, "high_warning"}, {74, ""}, {95, "high_critical"}, {87, "high_critical"},
+            {84, "high_warning"}, {70, ""}};
+        for (const auto& it : expected) {
+            MetricInfo metric("asset-h", "simple.load", "", it.first, now, "", 300);
+            list.addMetric(metric);
+            PureAlert alert;
+            INFO(it.first);
+            CHECK(rule->evaluate(list, metric.getTopicId(), alert) == 0);
+            CHECK(alert._severity == it.second);
+        }
+        // held from 78 to 76 and at 87, every suppressed transition is counted once
+        CHECK(rule->debounce().suppressed() == 2);
+    }
+
+    SECTION("debounce")
+    {
+        AlertConfiguration ac;
+        AlertConfiguration::B entry;
+        entry.first = s_simpleRule("asset-d", {{"high_warning", 80}}, ", \"debounce\": {\"count\": 3, \"time\": 10}");
+        REQUIRE(entry.first);
+        CHECK(entry.first->debounce().isEnabled());
+
+        auto update = [&](double value, uint64_t timestamp) {
+            MetricInfo metric("asset-d", "simple.load", "", value, timestamp, "", 300);
+            list.addMetric(metric);
+            PureAlert pureAlert, toSend;
+            REQUIRE(entry.first->evaluate(list, metric.getTopicId(), pureAlert) == 0);
+            return ac.updateAlert(entry, pureAlert, toSend) == 0;
+        };
+        // the first resolved alert is not a transition
+        CHECK(update(50, now));
+        // flapping is not sent
+        CHECK(!update(85, now + 1));
+        CHECK(!update(50, now + 2));
+        CHECK(!update(85, now + 3));
+        CHECK(!update(85, now + 4));
+        // 3 evaluations, but not 10 s yet
+        CHECK(!update(85, now + 5));
+        CHECK(update(85, now + 13));
+        CHECK(entry.second.size() == 1);
+        CHECK(entry.second[0]._status == ALERT_START);
+        // two transitions were held back (the first one was cancelled by the flap back)
+        CHECK(entry.first->debounce().suppressed() == 2);
+    }
+}